@@ -0,0 +1,287 @@
+/**
+ *
+ * artifact.cpp
+ * Build artifacts: the built tree as a file that can be mapped and pruned.
+ *
+ * Layout: a 64-byte header, then the nodes (quadtree::ArtifactNode) in
+ * pre-order (NW, NE, SE, SW), in the byte order of the machine:
+ *   "QTA" magic, version byte
+ *   0x01020304 (4 bytes), to tell the byte order
+ *   edge of the image (4 bytes)
+ *   number of nodes (8 bytes)
+ *   name of the class that wrote it, zero padded (32 bytes)
+ *   zero padding (12 bytes)
+ *
+ */
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <typeinfo>
+#include "compression/MappedFile.h"
+#include "quadtree.h"
+#include "trace.h"
+using namespace std;
+
+namespace {
+const char QTA_MAGIC[4] = {'Q', 'T', 'A', 1};
+const uint32_t QTA_BYTE_ORDER = 0x01020304;
+const size_t QTA_HEADER_SIZE = 64;
+const size_t QTA_CLASS_SIZE = 32;
+
+struct ArtifactHeader {
+  char magic[4];
+  uint32_t byteOrder;
+  uint32_t edge;
+  uint32_t padding;
+  uint64_t numNodes;
+  char className[QTA_CLASS_SIZE];
+  char reserved[8];
+};
+static_assert(sizeof(ArtifactHeader) == QTA_HEADER_SIZE, "header layout");
+}
+
+// Checks the records of the subtree at index, which must end by end: a
+// record of more than one is followed by four children of one dim less,
+// whose subtrees fill it exactly. The depth is bounded by the root's dim.
+bool quadtree::validArtifact(const ArtifactNode *nodes, size_t index,
+                             size_t end) {
+  const ArtifactNode &node = nodes[index];
+  if (node.size < 1 || node.size > end - index)
+    return false;
+  if (node.size == 1)
+    return true;
+  if (node.dim == 0)
+    return false;
+  end = index + node.size;
+  size_t child = index + 1;
+  for (int i = 0; i < 4; i++) {
+    if (child >= end || nodes[child].dim != node.dim - 1 ||
+        !validArtifact(nodes, child, end))
+      return false;
+    child += nodes[child].size;
+  }
+  return child == end;
+}
+
+int64_t quadtree::pruneTolerance(Node *node) const {
+  // the smallest tol in [INT_MIN, INT_MAX + 1] for which node is prunable
+  int64_t low = INT_MIN;
+  int64_t high = (int64_t)INT_MAX + 1;
+  while (low < high) {
+    int64_t mid = low + (high - low) / 2;
+    if (prunable(node, mid))
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  return low;
+}
+
+bool quadtree::writeArtifact(const string &fileName) const {
+  QTC_PHASE(PHASE_ENCODE);
+  TraceSpan span("encode");
+  vector<ArtifactNode> nodes;
+  writeArtifactHelper(root, nodes);
+
+  ArtifactHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QTA_MAGIC, 4);
+  header.byteOrder = QTA_BYTE_ORDER;
+  header.edge = root == NULL ? 0 : edge;
+  header.numNodes = nodes.size();
+  strncpy(header.className, typeid(*this).name(), QTA_CLASS_SIZE - 1);
+
+  ofstream out(fileName.c_str(), ios::binary);
+  out.write((const char *)&header, sizeof(header));
+  out.write((const char *)nodes.data(), nodes.size() * sizeof(ArtifactNode));
+  out.close();
+  if (!out) {
+    cerr << "QTA error: could not write " << fileName << endl;
+    return false;
+  }
+  return true;
+}
+
+void quadtree::writeArtifactHelper(Node *node,
+                                   vector<ArtifactNode> &nodes) const {
+  if (node == NULL)
+    return;
+  size_t index = nodes.size();
+  ArtifactNode record;
+  memset(&record, 0, sizeof(record));
+  record.r = node->avg.r;
+  record.g = node->avg.g;
+  record.b = node->avg.b;
+  record.dim = node->dim;
+  record.var = node->var;
+  record.minTol = pruneTolerance(node);
+  nodes.push_back(record);
+  // pixel leaves are written as the nodes they stand for
+  if (node->packed) {
+    for (int i = 0; i < 4; i++) {
+      Node leaf(node->upLeft, 0, pixelOf(node, i), 0);
+      writeArtifactHelper(&leaf, nodes);
+    }
+  }
+  writeArtifactHelper(node->NW, nodes);
+  writeArtifactHelper(node->NE, nodes);
+  writeArtifactHelper(node->SE, nodes);
+  writeArtifactHelper(node->SW, nodes);
+  nodes[index].size = nodes.size() - index;
+}
+
+bool quadtree::openArtifact(const string &fileName) {
+  return mapArtifact(fileName, typeid(*this).name());
+}
+
+// className is passed in, since a copy constructor can not ask typeid
+bool quadtree::mapArtifact(const string &fileName, const char *className) {
+  compression::MappedFile *file = new compression::MappedFile(fileName, false);
+  ArtifactHeader header;
+  bool valid = !file->error() && file->size() >= QTA_HEADER_SIZE;
+  if (valid) {
+    memcpy(&header, file->data(), sizeof(header));
+    header.className[QTA_CLASS_SIZE - 1] = 0;
+    valid = memcmp(header.magic, QTA_MAGIC, 4) == 0 &&
+            header.byteOrder == QTA_BYTE_ORDER &&
+            (header.edge & (header.edge - 1)) == 0 &&
+            header.edge <= (1u << 30) &&
+            header.numNodes * sizeof(ArtifactNode) ==
+                file->size() - QTA_HEADER_SIZE &&
+            (header.numNodes > 0) == (header.edge > 0) &&
+            strncmp(header.className, className,
+                    QTA_CLASS_SIZE - 1) == 0;
+  }
+  // the root covers the image and the whole array
+  const ArtifactNode *nodes =
+      valid ? (const ArtifactNode *)(file->data() + QTA_HEADER_SIZE) : NULL;
+  if (valid && header.numNodes > 0)
+    valid = nodes[0].dim == log2(header.edge) &&
+            nodes[0].size == header.numNodes &&
+            validArtifact(nodes, 0, header.numNodes);
+  if (!valid) {
+    cerr << "QTA error: " << fileName << " is not an artifact of this tree"
+         << endl;
+    delete file;
+    return false;
+  }
+
+  clear();
+  edge = header.edge;
+  if (header.numNodes == 0) {
+    delete file;
+    return true;
+  }
+  artifact = file;
+  artifactNodes = nodes;
+  artifactFile = fileName;
+  return true;
+}
+
+void quadtree::closeArtifact() {
+  delete artifact;
+  artifact = NULL;
+  artifactNodes = NULL;
+  artifactFile.clear();
+}
+
+int quadtree::artifactPruneSize(size_t index, const int tol) const {
+  const ArtifactNode &node = artifactNodes[index];
+  if (node.minTol <= tol)
+    return 1;
+  if (node.size == 1)
+    return 0;
+  int leaves = 0;
+  size_t child = index + 1;
+  for (int i = 0; i < 4; i++) {
+    leaves += artifactPruneSize(child, tol);
+    child += artifactNodes[child].size;
+  }
+  return leaves;
+}
+
+double quadtree::artifactDistortion(size_t index, const int tol) const {
+  const ArtifactNode &node = artifactNodes[index];
+  if (node.minTol <= tol || node.size == 1)
+    return node.var;
+  double error = 0;
+  size_t child = index + 1;
+  for (int i = 0; i < 4; i++) {
+    error += artifactDistortion(child, tol);
+    child += artifactNodes[child].size;
+  }
+  return error;
+}
+
+void quadtree::artifactCutStats(size_t index, const int tol,
+                                const RGBAPixel &predicted, bool lastChild,
+                                CutStats &cut) const {
+  const ArtifactNode &node = artifactNodes[index];
+  RGBAPixel avg(node.r, node.g, node.b);
+  cut.count(avg, predicted, lastChild);
+  if (node.dim > 0)
+    cut.flags++;
+  if (node.minTol <= tol || node.size == 1) {
+    cut.leaves++;
+    cut.runs += (size_t)1 << node.dim;
+    return;
+  }
+  cut.splits++;
+  size_t children[4];
+  RGBAPixel avgs[4];
+  size_t child = index + 1;
+  for (int i = 0; i < 4; i++) {
+    children[i] = child;
+    avgs[i] = RGBAPixel(artifactNodes[child].r, artifactNodes[child].g,
+                        artifactNodes[child].b);
+    child += artifactNodes[child].size;
+  }
+  for (int i = 0; i < 4; i++) {
+    RGBAPixel childPredicted =
+        i == 3 ? CutStats::predictLast(avg, avgs[0], avgs[1], avgs[2]) : avg;
+    artifactCutStats(children[i], tol, childPredicted, i == 3, cut);
+  }
+}
+
+quadtree::Node *quadtree::artifactTree(size_t index, pair<int, int> ul,
+                                       const int tol) const {
+  const ArtifactNode &record = artifactNodes[index];
+  Node *node = new Node(ul, record.dim, RGBAPixel(record.r, record.g, record.b),
+                        record.var);
+  if (record.minTol <= tol || record.size == 1)
+    return node;
+  int num = 1 << (record.dim - 1);
+  pair<int, int> childUL[4] = {ul, make_pair(ul.first + num, ul.second),
+                               make_pair(ul.first + num, ul.second + num),
+                               make_pair(ul.first, ul.second + num)};
+  Node **children[4] = {&node->NW, &node->NE, &node->SE, &node->SW};
+  size_t child = index + 1;
+  for (int i = 0; i < 4; i++) {
+    *children[i] = artifactTree(child, childUL[i], tol);
+    child += artifactNodes[child].size;
+  }
+  return node;
+}
+
+void quadtree::renderArtifact(size_t index, PNG &img, int x, int y) const {
+  const ArtifactNode &node = artifactNodes[index];
+  int size = 1 << node.dim;
+  if (node.size == 1) {
+    RGBAPixel color(node.r, node.g, node.b);
+    for (int px = x; px < x + size; px++) {
+      for (int py = y; py < y + size; py++) {
+        *img.getPixel(px, py) = color;
+      }
+    }
+    return;
+  }
+  int half = size / 2;
+  size_t child = index + 1;
+  int childX[4] = {x, x + half, x + half, x};
+  int childY[4] = {y, y, y + half, y + half};
+  for (int i = 0; i < 4; i++) {
+    renderArtifact(child, img, childX[i], childY[i]);
+    child += artifactNodes[child].size;
+  }
+}
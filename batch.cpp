@@ -0,0 +1,396 @@
+/**
+ *
+ * batch.cpp
+ *
+ */
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include "batch.h"
+#include "cache.h"
+#include "compression/MappedFile.h"
+#include "compression/lodepng/lodepng.h"
+#include "qtcount.h"
+#include "qtvar.h"
+#include "threadpool.h"
+#include "trace.h"
+using namespace std;
+
+namespace {
+bool endsWith(const string &s, const string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// An image going through the pipeline.
+struct InFlight {
+  const BatchJob *job;
+  PNG *image;
+  quadtree *tree;
+  double megapixels;
+  unsigned int width, height;
+  size_t footprint; // estimated peak memory
+  TreeFootprint built; // of the tree as built, if footprints are printed
+  string cacheKey;  // key of the output in the cache, if there is one
+
+  InFlight(const BatchJob *job, size_t footprint)
+      : job(job), image(NULL), tree(NULL), megapixels(0), width(0),
+        height(0), footprint(footprint) {}
+  ~InFlight() {
+    delete image;
+    delete tree;
+  }
+};
+
+// the stages; later stages have higher priority, so that images leave the
+// pipeline before new ones enter it
+const int STAGE_DECODE = 0;
+const int STAGE_PRUNE = 1;
+const int STAGE_WRITE = 2;
+
+class Pipeline {
+public:
+  Pipeline(const vector<BatchJob> &jobs, unsigned int numThreads,
+           size_t memoryBudget, ResultCache *cache, bool footprints)
+      : jobs(jobs), cache(cache), footprints(footprints), pool(numThreads),
+        next(0), nextFootprint(0), nextEstimated(false), estimating(false),
+        inFlight(0),
+        maxInFlight(2 * pool.size()), memoryBudget(memoryBudget),
+        memoryUsed(0) {}
+
+  BatchStats run() {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    admit();
+    pool.wait();
+    totals.seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                              start).count();
+    return totals;
+  }
+
+private:
+  const vector<BatchJob> &jobs;
+  ResultCache *cache;
+  bool footprints;
+  ThreadPool pool;
+  mutex lock; // guards the members below
+  size_t next;
+  size_t nextFootprint; // of jobs[next], once estimated
+  bool nextEstimated;
+  bool estimating; // a thread is reading the header of jobs[next]
+  size_t inFlight;
+  size_t maxInFlight;
+  size_t memoryBudget;
+  size_t memoryUsed; // estimated footprints of the images in flight
+  BatchStats totals;
+
+  // starts as many jobs as the in-flight limit and the memory budget allow
+  void admit() {
+    unique_lock<mutex> guard(lock);
+    while (next < jobs.size() && inFlight < maxInFlight) {
+      if (!nextEstimated) {
+        // the header is read without the lock, so finishing jobs do not wait
+        // on the file; whoever is reading it re-checks the limits after
+        if (estimating)
+          return;
+        estimating = true;
+        const string &input = jobs[next].input;
+        guard.unlock();
+        size_t footprint = estimateFootprint(input);
+        guard.lock();
+        estimating = false;
+        nextFootprint = footprint;
+        nextEstimated = true;
+        continue;
+      }
+      // the jobs after the next one wait as well, so it is not starved
+      if (memoryBudget > 0 && inFlight > 0 &&
+          memoryUsed + nextFootprint > memoryBudget)
+        break;
+      InFlight *item = new InFlight(&jobs[next++], nextFootprint);
+      nextEstimated = false;
+      inFlight++;
+      memoryUsed += item->footprint;
+      totals.peakMemory = max(totals.peakMemory, memoryUsed);
+      pool.submit([this, item]() { decode(item); }, STAGE_DECODE);
+    }
+  }
+
+  void finish(InFlight *item, bool ok) {
+    {
+      lock_guard<mutex> guard(lock);
+      if (ok) {
+        totals.images++;
+        totals.megapixels += item->megapixels;
+      } else {
+        totals.failed++;
+      }
+      inFlight--;
+      memoryUsed -= item->footprint;
+    }
+    delete item;
+    admit();
+  }
+
+  void decode(InFlight *item) {
+    TraceImage traced(item->job->input);
+    MappedFile input(item->job->input);
+    if (cache != NULL && !input.error()) {
+      item->cacheKey =
+          ResultCache::key(input.data(), input.size(), *item->job,
+                           !endsWith(item->job->output, ".qtc"));
+      vector<unsigned char> cached;
+      if (cache->get(item->cacheKey, cached)) {
+        // no decode, build or prune; the size is read from the header
+        unsigned int width = 0, height = 0;
+        LodePNGState state;
+        lodepng_state_init(&state);
+        lodepng_inspect(&width, &height, &state, input.data(), input.size());
+        lodepng_state_cleanup(&state);
+        item->width = width;
+        item->height = height;
+        TraceImage::setSize(width, height);
+        item->megapixels = width * (double)height / 1e6;
+        save(item, cached);
+        return;
+      }
+    }
+    item->image = new PNG();
+    if (input.error() ||
+        !item->image->readFromMemory(input.data(), input.size())) {
+      cerr << "batch: can not read " << item->job->input << endl;
+      finish(item, false);
+      return;
+    }
+    item->width = item->image->width();
+    item->height = item->image->height();
+    TraceImage::setSize(item->width, item->height);
+    item->megapixels = item->width * (double)item->height / 1e6;
+    pool.submit([this, item]() { prune(item); }, STAGE_PRUNE);
+  }
+
+  void prune(InFlight *item) {
+    TraceImage traced(item->job->input, item->width, item->height);
+    item->tree = compressImage(*item->image, *item->job,
+                               !endsWith(item->job->output, ".qtc"),
+                               footprints ? &item->built : NULL);
+    delete item->image;
+    item->image = NULL;
+    pool.submit([this, item]() { write(item); }, STAGE_WRITE);
+  }
+
+  void write(InFlight *item) {
+    TraceImage traced(item->job->input, item->width, item->height);
+    if (footprints) {
+      TreeFootprint pruned = item->tree->footprint();
+      lock_guard<mutex> guard(lock);
+      printFootprint(cout, item->job->input, item->width, item->height,
+                     item->built, pruned);
+    }
+    vector<unsigned char> out;
+    bool ok = true;
+    if (endsWith(item->job->output, ".qtc"))
+      item->tree->encodeQtc(out);
+    else
+      ok = item->tree->render().writeToMemory(out);
+    if (ok && cache != NULL)
+      cache->put(item->cacheKey, out);
+    if (!ok) {
+      cerr << "batch: can not encode " << item->job->output << endl;
+      finish(item, false);
+      return;
+    }
+    save(item, out);
+  }
+
+  void save(InFlight *item, const vector<unsigned char> &out) {
+    bool ok;
+    {
+      TraceSpan span("save");
+      ok = lodepng::save_file(out, item->job->output) == 0;
+    }
+    if (!ok)
+      cerr << "batch: can not write " << item->job->output << endl;
+    finish(item, ok);
+  }
+};
+}
+
+bool parseJobSetting(const string &setting, BatchJob &job) {
+  size_t eq = setting.find('=');
+  if (eq == string::npos)
+    return false;
+  string key = setting.substr(0, eq);
+  string value = setting.substr(eq + 1);
+  if (key == "policy") {
+    if (value != "var" && value != "count")
+      return false;
+    job.var = value == "var";
+    return true;
+  }
+  istringstream in(value);
+  long number;
+  if (!(in >> number) || !in.eof() || number < 0)
+    return false;
+  if (key == "bytes") {
+    job.bytes = number;
+    return true;
+  }
+  if (number > INT_MAX)
+    return false;
+  if (key == "tol")
+    job.tol = number;
+  else if (key == "leaves")
+    job.leaves = number;
+  else
+    return false;
+  return true;
+}
+
+quadtree *compressImage(PNG &image, const BatchJob &job, bool png,
+                        TreeFootprint *built) {
+  quadtree *tree;
+  // a tolerance known up front is a floor for a qtvar build (see
+  // quadtree::build)
+  if (job.var && job.leaves == 0 && job.bytes == 0)
+    tree = new qtvar(image, job.tol);
+  else if (job.var)
+    tree = new qtvar(image);
+  else
+    tree = new qtcount(image);
+  if (built != NULL)
+    *built = tree->footprint();
+  if (job.bytes > 0) {
+    int tol = png ? tree->pruneToPngBytes(job.bytes)
+                  : tree->pruneToBytes(job.bytes);
+    if (tol < 0) {
+      cerr << "batch: no prune fits in " << job.bytes << " bytes" << endl;
+      tree->prune(INT_MAX);
+    }
+    return tree;
+  }
+  int tol = job.tol;
+  if (job.leaves > 0)
+    tol = tree->idealPrune(job.leaves);
+  tree->prune(tol);
+  return tree;
+}
+
+void printFootprint(ostream &out, const string &name, unsigned int width,
+                    unsigned int height, const TreeFootprint &built,
+                    const TreeFootprint &pruned) {
+  const double MB = 1 << 20;
+  // pixels of the square the tree covers; a tree built with a floor may
+  // not reach them
+  size_t pixels = 0;
+  if (width > 0 && height > 0)
+    pixels = (size_t)1 << (2 * (int)log2(min(width, height)));
+  ios::fmtflags flags = out.flags();
+  out << fixed << setprecision(1) << name << " " << width << "x" << height
+      << ": image " << PNG::footprint(width, height) / MB << " MB, stats "
+      << stats::footprint(width, height) / MB << " MB, tree " << built.nodes
+      << " nodes of " << built.nodeBytes << " B and "
+      << built.pixelBytes / MB << " MB of pixels = " << built.bytes / MB
+      << " MB (" << setprecision(3)
+      << (pixels > 0 ? built.nodes / (double)pixels : 0.0)
+      << " per pixel of the square), pruned " << pruned.nodes << " nodes = "
+      << setprecision(1) << pruned.bytes / MB << " MB; RSS "
+      << residentBytes() / MB << " MB, peak " << peakResidentBytes() / MB
+      << " MB\n  nodes by level:";
+  for (size_t level = 0; level < built.nodesByLevel.size(); level++)
+    out << " " << built.nodesByLevel[level];
+  out << endl;
+  out.flags(flags);
+}
+
+bool readManifest(const string &fileName, const BatchJob &defaults,
+                  vector<BatchJob> &jobs) {
+  ifstream in(fileName.c_str());
+  if (!in) {
+    cerr << "batch: can not open manifest " << fileName << endl;
+    return false;
+  }
+  string line;
+  int lineNumber = 0;
+  while (getline(in, line)) {
+    lineNumber++;
+    istringstream fields(line);
+    BatchJob job = defaults;
+    if (!(fields >> job.input) || job.input[0] == '#')
+      continue;
+    bool valid = static_cast<bool>(fields >> job.output);
+    string setting;
+    while (valid && fields >> setting)
+      valid = parseJobSetting(setting, job);
+    if (!valid) {
+      cerr << "batch: " << fileName << ":" << lineNumber << ": invalid job"
+           << endl;
+      return false;
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+bool listDirectory(const string &dir, const string &outDir, bool png,
+                   const BatchJob &defaults, vector<BatchJob> &jobs) {
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) {
+    cerr << "batch: can not open directory " << dir << endl;
+    return false;
+  }
+  vector<string> names;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    string name = entry->d_name;
+    if (endsWith(name, ".png"))
+      names.push_back(name);
+  }
+  closedir(d);
+  sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); i++) {
+    BatchJob job = defaults;
+    job.input = dir + "/" + names[i];
+    job.output = outDir + "/" + names[i].substr(0, names[i].size() - 4) +
+                 (png ? ".png" : ".qtc");
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+size_t estimateFootprint(const string &fileName) {
+  // the signature and the IHDR chunk
+  unsigned char header[33];
+  ifstream in(fileName.c_str(), ios::binary);
+  if (!in.read((char *)header, sizeof(header)))
+    return 0;
+  unsigned int width, height;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  unsigned error = lodepng_inspect(&width, &height, &state, header,
+                                   sizeof(header));
+  lodepng_state_cleanup(&state);
+  if (error)
+    return 0;
+  return quadtree::buildFootprint(width, height);
+}
+
+size_t defaultMemoryBudget() {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long pageSize = sysconf(_SC_PAGE_SIZE);
+  if (pages <= 0 || pageSize <= 0)
+    return 0;
+  return (size_t)pages * pageSize / 2;
+}
+
+BatchStats runBatch(const vector<BatchJob> &jobs, unsigned int numThreads,
+                    size_t memoryBudget, ResultCache *cache, bool footprints) {
+  Pipeline pipeline(jobs, numThreads, memoryBudget, cache, footprints);
+  return pipeline.run();
+}
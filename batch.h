@@ -0,0 +1,140 @@
+/**
+ *
+ * batch.h
+ * Compression of many images at once.
+ *
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "quadtree.h"
+
+using namespace std;
+
+class ResultCache;
+
+/**
+ * One image to compress, and how.
+ */
+struct BatchJob {
+    string input;  // PNG file to compress
+    string output; // .qtc file, or PNG file of the rendered tree
+    bool var;      // prune with qtvar (true) or qtcount (false)
+    int tol;       // tolerance of the prune, if leaves and bytes are 0
+    int leaves;    // number of leaves to prune to (see idealPrune), or 0
+    size_t bytes;  // size of the output to prune to (see pruneToBytes), or 0
+
+    BatchJob() : var(true), tol(1000), leaves(0), bytes(0) {}
+};
+
+/**
+ * Totals of a batch run.
+ */
+struct BatchStats {
+    size_t images;     // images compressed
+    size_t failed;     // images that could not be read, compressed or written
+    double megapixels; // pixels of the compressed images, in millions
+    double seconds;    // wall clock time of the run
+    size_t peakMemory; // largest estimated footprint of the images in flight
+
+    BatchStats()
+        : images(0), failed(0), megapixels(0), seconds(0), peakMemory(0) {}
+};
+
+/**
+ * Applies a "key=value" setting (tol=N, leaves=N, bytes=N or
+ * policy=var|count) to a job.
+ * @return false, if the setting is not valid.
+ */
+bool parseJobSetting(const string &setting, BatchJob &job);
+
+/**
+ * Builds the tree of an image with the policy of a job, and prunes it to
+ * the job's tolerance, number of leaves or output size.
+ * @param png Whether the output is the rendered PNG rather than a .qtc file,
+ * for a job with an output size. If even the coarsest prune does not fit,
+ * the tree is pruned to its fewest leaves.
+ * @param built If not NULL, receives the footprint of the tree as built,
+ * before the prune: qtvar jobs with a tolerance only build the nodes a prune
+ * at it can keep (see quadtree::build).
+ * @return the tree, to be deleted by the caller.
+ */
+quadtree *compressImage(PNG &image, const BatchJob &job, bool png = false,
+                        TreeFootprint *built = NULL);
+
+/**
+ * Prints the memory taken by the compression of a width x height image:
+ * the decoded image, the stats tables, the full tree (with its nodes by
+ * level and per pixel) and the pruned tree, and the resident set size of
+ * the process.
+ */
+void printFootprint(ostream &out, const string &name, unsigned int width,
+                    unsigned int height, const TreeFootprint &built,
+                    const TreeFootprint &pruned);
+
+/**
+ * Reads a manifest of jobs: one job per line, made of the input file, the
+ * output file and optional settings tol=N, leaves=N, bytes=N and
+ * policy=var|count,
+ * separated by whitespace. Settings left out are taken from defaults.
+ * Empty lines and lines starting with # are skipped.
+ * @return true, if the file was read and every line is valid.
+ */
+bool readManifest(const string &fileName, const BatchJob &defaults,
+                  vector<BatchJob> &jobs);
+
+/**
+ * Makes a job with the given settings for every .png file of a directory,
+ * in name order. The output of input.png is outDir/input.qtc, or
+ * outDir/input.png if png is set.
+ * @return true, if the directory was read.
+ */
+bool listDirectory(const string &dir, const string &outDir, bool png,
+                   const BatchJob &defaults, vector<BatchJob> &jobs);
+
+/**
+ * Estimates the peak memory of compressing a PNG file (see
+ * quadtree::buildFootprint) from the size in its header, without decoding
+ * it.
+ * @return the estimate in bytes, or 0 if the header can not be read.
+ */
+size_t estimateFootprint(const string &fileName);
+
+/**
+ * @return a memory budget for runBatch: half of the physical memory.
+ */
+size_t defaultMemoryBudget();
+
+/**
+ * Runs the jobs as a pipeline of three stages on a shared pool of threads:
+ * decode the PNG, build and prune the tree, then render or encode it and
+ * write the output. Stages of different images run at the same time, so
+ * one image is decoded while another is pruned and a third is written.
+ * Later stages go first, and at most two images per thread are in flight.
+ *
+ * Images are admitted in order, and only while the estimated footprints
+ * of the images in flight fit in the memory budget. An image that does
+ * not fit yet holds back the ones after it, so the memory freed meanwhile
+ * is reserved for it and large images are not starved by small ones. An
+ * image larger than the whole budget runs on its own.
+ *
+ * With a cache, an output found there is written as is, without decoding
+ * the image, and new outputs are added to it.
+ * Failures are reported on cerr and counted.
+ * @param numThreads Number of threads; 0 for one per hardware thread.
+ * @param memoryBudget Memory budget in bytes; 0 for none.
+ * @param cache Cache of outputs (see cache.h), or NULL.
+ * @param footprints Whether to print the footprint of every image
+ * compressed on cout (see printFootprint).
+ */
+BatchStats runBatch(const vector<BatchJob> &jobs, unsigned int numThreads = 0,
+                    size_t memoryBudget = 0, ResultCache *cache = NULL,
+                    bool footprints = false);
+
+#endif
@@ -0,0 +1,410 @@
+// File:        bench.cpp
+// Description: Microbenchmarks of every stage of the compression pipeline,
+//              on deterministic synthetic images (see usage)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "compression/PNG.h"
+#include "compression/RGBAPixel.h"
+#include "qtcount.h"
+#include "qtvar.h"
+#include "stats.h"
+
+using namespace compression;
+using namespace std;
+
+static int usage() {
+    cerr << "usage: benchResult [options]\n"
+            "options:\n"
+            "  --sizes N,N,...   edges of the images (default 256,1024,4096,16384)\n"
+            "  --images K,K,...  kinds of images: flat, gradient, noise, natural\n"
+            "                    (default all)\n"
+            "  --reps N          repetitions of each benchmark (default 5)\n"
+            "  --queries N       getAvg/getVar queries per repetition (default 1000000)\n"
+            "  --memory MB       sizes needing more are skipped (default: half of the RAM)\n"
+            "  --json FILE       also write the results to FILE"
+         << endl;
+    return 2;
+}
+
+// splits "a,b,c"
+static vector<string> splitList(const string& list) {
+    vector<string> items;
+    stringstream in(list);
+    string item;
+    while (getline(in, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+// a 32-bit integer hash (from the finalizer of MurmurHash3), for noise
+static uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t lattice(int x, int y, uint32_t seed) {
+    return mix(x * 0x27D4EB2Fu ^ mix(y * 0x165667B1u ^ seed));
+}
+
+// smooth value noise in [0, 1), with one lattice point every cell pixels
+static double valueNoise(int x, int y, int cell, uint32_t seed) {
+    int cx = x / cell;
+    int cy = y / cell;
+    double fx = (double)(x % cell) / cell;
+    double fy = (double)(y % cell) / cell;
+    fx = fx * fx * (3 - 2 * fx);
+    fy = fy * fy * (3 - 2 * fy);
+    double v00 = lattice(cx, cy, seed) / 4294967296.0;
+    double v10 = lattice(cx + 1, cy, seed) / 4294967296.0;
+    double v01 = lattice(cx, cy + 1, seed) / 4294967296.0;
+    double v11 = lattice(cx + 1, cy + 1, seed) / 4294967296.0;
+    double top = v00 + (v10 - v00) * fx;
+    double bottom = v01 + (v11 - v01) * fx;
+    return top + (bottom - top) * fy;
+}
+
+/**
+ * Builds a synthetic edge x edge image; the same kind and edge always give
+ * the same pixels.
+ *   flat: a single colour, the best case of every tree.
+ *   gradient: smooth ramps along x, y and the diagonal.
+ *   noise: independent random pixels, the worst case.
+ *   natural: fractal value noise (large smooth regions with finer detail
+ *   on top, its energy falling off with frequency as in photographs) and
+ *   a little grain.
+ * @return false, if the kind is unknown.
+ */
+static bool syntheticImage(const string& kind, unsigned int edge, PNG& img) {
+    if (kind != "flat" && kind != "gradient" && kind != "noise" &&
+        kind != "natural")
+        return false;
+    img.resize(edge, edge);
+    for (unsigned int y = 0; y < edge; y++) {
+        for (unsigned int x = 0; x < edge; x++) {
+            int r, g, b;
+            if (kind == "flat") {
+                r = 70;
+                g = 130;
+                b = 180;
+            } else if (kind == "gradient") {
+                r = x * 255 / edge;
+                g = y * 255 / edge;
+                b = (x + y) * 255 / (2 * edge);
+            } else if (kind == "noise") {
+                uint32_t h = lattice(x, y, 1);
+                r = h & 0xFF;
+                g = (h >> 8) & 0xFF;
+                b = (h >> 16) & 0xFF;
+            } else {
+                int c[3];
+                for (int channel = 0; channel < 3; channel++) {
+                    double v = 0, amplitude = 0.5;
+                    int cell = max(4u, edge / 4);
+                    for (; cell >= 4; cell /= 2, amplitude *= 0.55)
+                        v += amplitude * valueNoise(x, y, cell, 17 + channel);
+                    v += ((lattice(x, y, 3 + channel) & 0xF) - 7.5) / 255.0;
+                    c[channel] = min(255, max(0, (int)(v * 280)));
+                }
+                r = c[0];
+                g = c[1];
+                b = c[2];
+            }
+            *img.getPixel(x, y) = RGBAPixel(r, g, b);
+        }
+    }
+    return true;
+}
+
+/**
+ * Timings of one benchmark, over its repetitions.
+ */
+struct BenchResult {
+    string name;
+    string image;
+    unsigned int edge;
+    size_t items;           // operations per repetition, such as queries
+    vector<double> samples; // milliseconds per repetition
+
+    double minimum() const { return *min_element(samples.begin(), samples.end()); }
+    double median() const {
+        vector<double> sorted = samples;
+        sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+        return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+    double mean() const {
+        double sum = 0;
+        for (size_t i = 0; i < samples.size(); i++)
+            sum += samples[i];
+        return sum / samples.size();
+    }
+    double stddev() const {
+        if (samples.size() < 2)
+            return 0;
+        double m = mean(), sum = 0;
+        for (size_t i = 0; i < samples.size(); i++)
+            sum += (samples[i] - m) * (samples[i] - m);
+        return sqrt(sum / (samples.size() - 1));
+    }
+    // nanoseconds per item at the median
+    double perItem() const { return median() * 1e6 / items; }
+};
+
+/**
+ * Memory taken by the compression of one image (see printFootprint).
+ */
+struct ImageFootprint {
+    string image;
+    unsigned int edge;
+    TreeFootprint built;  // the full tree
+    TreeFootprint pruned; // the tree pruned by the prune benchmark
+    size_t rss;           // resident set size after the prune
+};
+
+/**
+ * Runs the benchmarks on one image, appending their results.
+ */
+class Bench {
+public:
+    Bench(const string& image, unsigned int edge, int reps, size_t queries,
+          vector<BenchResult>& results, vector<ImageFootprint>& footprints)
+        : image(image), edge(edge), reps(reps), queries(queries),
+          results(results), footprints(footprints) {}
+
+    void run(PNG& img) {
+        size_t pixels = (size_t)edge * edge;
+        int dims = 0;
+        while ((1u << (dims + 1)) <= edge)
+            dims++;
+
+        stats* s = NULL;
+        measure("stats", pixels, [&]() { delete s; s = NULL; },
+                [&]() { s = new stats(img); });
+
+        // random squares, the same for every image
+        vector<pair<int, int> > corners(queries);
+        vector<int> sizes(queries);
+        for (size_t i = 0; i < queries; i++) {
+            uint32_t h = lattice(i, 0, 5);
+            sizes[i] = h % (dims + 1);
+            int span = edge - (1 << sizes[i]) + 1;
+            corners[i] = make_pair((int)(mix(h) % span), (int)(mix(h + 1) % span));
+        }
+        volatile long sink = 0;
+        measure("getAvg", queries, NULL, [&]() {
+            long sum = 0;
+            for (size_t i = 0; i < queries; i++)
+                sum += s->getAvg(corners[i], sizes[i]).r;
+            sink = sink + sum;
+        });
+        measure("getVar", queries, NULL, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < queries; i++)
+                sum += s->getVar(corners[i], sizes[i]);
+            sink = sink + (long)sum;
+        });
+        delete s;
+
+        qtcount* counted = NULL;
+        measure("build/qtcount", pixels, [&]() { delete counted; counted = NULL; },
+                [&]() { counted = new qtcount(img); });
+        delete counted;
+
+        qtvar* tree = NULL;
+        measure("build/qtvar", pixels, [&]() { delete tree; tree = NULL; },
+                [&]() { tree = new qtvar(img); });
+
+        qtvar* other = NULL;
+        measure("copy", pixels, [&]() { delete other; other = NULL; },
+                [&]() { other = new qtvar(*tree); });
+        delete other;
+        measure("clear", pixels, [&]() { other = new qtvar(*tree); },
+                [&]() { delete other; other = NULL; });
+
+        // about one leaf per 64 pixels
+        int leaves = max((size_t)1, pixels / 64);
+        int tol = 0;
+        measure("idealPrune", 1, NULL, [&]() { tol = tree->idealPrune(leaves); });
+        measure("pruneSize", 1, NULL, [&]() { sink = sink + tree->pruneSize(tol); });
+        measure("prune", pixels, [&]() { delete other; other = new qtvar(*tree); },
+                [&]() { other->prune(tol); });
+        ImageFootprint footprint;
+        footprint.image = image;
+        footprint.edge = edge;
+        footprint.built = tree->footprint();
+        footprint.pruned = other->footprint();
+        footprint.rss = residentBytes();
+        footprints.push_back(footprint);
+        cout << "# ";
+        printFootprint(cout, image, edge, edge, footprint.built, footprint.pruned);
+        delete tree;
+
+        PNG rendered;
+        measure("render", pixels, NULL, [&]() { rendered = other->render(); });
+        delete other;
+
+        vector<unsigned char> encoded;
+        measure("PNG write", pixels, NULL, [&]() { img.writeToMemory(encoded); });
+        PNG decoded;
+        measure("PNG read", pixels, NULL,
+                [&]() { decoded.readFromMemory(encoded.data(), encoded.size()); });
+    }
+
+private:
+    /**
+     * Times reps runs of body. setup runs, untimed, before each of them,
+     * if not NULL.
+     */
+    void measure(const string& name, size_t items, function<void()> setup,
+                 function<void()> body) {
+        BenchResult result;
+        result.name = name;
+        result.image = image;
+        result.edge = edge;
+        result.items = items;
+        for (int i = 0; i < reps; i++) {
+            if (setup)
+                setup();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            body();
+            result.samples.push_back(chrono::duration<double, milli>(
+                chrono::steady_clock::now() - start).count());
+        }
+        printRow(result);
+        results.push_back(result);
+    }
+
+    void printRow(const BenchResult& r) {
+        cout << left << setw(15) << r.name << setw(10) << r.image << right
+             << setw(7) << r.edge << fixed << setprecision(3) << setw(12)
+             << r.minimum() << setw(12) << r.median() << setw(12) << r.mean()
+             << setw(10) << r.stddev() << setw(12) << setprecision(2)
+             << r.perItem() << endl;
+    }
+
+    string image;
+    unsigned int edge;
+    int reps;
+    size_t queries;
+    vector<BenchResult>& results;
+    vector<ImageFootprint>& footprints;
+};
+
+static void writeJson(ostream& out, const vector<BenchResult>& results,
+                      const vector<ImageFootprint>& footprints, int reps) {
+    out << "{\n  \"reps\": " << reps << ",\n  \"results\": [";
+    out << setprecision(6) << defaultfloat;
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name
+            << "\", \"image\": \"" << r.image << "\", \"edge\": " << r.edge
+            << ", \"items\": " << r.items << ", \"min_ms\": " << r.minimum()
+            << ", \"median_ms\": " << r.median() << ", \"mean_ms\": " << r.mean()
+            << ", \"stddev_ms\": " << r.stddev() << ", \"ns_per_item\": "
+            << r.perItem() << ", \"samples_ms\": [";
+        for (size_t j = 0; j < r.samples.size(); j++)
+            out << (j ? ", " : "") << r.samples[j];
+        out << "]}";
+    }
+    out << "\n  ],\n  \"footprints\": [";
+    for (size_t i = 0; i < footprints.size(); i++) {
+        const ImageFootprint& f = footprints[i];
+        out << (i ? ",\n" : "\n") << "    {\"image\": \"" << f.image
+            << "\", \"edge\": " << f.edge << ", \"image_bytes\": "
+            << PNG::footprint(f.edge, f.edge) << ", \"stats_bytes\": "
+            << stats::footprint(f.edge, f.edge) << ", \"nodes\": "
+            << f.built.nodes << ", \"node_bytes\": " << f.built.nodeBytes
+            << ", \"tree_bytes\": " << f.built.bytes << ", \"pruned_nodes\": "
+            << f.pruned.nodes << ", \"pruned_bytes\": " << f.pruned.bytes
+            << ", \"rss_bytes\": " << f.rss << ", \"nodes_by_level\": [";
+        for (size_t level = 0; level < f.built.nodesByLevel.size(); level++)
+            out << (level ? ", " : "") << f.built.nodesByLevel[level];
+        out << "]}";
+    }
+    out << "\n  ]\n}" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> sizes = splitList("256,1024,4096,16384");
+    vector<string> images = splitList("flat,gradient,noise,natural");
+    int reps = 5;
+    size_t queries = 1000000;
+    size_t memoryBudget = defaultMemoryBudget();
+    string jsonFile;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--sizes" && hasValue)
+            sizes = splitList(argv[++i]);
+        else if (arg == "--images" && hasValue)
+            images = splitList(argv[++i]);
+        else if (arg == "--reps" && hasValue)
+            reps = max(1, atoi(argv[++i]));
+        else if (arg == "--queries" && hasValue)
+            queries = max(1L, atol(argv[++i]));
+        else if (arg == "--memory" && hasValue)
+            memoryBudget = (size_t)atol(argv[++i]) << 20;
+        else if (arg == "--json" && hasValue)
+            jsonFile = argv[++i];
+        else
+            return usage();
+    }
+
+    cout << left << setw(15) << "benchmark" << setw(10) << "image" << right
+         << setw(7) << "edge" << setw(12) << "min ms" << setw(12) << "median ms"
+         << setw(12) << "mean ms" << setw(10) << "stddev" << setw(12)
+         << "ns/item" << endl;
+    vector<BenchResult> results;
+    vector<ImageFootprint> footprints;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        unsigned int edge = atoi(sizes[i].c_str());
+        if (edge == 0 || (edge & (edge - 1)) != 0) {
+            cerr << "bench: " << sizes[i] << " is not a power of two" << endl;
+            return 2;
+        }
+        // the tree, its copy and the stats built beside it
+        size_t footprint = 2 * quadtree::buildFootprint(edge, edge);
+        if (memoryBudget > 0 && footprint > memoryBudget) {
+            cout << "skipping " << edge << "x" << edge << ": needs about "
+                 << (footprint >> 20) << " MB, more than the "
+                 << (memoryBudget >> 20) << " MB budget" << endl;
+            continue;
+        }
+        for (size_t k = 0; k < images.size(); k++) {
+            PNG img;
+            if (!syntheticImage(images[k], edge, img)) {
+                cerr << "bench: unknown image " << images[k] << endl;
+                return 2;
+            }
+            Bench(images[k], edge, reps, queries, results, footprints).run(img);
+        }
+    }
+
+    if (!jsonFile.empty()) {
+        ofstream out(jsonFile.c_str());
+        writeJson(out, results, footprints, reps);
+        if (!out) {
+            cerr << "bench: can not write " << jsonFile << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,272 @@
+/**
+ *
+ * budget.cpp
+ * Pruning to a budget of output bytes.
+ *
+ * The size of the output of a prune is modeled from its cut, the nodes the
+ * prune would leave, so that tolerances can be compared without pruning or
+ * encoding: the raw .qtc size exactly, the entropy coded one as the
+ * empirical entropy of what encodeQtc codes, and the PNG one from the rows
+ * of the leaves times the entropy of their colors. The candidate a search settles on is
+ * encoded, and the ratio of its size to the model calibrates the next
+ * search.
+ *
+ */
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include "quadtree.h"
+#include "trace.h"
+using namespace std;
+
+namespace {
+// residuals of g and b are coded as differences from the residual of the
+// previous channel, so they lie in [-510, 510]
+const int RESIDUAL_OFFSET = 510;
+const int RESIDUAL_BINS = 2 * RESIDUAL_OFFSET + 1;
+// magic, version, flags, edge and node or bit count
+const double QTC_HEADER_BYTES = 13;
+// signature and the IHDR, IDAT and IEND chunks
+const double PNG_OVERHEAD_BYTES = 57;
+// deflate codes a row of a render in about a match per run of one color:
+// bytes per row, and per bit of color entropy of a run, on natural images
+const double PNG_ROW_BYTES = 4;
+const double PNG_BYTES_PER_BIT = 0.04;
+// the candidates a search encodes, at most
+const int MAX_BUDGET_ENCODES = 6;
+
+// the empirical entropy, in bits, of the values counted by a histogram
+double entropyBits(const vector<size_t> &histogram) {
+  size_t total = 0;
+  for (size_t i = 0; i < histogram.size(); i++)
+    total += histogram[i];
+  double bits = 0;
+  for (size_t i = 0; i < histogram.size(); i++)
+    if (histogram[i] > 0)
+      bits -= histogram[i] * log2(histogram[i] / (double)total);
+  return bits;
+}
+
+// the same, of ones out of total yes/no values
+double entropyBits(size_t ones, size_t total) {
+  vector<size_t> histogram(2);
+  histogram[0] = total - ones;
+  histogram[1] = ones;
+  return entropyBits(histogram);
+}
+}
+
+quadtree::CutStats::CutStats() : leaves(0), flags(0), splits(0), runs(0) {
+  for (int last = 0; last < 2; last++)
+    for (int c = 0; c < 3; c++)
+      residuals[last][c].assign(RESIDUAL_BINS, 0);
+}
+
+void quadtree::CutStats::count(const RGBAPixel &avg,
+                               const RGBAPixel &predicted, bool lastChild) {
+  int r = avg.r - predicted.r;
+  int g = avg.g - predicted.g;
+  int b = avg.b - predicted.b;
+  residuals[lastChild][0][r + RESIDUAL_OFFSET]++;
+  residuals[lastChild][1][g - r + RESIDUAL_OFFSET]++;
+  residuals[lastChild][2][b - g + RESIDUAL_OFFSET]++;
+}
+
+RGBAPixel quadtree::CutStats::predictLast(const RGBAPixel &parent,
+                                          const RGBAPixel &a,
+                                          const RGBAPixel &b,
+                                          const RGBAPixel &c) {
+  int values[3] = {4 * parent.r - a.r - b.r - c.r,
+                   4 * parent.g - a.g - b.g - c.g,
+                   4 * parent.b - a.b - b.b - c.b};
+  for (int i = 0; i < 3; i++)
+    values[i] = max(0, min(255, values[i]));
+  return RGBAPixel(values[0], values[1], values[2]);
+}
+
+size_t quadtree::estimateQtcBytes(const int tol, bool entropyCoded) const {
+  return llround(
+      modelBytes(cutStats(tol), entropyCoded ? BUDGET_QTC : BUDGET_QTC_RAW));
+}
+
+size_t quadtree::estimatePngBytes(const int tol) const {
+  return llround(modelBytes(cutStats(tol), BUDGET_PNG));
+}
+
+int quadtree::pruneToBytes(const size_t budget, bool entropyCoded) {
+  return pruneToBudget(budget, entropyCoded ? BUDGET_QTC : BUDGET_QTC_RAW);
+}
+
+int quadtree::pruneToPngBytes(const size_t budget) {
+  return pruneToBudget(budget, BUDGET_PNG);
+}
+
+int quadtree::pruneToBudget(const size_t budget, const BudgetFormat format) {
+  if (root == NULL && artifact == NULL)
+    return -1;
+  int tol;
+  {
+    QTC_PHASE(PHASE_PRUNE);
+    TraceSpan span("prune");
+    // the model of each tolerance probed, before calibration
+    map<int, double> models;
+    auto model = [&](int t) {
+      map<int, double>::iterator known = models.find(t);
+      if (known != models.end())
+        return known->second;
+      return models[t] = modelBytes(cutStats(t), format);
+    };
+    // encoded size over model, at the largest tolerance known not to fit
+    // and at the smallest known to fit
+    double failScale = 1, fitScale = 1;
+    int fail = -1;
+    int fit = -1;
+    for (int encodes = 0; encodes < MAX_BUDGET_ENCODES; encodes++) {
+      if (fail == INT_MAX || fail + 1 == fit)
+        break;
+      int low = fail + 1;
+      int high = fit >= 0 ? fit - 1 : INT_MAX;
+      // within a bracket, the error of the model is about halfway between
+      // its errors at the ends
+      double scale = fail < 0 ? fitScale : fit < 0 ? failScale
+                                                   : sqrt(failScale * fitScale);
+      // the smallest tolerance the calibrated model fits with a cut other
+      // than the failed one's, or high
+      int tol = low;
+      for (int h = high; tol < h;) {
+        int mid = tol + (h - tol) / 2;
+        if (scale * model(mid) <= budget &&
+            (fail < 0 || model(mid) < model(fail)))
+          h = mid;
+        else
+          tol = mid + 1;
+      }
+      if (fit >= 0 && scale * model(tol) > budget) {
+        // the model sees no better fit; it is exact when nothing failed
+        if (fail < 0)
+          break;
+        tol = low + (high - low) / 2;
+      }
+      // nor is a cut that was encoded already
+      if ((fit >= 0 && model(tol) == model(fit)) ||
+          (fail >= 0 && model(tol) == model(fail)))
+        break;
+      size_t bytes = encodedBytes(tol, format);
+      if (bytes <= budget) {
+        fit = tol;
+        fitScale = bytes / max(model(tol), 1.0);
+      } else {
+        fail = tol;
+        failScale = bytes / max(model(tol), 1.0);
+      }
+    }
+    if (fit < 0 && fail < INT_MAX && encodedBytes(INT_MAX, format) <= budget)
+      fit = INT_MAX;
+    tol = fit;
+  }
+  if (tol >= 0)
+    prune(tol);
+  return tol;
+}
+
+quadtree::CutStats quadtree::cutStats(const int tol) const {
+  CutStats cut;
+  if (artifact != NULL)
+    artifactCutStats(0, tol, RGBAPixel(128, 128, 128), false, cut);
+  else if (root != NULL)
+    cutStatsHelper(root, tol, RGBAPixel(128, 128, 128), false, cut);
+  return cut;
+}
+
+void quadtree::cutStatsHelper(Node *node, const int tol,
+                              const RGBAPixel &predicted, bool lastChild,
+                              CutStats &cut) const {
+  cut.count(node->avg, predicted, lastChild);
+  if (node->dim > 0)
+    cut.flags++;
+  if ((node->NW == NULL && !node->packed) || prunable(node, tol)) {
+    cut.leaves++;
+    cut.runs += (size_t)1 << node->dim;
+    return;
+  }
+  cut.splits++;
+  if (node->packed) {
+    RGBAPixel leaves[4];
+    for (int i = 0; i < 4; i++)
+      leaves[i] = pixelOf(node, i);
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel childPredicted =
+          i == 3 ? CutStats::predictLast(node->avg, leaves[0], leaves[1],
+                                         leaves[2])
+                 : node->avg;
+      cut.count(leaves[i], childPredicted, i == 3);
+    }
+    cut.leaves += 4;
+    cut.runs += 4;
+    return;
+  }
+  Node *children[4] = {node->NW, node->NE, node->SE, node->SW};
+  for (int i = 0; i < 4; i++) {
+    RGBAPixel childPredicted =
+        i == 3 ? CutStats::predictLast(node->avg, children[0]->avg,
+                                       children[1]->avg, children[2]->avg)
+               : node->avg;
+    cutStatsHelper(children[i], tol, childPredicted, i == 3, cut);
+  }
+}
+
+double quadtree::modelBytes(const CutStats &cut,
+                            const BudgetFormat format) const {
+  if (format == BUDGET_QTC_RAW)
+    return QTC_HEADER_BYTES + (cut.flags + 7) / 8 + 3 * cut.leaves;
+  double colorBits = 0;
+  size_t nodes = 0;
+  for (int last = 0; last < 2; last++)
+    for (int c = 0; c < 3; c++)
+      colorBits += entropyBits(cut.residuals[last][c]);
+  for (size_t i = 0; i < cut.residuals[0][0].size(); i++)
+    nodes += cut.residuals[0][0][i] + cut.residuals[1][0][i];
+  if (format == BUDGET_QTC)
+    return QTC_HEADER_BYTES +
+           (entropyBits(cut.splits, cut.flags) + colorBits) / 8;
+  double bitsPerNode = nodes > 0 ? colorBits / nodes : 0;
+  return PNG_OVERHEAD_BYTES + PNG_ROW_BYTES * edge +
+         PNG_BYTES_PER_BIT * cut.runs * bitsPerNode;
+}
+
+size_t quadtree::encodedBytes(const int tol, const BudgetFormat format) {
+  Node *cut = artifact != NULL ? artifactTree(0, make_pair(0, 0), tol)
+                               : cutTree(root, tol);
+  // the cut stands in for the tree while it is encoded
+  Node *full = root;
+  compression::MappedFile *mapped = artifact;
+  root = cut;
+  artifact = NULL;
+  vector<unsigned char> out;
+  bool ok = true;
+  if (format == BUDGET_PNG)
+    ok = render().writeToMemory(out);
+  else
+    encodeQtc(out, format == BUDGET_QTC);
+  root = full;
+  artifact = mapped;
+  clearHelper(cut);
+  return ok ? out.size() : SIZE_MAX;
+}
+
+quadtree::Node *quadtree::cutTree(Node *node, const int tol) const {
+  Node *copy = new Node(node->upLeft, node->dim, node->avg, node->var);
+  if ((node->NW == NULL && !node->packed) || prunable(node, tol))
+    return copy;
+  // the pixel block is the tree's, which the cut stands in for
+  if (node->packed) {
+    copy->packed = true;
+    return copy;
+  }
+  copy->NW = cutTree(node->NW, tol);
+  copy->NE = cutTree(node->NE, tol);
+  copy->SE = cutTree(node->SE, tol);
+  copy->SW = cutTree(node->SW, tol);
+  return copy;
+}
@@ -0,0 +1,186 @@
+/**
+ *
+ * cache.cpp
+ *
+ */
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include "cache.h"
+#include "compression/lodepng/lodepng.h"
+using namespace std;
+
+namespace {
+// bumped whenever the encoders can write different bytes for the same job,
+// so entries left in a cache directory by an older build are not served
+const char *const KEY_VERSION = "v2";
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// runs the compression function on one 64-byte block
+void sha256Block(uint32_t state[8], const unsigned char *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                  ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+}
+
+void sha256(const unsigned char *data, size_t size, unsigned char digest[32]) {
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64)
+    sha256Block(state, data + i);
+  // the tail, a 1 bit, zeros and the length in bits fill one or two blocks
+  unsigned char last[128] = {0};
+  size_t tail = size - i;
+  memcpy(last, data + i, tail);
+  last[tail] = 0x80;
+  size_t blocks = tail + 9 <= 64 ? 1 : 2;
+  uint64_t bits = (uint64_t)size * 8;
+  for (int j = 0; j < 8; j++)
+    last[blocks * 64 - 1 - j] = (unsigned char)(bits >> (8 * j));
+  for (size_t j = 0; j < blocks; j++)
+    sha256Block(state, last + 64 * j);
+  for (int j = 0; j < 8; j++)
+    for (int k = 0; k < 4; k++)
+      digest[4 * j + k] = (unsigned char)(state[j] >> (24 - 8 * k));
+}
+
+ResultCache::ResultCache(size_t capacity, const string &directory)
+    : capacity(capacity), directory(directory) {}
+
+string ResultCache::key(const unsigned char *source, size_t size,
+                        const BatchJob &job, bool png) {
+  unsigned char digest[32];
+  sha256(source, size, digest);
+  ostringstream out;
+  out << KEY_VERSION << "-" << hex << setfill('0');
+  for (int i = 0; i < 32; i++)
+    out << setw(2) << (int)digest[i];
+  out << dec << "-" << size << "-" << (job.var ? "var" : "count") << "-";
+  // the tolerance does not matter when pruning to a number of leaves or
+  // bytes
+  if (job.bytes > 0)
+    out << "b" << job.bytes;
+  else if (job.leaves > 0)
+    out << "l" << job.leaves;
+  else
+    out << "t" << job.tol;
+  out << (png ? ".png" : ".qtc");
+  return out.str();
+}
+
+bool ResultCache::get(const string &key, vector<unsigned char> &out) {
+  {
+    lock_guard<mutex> guard(lock);
+    unordered_map<string, list<Entry>::iterator>::iterator found =
+        index.find(key);
+    if (found != index.end()) {
+      lru.splice(lru.begin(), lru, found->second);
+      out = found->second->second;
+      counters.hits++;
+      return true;
+    }
+  }
+  // read outside the lock; the file is complete, since it is renamed into
+  // place once written
+  vector<unsigned char> data;
+  if (directory.empty() || lodepng::load_file(data, path(key)) != 0) {
+    lock_guard<mutex> guard(lock);
+    counters.misses++;
+    return false;
+  }
+  lock_guard<mutex> guard(lock);
+  counters.hits++;
+  counters.diskHits++;
+  if (index.find(key) == index.end())
+    insert(key, data);
+  out.swap(data);
+  return true;
+}
+
+void ResultCache::put(const string &key, const vector<unsigned char> &data) {
+  if (!directory.empty()) {
+    ostringstream temp;
+    temp << path(key) << ".tmp" << getpid() << "-" << this_thread::get_id();
+    if (lodepng::save_file(data, temp.str()) == 0)
+      rename(temp.str().c_str(), path(key).c_str());
+    else
+      remove(temp.str().c_str());
+  }
+  lock_guard<mutex> guard(lock);
+  if (index.find(key) == index.end())
+    insert(key, data);
+}
+
+CacheStats ResultCache::stats() {
+  lock_guard<mutex> guard(lock);
+  CacheStats current = counters;
+  current.entries = lru.size();
+  return current;
+}
+
+void ResultCache::insert(const string &key, const vector<unsigned char> &data) {
+  if (data.size() > capacity)
+    return;
+  while (!lru.empty() && counters.bytes + data.size() > capacity) {
+    counters.bytes -= lru.back().second.size();
+    index.erase(lru.back().first);
+    lru.pop_back();
+    counters.evictions++;
+  }
+  lru.push_front(Entry(key, data));
+  index[key] = lru.begin();
+  counters.bytes += data.size();
+}
+
+string ResultCache::path(const string &key) const {
+  return directory + "/" + key;
+}
@@ -0,0 +1,104 @@
+/**
+ *
+ * cache.h
+ * Cache of compression results, keyed by the content of their source.
+ *
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "batch.h"
+
+using namespace std;
+
+/**
+ * Counters of a ResultCache.
+ */
+struct CacheStats {
+    size_t hits;      // lookups answered from memory or disk
+    size_t diskHits;  // of the hits, those read back from the directory
+    size_t misses;
+    size_t evictions; // entries dropped from memory to make room
+    size_t entries;   // entries in memory
+    size_t bytes;     // size of the entries in memory
+
+    CacheStats()
+        : hits(0), diskHits(0), misses(0), evictions(0), entries(0), bytes(0) {}
+};
+
+/**
+ * ResultCache: the encoded outputs of compressions (.qtc or PNG files),
+ * keyed by a digest of the source PNG file and the settings, so repeated
+ * requests skip decoding, building and pruning. The most recently used
+ * entries are kept in memory up to a capacity; with a directory, every
+ * entry is also written there and read back after it was evicted, or by
+ * a later process. Thread safe.
+ */
+class ResultCache {
+public:
+    /**
+     * @param capacity Size of the entries kept in memory, in bytes.
+     * @param directory Directory backing the cache, which must exist; ""
+     * for a memory only cache.
+     */
+    ResultCache(size_t capacity, const string &directory = "");
+
+    /**
+     * Key of the result of a job: a version of the encoders, the SHA-256
+     * digest of the source PNG file, its size and the settings that change
+     * the output.
+     * @param source The contents of the source PNG file.
+     * @param png Whether the output is a rendered PNG rather than a .qtc file.
+     */
+    static string key(const unsigned char *source, size_t size,
+                      const BatchJob &job, bool png);
+
+    /**
+     * Looks a result up.
+     * @return true, if it was found; out then holds it.
+     */
+    bool get(const string &key, vector<unsigned char> &out);
+
+    /**
+     * Stores a result, evicting the least recently used ones as needed.
+     * Results larger than the capacity are only stored on disk.
+     */
+    void put(const string &key, const vector<unsigned char> &data);
+
+    CacheStats stats();
+
+private:
+    ResultCache(const ResultCache &other);
+    ResultCache &operator=(const ResultCache &other);
+
+    typedef pair<string, vector<unsigned char> > Entry;
+
+    // adds an entry in front of the LRU list; lock must be held
+    void insert(const string &key, const vector<unsigned char> &data);
+    string path(const string &key) const;
+
+    size_t capacity;
+    string directory;
+    mutex lock;        // guards the members below
+    list<Entry> lru;   // most recently used first
+    unordered_map<string, list<Entry>::iterator> index;
+    CacheStats counters;
+};
+
+/**
+ * SHA-256 digest of data[0, size), so distinct sources can not share a
+ * key by accident.
+ */
+void sha256(const unsigned char *data, size_t size, unsigned char digest[32]);
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * @file MappedFile.cpp
+ * Implementation of MappedFile, with mmap where available and lodepng
+ * file loading otherwise.
+ */
+
+#include "MappedFile.h"
+
+#include "lodepng/lodepng.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPEDFILE_HAVE_MMAP
+#endif
+
+namespace compression {
+    MappedFile::MappedFile(const string& fileName, bool sequential)
+        : data_(nullptr), size_(0), mapped_(false), error_(0) {
+#ifdef MAPPEDFILE_HAVE_MMAP
+        int fd = open(fileName.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+                data_ = static_cast<const unsigned char*>(map);
+                size_ = st.st_size;
+                mapped_ = true;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (mapped_) {
+            return;
+        }
+#endif
+        error_ = lodepng::load_file(buffer_, fileName);
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    MappedFile::~MappedFile() {
+#ifdef MAPPEDFILE_HAVE_MMAP
+        if (mapped_) {
+            munmap(const_cast<unsigned char*>(data_), size_);
+        }
+#endif
+    }
+
+    const unsigned char* MappedFile::data() const {
+        return data_;
+    }
+
+    size_t MappedFile::size() const {
+        return size_;
+    }
+
+    unsigned MappedFile::error() const {
+        return error_;
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * @file MappedFile.h
+ * Read-only view of the contents of a file.
+ */
+
+#ifndef COMPRESSION_MAPPEDFILE_H
+#define COMPRESSION_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace compression {
+    /**
+     * Read-only view of the contents of a file. Where possible the file is
+     * memory mapped, so readers use it straight from the page cache instead
+     * of from a private copy and only touch the pages they need; otherwise
+     * it is read into a buffer.
+     */
+    class MappedFile {
+    public:
+        /**
+         * Opens and maps (or reads) a file.
+         * @param fileName Name of the file to be read.
+         * @param sequential Whether the file will be read front to back,
+         *                   once, rather than at random places.
+         */
+        MappedFile(const string& fileName, bool sequential = true);
+
+        /**
+         * Destructor: unmaps the file.
+         */
+        ~MappedFile();
+
+        /**
+         * @return The contents of the file.
+         */
+        const unsigned char* data() const;
+
+        /**
+         * @return The size of the file.
+         */
+        size_t size() const;
+
+        /**
+         * @return 0 if the file was read, otherwise a lodepng error code
+         *         (78: the file could not be opened).
+         */
+        unsigned error() const;
+
+    private:
+        MappedFile(const MappedFile& other);
+        MappedFile& operator=(const MappedFile& other);
+
+        const unsigned char* data_;
+        size_t size_;
+        bool mapped_;
+        unsigned error_;
+        vector<unsigned char> buffer_; /*< Contents of the file, if it is not mapped */
+    };
+}
+
+#endif
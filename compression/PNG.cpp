@@ -8,9 +8,13 @@
 #include "PNG.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <string>
 
+#include "MappedFile.h"
+#include "../metrics.h"
+#include "../trace.h"
 #include "lodepng/lodepng.h"
 
 namespace compression {
@@ -97,18 +101,30 @@ namespace compression {
     }
 
     bool PNG::readFromFile(const string& fileName) {
-        vector<unsigned char> byteData;
-        unsigned error = lodepng::decode(byteData, width_, height_, fileName);
+        MappedFile input(fileName);
+        if (input.error()) {
+            cerr << "PNG decoder error " << input.error() << ": " << lodepng_error_text(input.error()) << endl;
+            return false;
+        }
+        return readFromMemory(input.data(), input.size());
+    }
+
+    bool PNG::readFromMemory(const unsigned char* data, size_t size) {
+        QTC_PHASE(PHASE_DECODE);
+        TraceSpan span("decode");
+        unsigned char* byteData = nullptr;
+        unsigned error = lodepng_decode32(&byteData, &width_, &height_, data, size);
 
         if (error) {
             cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+            free(byteData);
             return false;
         }
 
         delete[] imageData_;
         imageData_ = new RGBAPixel[width_ * height_];
 
-        for (unsigned i = 0; i < byteData.size(); i += 4) {
+        for (unsigned i = 0; i < width_ * height_ * 4; i += 4) {
             RGBAPixel& pixel = imageData_[i / 4];
             pixel.r = byteData[i];
             pixel.g = byteData[i + 1];
@@ -116,10 +132,75 @@ namespace compression {
             pixel.a = byteData[i + 3] / 255.;
         }
 
+        free(byteData);
+        return true;
+    }
+
+    namespace {
+        // Context of the lodepng row callback. width and height are the
+        // output parameters of lodepng_decode_rows, set before the first row
+        struct RowStream {
+            PNG::RowReader* reader;
+            unsigned width;
+            unsigned height;
+            vector<RGBAPixel> pixels;
+        };
+
+        unsigned streamRow(void* context, unsigned y, const unsigned char* row) {
+            RowStream* stream = static_cast<RowStream*>(context);
+            if (y == 0) {
+                stream->pixels.resize(stream->width);
+                stream->reader->begin(stream->width, stream->height);
+            }
+            for (unsigned x = 0; x < stream->width; x++) {
+                RGBAPixel& pixel = stream->pixels[x];
+                pixel.r = row[(x * 4)];
+                pixel.g = row[(x * 4) + 1];
+                pixel.b = row[(x * 4) + 2];
+                pixel.a = row[(x * 4) + 3] / 255.;
+            }
+            stream->reader->row(y, stream->pixels.data());
+            return 0;
+        }
+    }
+
+    bool PNG::readRows(const string& fileName, RowReader& reader) {
+        MappedFile input(fileName);
+        unsigned error = input.error();
+
+        RowStream stream;
+        stream.reader = &reader;
+        stream.width = 0;
+        stream.height = 0;
+        if (!error) {
+            lodepng::State state;
+            error = lodepng_decode_rows(&stream.width, &stream.height, &state, input.data(), input.size(),
+                                        streamRow, &stream);
+        }
+
+        if (error) {
+            cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+            return false;
+        }
         return true;
     }
 
-    bool PNG::writeToFile(const string& fileName) {
+    bool PNG::writeToFile(const string& fileName, bool fast) {
+        QTC_PHASE(PHASE_ENCODE);
+        vector<unsigned char> encoded;
+        if (!writeToMemory(encoded, fast)) {
+            return false;
+        }
+        unsigned error = lodepng::save_file(encoded, fileName);
+        if (error) {
+            cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+        }
+        return (error == 0);
+    }
+
+    bool PNG::writeToMemory(vector<unsigned char>& out, bool fast) {
+        QTC_PHASE(PHASE_ENCODE);
+        TraceSpan span("encode");
         unsigned char* byteData = new unsigned char[width_ * height_ * 4];
 
         for (unsigned i = 0; i < width_ * height_; i++) {
@@ -129,7 +210,13 @@ namespace compression {
             byteData[(i * 4) + 3] = imageData_[i].a * 255;
         }
 
-        unsigned error = lodepng::encode(fileName, byteData, width_, height_);
+        lodepng::State state;
+        if (fast) {
+            state.encoder.zlibsettings.fastmatch = 1;
+            state.encoder.filter_strategy = LFS_FOUR;
+        }
+        out.clear();
+        unsigned error = lodepng::encode(out, byteData, width_, height_, state);
         if (error) {
             cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
         }
@@ -170,4 +257,15 @@ namespace compression {
         height_ = newHeight;
         imageData_ = newImageData;
     }
+
+    size_t PNG::footprint() const {
+        return imageData_ == nullptr ? 0 : footprint(width_, height_);
+    }
+
+    size_t PNG::footprint(unsigned int width, unsigned int height) {
+        if ((size_t)width * height == 0) {
+            return 0;
+        }
+        return heapBlockBytes((size_t)width * height * sizeof(RGBAPixel));
+    }
 }
@@ -17,6 +17,30 @@ using namespace std;
 namespace compression {
     class PNG {
     public:
+        /**
+         * Receives the rows of an image streamed by readRows, from top to
+         * bottom. Implementations consume each row as it arrives so that the
+         * whole image is never resident.
+         */
+        class RowReader {
+        public:
+            virtual ~RowReader() {}
+
+            /**
+             * Called once, before the first row.
+             * @param width Width of the image.
+             * @param height Height of the image.
+             */
+            virtual void begin(unsigned int width, unsigned int height) = 0;
+
+            /**
+             * Called for every row of the image, in order.
+             * @param y Y-coordinate of the row.
+             * @param row The width pixels of the row, only valid during the call.
+             */
+            virtual void row(unsigned int y, const RGBAPixel* row) = 0;
+        };
+
         /**
          * Creates an empty PNG image.
          */
@@ -71,12 +95,40 @@ namespace compression {
          */
         bool readFromFile(const string& fileName);
 
+        /**
+         * Reads in a PNG image from the contents of a PNG file in memory.
+         * Overwrites any current image content in the PNG.
+         * @param data The PNG file.
+         * @param size Size of the PNG file.
+         * @return true, if the image was successfully read and loaded.
+         */
+        bool readFromMemory(const unsigned char* data, size_t size);
+
+        /**
+         * Streams a PNG image from a file to a RowReader, one row at a time,
+         * without decoding the whole image into memory.
+         * @param fileName Name of the file to be read from.
+         * @param reader Receives the size and the rows of the image.
+         * @return true, if the image was successfully read.
+         */
+        static bool readRows(const string& fileName, RowReader& reader);
+
         /**
          * Writes a PNG image to a file.
          * @param fileName Name of the file to be written.
+         * @param fast If true, trade compression ratio for encoding speed:
+         *             the fast LZ77 matcher and a single (Paeth) filter are used.
          * @return true, if the image was successfully written.
          */
-        bool writeToFile(const string& fileName);
+        bool writeToFile(const string& fileName, bool fast = false);
+
+        /**
+         * Encodes a PNG image into memory, as writeToFile would write it.
+         * @param out Receives the PNG file.
+         * @param fast See writeToFile.
+         * @return true, if the image was successfully encoded.
+         */
+        bool writeToMemory(vector<unsigned char>& out, bool fast = false);
 
         /**
          * Pixel access operator. Gets a pointer to the pixel at the given
@@ -109,6 +161,17 @@ namespace compression {
          */
         void resize(unsigned int newWidth, unsigned int newHeight);
 
+        /**
+         * Gets the heap bytes held by the pixels, including the
+         * allocator's overhead (see heapBlockBytes in metrics.h).
+         */
+        size_t footprint() const;
+
+        /**
+         * Gets what footprint() is for a width x height image.
+         */
+        static size_t footprint(unsigned int width, unsigned int height);
+
     private:
         unsigned int width_;   /*< Width of the image */
         unsigned int height_;  /*< Height of the image */
@@ -39,6 +39,13 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+/*x86 SIMD checksums (PCLMUL CRC32, SSSE3 Adler-32) are compiled per function with target attributes and selected at
+runtime with cpuid, so the rest of the file does not need any -m flags. Pass -DLODEPNG_NO_COMPILE_SIMD to disable them.*/
+#if !defined(LODEPNG_NO_COMPILE_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_COMPILE_X86_SIMD
+#include <immintrin.h>
+#endif /*LODEPNG_COMPILE_X86_SIMD*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -463,7 +470,7 @@ typedef struct {
   size_t size; /*size of data in bytes*/
   size_t bitsize; /*size of data in bits, end of valid bp values, should be 8*size*/
   size_t bp;
-  unsigned buffer; /*buffer for reading bits. NOTE: 'unsigned' must support at least 32 bits*/
+  unsigned long long buffer; /*buffer for reading bits. NOTE: 'unsigned long long' must support at least 64 bits*/
 } LodePNGBitReader;
 
 /* data size argument is in bytes. Returns error if size too large causing overflow */
@@ -559,10 +566,31 @@ static LODEPNG_INLINE void ensureBits32(LodePNGBitReader* reader, size_t nbits)
   (void)nbits;
 }
 
+/*See ensureBits documentation above. This one ensures up to 56 bits: a whole 64-bit word is loaded at once when
+there are at least 8 bytes left, so the inflate loop can decode several symbols and their extra bits per refill*/
+static LODEPNG_INLINE void ensureBits56(LodePNGBitReader* reader, size_t nbits) {
+  size_t start = reader->bp >> 3u;
+  size_t size = reader->size;
+  const unsigned char* p = reader->data + start;
+  if(start + 7u < size) {
+    reader->buffer = (unsigned long long)p[0] | ((unsigned long long)p[1] << 8u) |
+                     ((unsigned long long)p[2] << 16u) | ((unsigned long long)p[3] << 24u) |
+                     ((unsigned long long)p[4] << 32u) | ((unsigned long long)p[5] << 40u) |
+                     ((unsigned long long)p[6] << 48u) | ((unsigned long long)p[7] << 56u);
+    reader->buffer >>= (reader->bp & 7u);
+  } else {
+    size_t i;
+    reader->buffer = 0;
+    for(i = 0; start + i < size; ++i) reader->buffer |= ((unsigned long long)p[i] << (i * 8u));
+    reader->buffer >>= (reader->bp & 7u);
+  }
+  (void)nbits;
+}
+
 /* Get bits without advancing the bit pointer. Must have enough bits available with ensureBits. Max nbits is 31. */
 static LODEPNG_INLINE unsigned peekBits(LodePNGBitReader* reader, size_t nbits) {
   /* The shift allows nbits to be only up to 31. */
-  return reader->buffer & ((1u << nbits) - 1u);
+  return (unsigned)(reader->buffer & ((1u << nbits) - 1u));
 }
 
 /* Must have enough bits available with ensureBits */
@@ -637,6 +665,9 @@ typedef struct HuffmanTree {
   /* for reading only */
   unsigned char* table_len; /*length of symbol from lookup table, or max length if secondary lookup needed*/
   unsigned short* table_value; /*value of symbol from lookup table, or pointer to secondary table if needed*/
+  /* for reading literal runs only, see HuffmanTree_makePairTable */
+  unsigned char* pair_len; /*total length of two literals decoded by one lookup, or 0 if the entry is not a pair*/
+  unsigned short* pair_value; /*first literal in the low byte, second literal in the high byte*/
 } HuffmanTree;
 
 static void HuffmanTree_init(HuffmanTree* tree) {
@@ -644,6 +675,8 @@ static void HuffmanTree_init(HuffmanTree* tree) {
   tree->lengths = 0;
   tree->table_len = 0;
   tree->table_value = 0;
+  tree->pair_len = 0;
+  tree->pair_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree) {
@@ -651,6 +684,8 @@ static void HuffmanTree_cleanup(HuffmanTree* tree) {
   lodepng_free(tree->lengths);
   lodepng_free(tree->table_len);
   lodepng_free(tree->table_value);
+  lodepng_free(tree->pair_len);
+  lodepng_free(tree->pair_value);
 }
 
 /* amount of bits for first huffman table lookup (aka root bits), see HuffmanTree_makeTable and huffmanDecodeSymbol.*/
@@ -661,6 +696,9 @@ static void HuffmanTree_cleanup(HuffmanTree* tree) {
 which is possible in case of only 0 or 1 present symbols. */
 #define INVALIDSYMBOL 65535u
 
+/* amount of bits for the two-literal lookup table, see HuffmanTree_makePairTable. Must be >= FIRSTBITS. */
+#define PAIRBITS 11u
+
 /* make table for huffman decoding */
 static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
   static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
@@ -1068,6 +1106,38 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree) {
 
 #ifdef LODEPNG_COMPILE_DECODER
 
+/*
+Make the multi-symbol table of a literal/length tree: for every PAIRBITS-bit pattern whose
+first two symbols are both literals with a total length of at most PAIRBITS, store both
+literals so that runs of literals decode two bytes per lookup. Must be called after
+HuffmanTree_makeTable. Returns error code.
+*/
+static unsigned HuffmanTree_makePairTable(HuffmanTree* tree) {
+  static const unsigned pairsize = 1u << PAIRBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned i;
+  tree->pair_len = (unsigned char*)lodepng_malloc(pairsize * sizeof(*tree->pair_len));
+  tree->pair_value = (unsigned short*)lodepng_malloc(pairsize * sizeof(*tree->pair_value));
+  if(!tree->pair_len || !tree->pair_value) return 83; /*alloc fail*/
+
+  for(i = 0; i != pairsize; ++i) {
+    unsigned l1 = tree->table_len[i & mask], l2, rest;
+    unsigned v1 = tree->table_value[i & mask], v2;
+    tree->pair_len[i] = 0;
+    tree->pair_value[i] = 0;
+    /*the first symbol must be a literal fully resolved by the first table*/
+    if(l1 > FIRSTBITS || v1 > 255) continue;
+    /*the second symbol is decoded from the remaining PAIRBITS - l1 bits*/
+    rest = i >> l1;
+    l2 = tree->table_len[rest & mask];
+    v2 = tree->table_value[rest & mask];
+    if(l2 > FIRSTBITS || l1 + l2 > PAIRBITS || v2 > 255) continue;
+    tree->pair_len[i] = (unsigned char)(l1 + l2);
+    tree->pair_value[i] = (unsigned short)(v1 | (v2 << 8u));
+  }
+  return 0;
+}
+
 /*
 returns the code. The bit reader must already have been ensured at least 15 bits
 */
@@ -1093,6 +1163,34 @@ static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree*
 /* / Inflator (Decompressor)                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*
+Optional consumer of inflated data, for decoding without keeping the whole output in memory. When given,
+the output vector is used as a sliding window: whenever it grows beyond INFLATE_SINK_FLUSH bytes, all but the
+last INFLATE_WINDOW bytes (the maximum deflate distance) are handed to consume and dropped from the vector.
+The remaining bytes must be consumed by the caller at the end.
+*/
+typedef struct InflateSink {
+  unsigned (*consume)(void* context, const unsigned char* data, size_t size); /*returns error code*/
+  void* context;
+} InflateSink;
+
+#define INFLATE_WINDOW 32768u
+#define INFLATE_SINK_FLUSH 262144u
+
+/*hands all but the last keep bytes of out to the sink, and moves the kept bytes to the front*/
+static unsigned inflateSinkFlush(ucvector* out, const InflateSink* sink, size_t keep) {
+  size_t i, n;
+  unsigned error;
+  if(out->size <= keep) return 0;
+  n = out->size - keep;
+  error = sink->consume(sink->context, out->data, n);
+  if(error) return error;
+  /*forward copy, the ranges may overlap*/
+  for(i = 0; i != keep; ++i) out->data[i] = out->data[n + i];
+  out->size = keep;
+  return 0;
+}
+
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification
 Returns error code.*/
 static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d) {
@@ -1237,11 +1335,12 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
 /*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
 static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
-                                    unsigned btype, size_t max_output_size) {
+                                    unsigned btype, size_t max_output_size, const InflateSink* sink) {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  const size_t reserved_size = 260; /* must be at least 258 for max length, and a few extra for adding a few extra literals */
+  /* must be at least 258 for max length, and a few extra for the literals decoded before it in the same iteration */
+  const size_t reserved_size = 264;
   int done = 0;
 
   if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
@@ -1251,14 +1350,22 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
 
   if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
   else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+  if(!error) error = HuffmanTree_makePairTable(&tree_ll);
 
 
   while(!error && !done) /*decode all symbols until end reached, breaks at end code*/ {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll;
-    /* ensure enough bits for 2 huffman code reads (15 bits each): if the first is a literal, a second literal is read at once. This
-    appears to be slightly faster, than ensuring 20 bits here for 1 huffman symbol and the potential 5 extra bits for the length symbol.*/
-    ensureBits32(reader, 30);
+    unsigned code_ll, pair;
+    /* one 64-bit refill gives enough bits for a literal pair lookup (PAIRBITS), 2 huffman code reads (15 bits each)
+    and the extra bits of a length code (5 bits), only the distance code needs another refill.*/
+    ensureBits56(reader, 46);
+    /*multi-symbol fast path: decode two literals with a single table lookup*/
+    pair = peekBits(reader, PAIRBITS);
+    if(tree_ll.pair_len[pair]) {
+      out->data[out->size++] = (unsigned char)(tree_ll.pair_value[pair] & 255u);
+      out->data[out->size++] = (unsigned char)(tree_ll.pair_value[pair] >> 8u);
+      advanceBits(reader, tree_ll.pair_len[pair]);
+    }
     code_ll = huffmanDecodeSymbol(reader, &tree_ll);
     if(code_ll <= 255) {
       /*slightly faster code path if multiple literals in a row*/
@@ -1279,12 +1386,11 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
       if(numextrabits_l != 0) {
         /* bits already ensured above */
-        ensureBits25(reader, 5);
         length += readBits(reader, numextrabits_l);
       }
 
       /*part 3: get distance code*/
-      ensureBits32(reader, 28); /* up to 15 for the huffman symbol, up to 13 for the extra bits */
+      ensureBits56(reader, 28); /* up to 15 for the huffman symbol, up to 13 for the extra bits */
       code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29) {
         if(code_d <= 31) {
@@ -1308,12 +1414,18 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
       backward = start - distance;
 
       out->size += length;
-      if(distance < length) {
-        size_t forward;
-        lodepng_memcpy(out->data + start, out->data + backward, distance);
-        start += distance;
-        for(forward = distance; forward < length; ++forward) {
-          out->data[start++] = out->data[backward++];
+      if(distance == 1) {
+        /*run of a single repeated byte, very common in filtered PNG scanlines*/
+        lodepng_memset(out->data + start, out->data[backward], length);
+      } else if(distance < length) {
+        /*overlapping copy: the already written part repeats with period distance, so copy it in chunks that
+        double in size instead of byte by byte. The source stays a multiple of distance behind the destination.*/
+        size_t copied = 0, period = distance;
+        while(copied < length) {
+          size_t chunk = LODEPNG_MIN(period, length - copied);
+          lodepng_memcpy(out->data + start + copied, out->data + start + copied - period, chunk);
+          copied += chunk;
+          period <<= 1u;
         }
       } else {
         lodepng_memcpy(out->data + start, out->data + backward, length);
@@ -1323,6 +1435,10 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
     } else /*if(code_ll == INVALIDSYMBOL)*/ {
       ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
     }
+    if(sink && out->size >= INFLATE_SINK_FLUSH) {
+      error = inflateSinkFlush(out, sink, INFLATE_WINDOW);
+      if(error) break;
+    }
     if(out->allocsize - out->size < reserved_size) {
       if(!ucvector_reserve(out, out->size + reserved_size)) ERROR_BREAK(83); /*alloc fail*/
     }
@@ -1333,7 +1449,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
       /* TODO: revise error codes 10,11,50: the above comment is no longer valid */
       ERROR_BREAK(51); /*error, bit pointer jumps past memory*/
     }
-    if(max_output_size && out->size > max_output_size) {
+    if(!sink && max_output_size && out->size > max_output_size) {
       ERROR_BREAK(109); /*error, larger than max size*/
     }
   }
@@ -1381,7 +1497,7 @@ static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader,
 
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings) {
+                                 const LodePNGDecompressSettings* settings, const InflateSink* sink) {
   unsigned BFINAL = 0;
   LodePNGBitReader reader;
   unsigned error = LodePNGBitReader_init(&reader, in, insize);
@@ -1397,8 +1513,9 @@ static unsigned lodepng_inflatev(ucvector* out,
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
     else if(BTYPE == 0) error = inflateNoCompression(out, &reader, settings); /*no compression*/
-    else error = inflateHuffmanBlock(out, &reader, BTYPE, settings->max_output_size); /*compression, BTYPE 01 or 10*/
-    if(!error && settings->max_output_size && out->size > settings->max_output_size) error = 109;
+    else error = inflateHuffmanBlock(out, &reader, BTYPE, settings->max_output_size, sink); /*compression, BTYPE 01 or 10*/
+    if(!error && sink && out->size >= INFLATE_SINK_FLUSH) error = inflateSinkFlush(out, sink, INFLATE_WINDOW);
+    if(!error && !sink && settings->max_output_size && out->size > settings->max_output_size) error = 109;
     if(error) break;
   }
 
@@ -1409,7 +1526,7 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings) {
   ucvector v = ucvector_init(*out, *outsize);
-  unsigned error = lodepng_inflatev(&v, in, insize, settings);
+  unsigned error = lodepng_inflatev(&v, in, insize, settings, 0);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -1428,7 +1545,7 @@ static unsigned inflatev(ucvector* out, const unsigned char* in, size_t insize,
     }
     return error;
   } else {
-    return lodepng_inflatev(out, in, insize, settings);
+    return lodepng_inflatev(out, in, insize, settings, 0);
   }
 }
 
@@ -1734,6 +1851,77 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+Fast LZ77 encoding, used when settings->fastmatch is set. Output format and error codes are the same as
+encodeLZ77. Only hash->head is used, as a single-probe table from a hash of the next 3 bytes to the last
+circular position with that hash: there are no chains, every position is probed once and the first match is
+taken greedily. Positions inside a match are not inserted. When no match is found for a while, the step
+between probes grows so incompressible data is passed through quickly as literals. Any distance within the
+window is a valid match, so stale table entries only cost a failed compare.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash,
+                               const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize) {
+  size_t pos = inpos;
+  size_t lastmatch = inpos; /*end of the last match, the skip-ahead step grows with the distance to it*/
+  unsigned error = 0;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  while(pos < insize) {
+    size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
+    size_t step, i;
+    unsigned length = 0, offset = 0;
+
+    if(pos + 3 <= insize) {
+      /*multiplicative hash: unlike getHash it spreads non-zero bytes well, and it is computed only once per probe*/
+      unsigned key = (unsigned)in[pos] | ((unsigned)in[pos + 1] << 8u) | ((unsigned)in[pos + 2] << 16u);
+      unsigned hashval = ((key * 2654435761u) >> 16u) & HASH_BIT_MASK;
+      int hashpos = hash->head[hashval];
+      hash->head[hashval] = (int)wpos;
+      if(hashpos != -1) {
+        offset = (unsigned)((wpos - (size_t)hashpos) & (windowsize - 1));
+        if(offset != 0 && offset <= pos) {
+          const unsigned char* foreptr = &in[pos];
+          const unsigned char* backptr = &in[pos - offset];
+          const unsigned char* lastptr =
+              &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+          while(foreptr != lastptr && *backptr == *foreptr) {
+            ++backptr;
+            ++foreptr;
+          }
+          length = (unsigned)(foreptr - &in[pos]);
+        }
+      }
+    }
+
+    /*a length of 3 at a long distance costs more bits than the literals*/
+    if(length >= 4 || (length == 3 && offset <= 4096)) {
+      addLengthDistance(out, length, offset);
+      pos += length;
+      lastmatch = pos;
+      /*only the last two positions of the match are inserted, so repeating patterns keep being found*/
+      for(i = pos - 2; i < pos && i + 3 <= insize; ++i) {
+        unsigned key = (unsigned)in[i] | ((unsigned)in[i + 1] << 8u) | ((unsigned)in[i + 2] << 16u);
+        hash->head[((key * 2654435761u) >> 16u) & HASH_BIT_MASK] = (int)(i & (windowsize - 1));
+      }
+      continue;
+    }
+
+    /*no match: emit literals, the longer since the last match the bigger the step*/
+    step = 1 + ((pos - lastmatch) >> 5u);
+    if(step > 8) step = 8;
+    if(step > insize - pos) step = insize - pos;
+    for(i = 0; i != step; ++i) {
+      if(!uivector_push_back(out, in[pos + i])) ERROR_BREAK(83 /*alloc fail*/);
+    }
+    if(error) break;
+    pos += step;
+  }
+
+  return error;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
@@ -1860,8 +2048,12 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      if(settings->fastmatch) {
+        error = encodeLZ77Fast(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize);
+      } else {
+        error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                           settings->minmatch, settings->nicematch, settings->lazymatching);
+      }
       if(error) break;
     } else {
       if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
@@ -2046,8 +2238,12 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     if(settings->use_lz77) /*LZ77 encoded*/ {
       uivector lz77_encoded;
       uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      if(settings->fastmatch) {
+        error = encodeLZ77Fast(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize);
+      } else {
+        error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                           settings->minmatch, settings->nicematch, settings->lazymatching);
+      }
       if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
       uivector_cleanup(&lz77_encoded);
     } else /*no LZ77, but still will be Huffman compressed*/ {
@@ -2135,10 +2331,66 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+#ifdef LODEPNG_COMPILE_X86_SIMD
+/*
+Adler32 update of blocks * 32 bytes with SSSE3. Per 32 byte block, s1 gets the byte sum (psadbw) and s2 gets
+32 times the previous s1 plus the bytes weighted 32..1 (pmaddubsw). The modulo is deferred over at most 5552
+bytes as in the scalar version.
+*/
+__attribute__((target("ssse3")))
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned blocks) {
+  unsigned s1 = adler & 0xffffu;
+  unsigned s2 = (adler >> 16u) & 0xffffu;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  while(blocks != 0u) {
+    unsigned n = blocks > 5552u / 32u ? 5552u / 32u : blocks;
+    __m128i v_ps = _mm_setr_epi32((int)(s1 * n), 0, 0, 0); /*sum of s1 before each block*/
+    __m128i v_s2 = _mm_setr_epi32((int)s2, 0, 0, 0);
+    __m128i v_s1 = zero;
+    blocks -= n;
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)(data));
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /*horizontal sums of the 4 lanes*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521u;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521u;
+  }
+  return (s2 << 16u) | s1;
+}
+#endif /*LODEPNG_COMPILE_X86_SIMD*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
   unsigned s1 = adler & 0xffffu;
   unsigned s2 = (adler >> 16u) & 0xffffu;
 
+#ifdef LODEPNG_COMPILE_X86_SIMD
+  if(len >= 64u && __builtin_cpu_supports("ssse3")) {
+    unsigned blocks = len / 32u;
+    adler = update_adler32_ssse3(adler, data, blocks);
+    s1 = adler & 0xffffu;
+    s2 = (adler >> 16u) & 0xffffu;
+    data += blocks * 32u;
+    len -= blocks * 32u;
+  }
+#endif /*LODEPNG_COMPILE_X86_SIMD*/
+
   while(len != 0u) {
     unsigned i;
     /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
@@ -2166,10 +2418,8 @@ static unsigned adler32(const unsigned char* data, unsigned len) {
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-static unsigned lodepng_zlib_decompressv(ucvector* out,
-                                         const unsigned char* in, size_t insize,
-                                         const LodePNGDecompressSettings* settings) {
-  unsigned error = 0;
+/*checks the 2 byte zlib header, returns error code*/
+static unsigned zlib_check_header(const unsigned char* in, size_t insize) {
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2194,6 +2444,14 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
       "The additional flags shall not specify a preset dictionary."*/
     return 26;
   }
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out,
+                                         const unsigned char* in, size_t insize,
+                                         const LodePNGDecompressSettings* settings) {
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
 
   error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
@@ -2243,6 +2501,42 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
   return error;
 }
 
+/*wraps the sink of zlib_decompress_sink to compute the adler32 of the data it receives*/
+typedef struct ZlibSink {
+  const InflateSink* sink;
+  unsigned adler;
+} ZlibSink;
+
+static unsigned zlibSinkConsume(void* context, const unsigned char* data, size_t size) {
+  ZlibSink* zlib = (ZlibSink*)context;
+  zlib->adler = update_adler32(zlib->adler, data, (unsigned)size);
+  return zlib->sink->consume(zlib->sink->context, data, size);
+}
+
+/*Like zlib_decompress, but the output is handed to the sink in pieces instead of returned as one buffer,
+so only the inflate window is resident. Custom zlib and inflate functions are not used.*/
+static unsigned zlib_decompress_sink(const unsigned char* in, size_t insize,
+                                     const LodePNGDecompressSettings* settings, const InflateSink* sink) {
+  ucvector v = ucvector_init(NULL, 0);
+  ZlibSink zlib;
+  InflateSink wrapped;
+  unsigned error = zlib_check_header(in, insize);
+
+  zlib.sink = sink;
+  zlib.adler = 1u;
+  wrapped.consume = zlibSinkConsume;
+  wrapped.context = &zlib;
+
+  if(!error) error = lodepng_inflatev(&v, in + 2, insize - 2, settings, &wrapped);
+  if(!error) error = inflateSinkFlush(&v, &wrapped, 0);
+  if(!error && !settings->ignore_adler32) {
+    unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+    if(zlib.adler != ADLER32) error = 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  lodepng_free(v.data);
+  return error;
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2333,13 +2627,14 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->fastmatch = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2374,50 +2669,398 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifdef LODEPNG_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/* CRC polynomial: 0xedb88320. lodepng_crc32_table[0] is the classic byte-at-a-time table, table[k] advances the
+CRC of a byte that is followed by k more bytes, which allows processing 8 bytes per step (slicing-by-8). */
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+/*Portable CRC update, slicing-by-8. r is the running (non-inverted) CRC register.*/
+static unsigned lodepng_crc32_slice8(unsigned r, const unsigned char* data, size_t length) {
+  while(length >= 8) {
+    r ^= (unsigned)data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u);
+    r = lodepng_crc32_table[7][r & 0xffu] ^ lodepng_crc32_table[6][(r >> 8u) & 0xffu] ^
+        lodepng_crc32_table[5][(r >> 16u) & 0xffu] ^ lodepng_crc32_table[4][r >> 24u] ^
+        lodepng_crc32_table[3][data[4]] ^ lodepng_crc32_table[2][data[5]] ^
+        lodepng_crc32_table[1][data[6]] ^ lodepng_crc32_table[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+  while(length != 0) {
+    r = lodepng_crc32_table[0][(r ^ *data++) & 0xffu] ^ (r >> 8u);
+    --length;
+  }
+  return r;
+}
+
+#ifdef LODEPNG_COMPILE_X86_SIMD
+/*
+CRC update by folding 64 bytes at a time with carry-less multiplication, followed by a
+Barrett reduction, see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+Instruction" (Intel). The constants are for the bit-reflected polynomial 0xedb88320.
+Requires length >= 64 and a multiple of 16. r is the running (non-inverted) CRC register.
+*/
+__attribute__((target("pclmul,sse4.1")))
+static unsigned lodepng_crc32_pclmul(unsigned r, const unsigned char* data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)r));
+  data += 64;
+  length -= 64;
+
+  /*fold 4 lanes of 128 bits in parallel*/
+  x0 = k1k2;
+  while(length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the 4 lanes into one*/
+  x0 = k3k4;
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /*fold remaining blocks of 16 bytes*/
+  while(length >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*fold 128 bits to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = k5k0;
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x0 = poly;
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_extract_epi32(x1, 1);
+}
+#endif /*LODEPNG_COMPILE_X86_SIMD*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i) {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xffu] ^ (r >> 8u);
+#ifdef LODEPNG_COMPILE_X86_SIMD
+  /*the folding needs a few blocks to pay off, small chunks such as IHDR or IEND use the table*/
+  if(length >= 256 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    size_t chunk = length & ~(size_t)15u;
+    r = lodepng_crc32_pclmul(r, data, chunk);
+    data += chunk;
+    length -= chunk;
   }
-  return r ^ 0xffffffffu;
+#endif /*LODEPNG_COMPILE_X86_SIMD*/
+  return lodepng_crc32_slice8(r, data, length) ^ 0xffffffffu;
 }
 #else /* LODEPNG_COMPILE_CRC */
 /*in this case, the function is only declared here, and must be defined externally
@@ -4827,17 +5470,19 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
   return error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize) {
+/*
+Reads the header and all chunks, stores the metadata in state, and returns the zlib compressed data of the IDAT
+chunks in *idat_out. The common case of a single IDAT chunk points straight into in, so that a memory mapped
+file is read in place, and *idat_buffer is NULL. Multiple IDAT chunks are concatenated in *idat_buffer, which
+the caller must free. Sets state->error.
+*/
+static void decodeChunks(const unsigned char** idat_out, size_t* idatsize_out, unsigned char** idat_buffer,
+                         unsigned* w, unsigned* h, LodePNGState* state, const unsigned char* in, size_t insize) {
   unsigned char IEND = 0;
   const unsigned char* chunk; /*points to beginning of next chunk*/
-  unsigned char* idat; /*the data from idat chunks, zlib compressed*/
+  const unsigned char* idat = 0; /*the data from idat chunks, zlib compressed*/
+  unsigned char* buffer = 0; /*the concatenated data of multiple idat chunks*/
   size_t idatsize = 0;
-  unsigned char* scanlines = 0;
-  size_t scanlines_size = 0, expected_size = 0;
-  size_t outsize = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4845,9 +5490,10 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-
   /* safe output values in case error happens */
-  *out = 0;
+  *idat_out = 0;
+  *idatsize_out = 0;
+  *idat_buffer = 0;
   *w = *h = 0;
 
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
@@ -4857,14 +5503,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     CERROR_RETURN(state->error, 92); /*overflow possible due to amount of pixels*/
   }
 
-  /*the input filesize is a safe upper bound for the sum of idat chunks size*/
-  idat = (unsigned char*)lodepng_malloc(insize);
-  if(!idat) CERROR_RETURN(state->error, 83); /*alloc fail*/
-
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
-  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
+  /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk*/
   while(!IEND && !state->error) {
     unsigned chunkLength;
     const unsigned char* data; /*the data in the chunk*/
@@ -4897,8 +5538,19 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       size_t newsize;
       if(lodepng_addofl(idatsize, chunkLength, &newsize)) CERROR_BREAK(state->error, 95);
       if(newsize > insize) CERROR_BREAK(state->error, 95);
-      lodepng_memcpy(idat + idatsize, data, chunkLength);
-      idatsize += chunkLength;
+      if(!idat) {
+        idat = data; /*no copy while there is only one IDAT chunk*/
+      } else {
+        if(!buffer) {
+          /*the input filesize is a safe upper bound for the sum of idat chunks size*/
+          buffer = (unsigned char*)lodepng_malloc(insize);
+          if(!buffer) CERROR_BREAK(state->error, 83); /*alloc fail*/
+          lodepng_memcpy(buffer, idat, idatsize);
+          idat = buffer;
+        }
+        lodepng_memcpy(buffer + idatsize, data, chunkLength);
+      }
+      idatsize = newsize;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -4990,6 +5642,31 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     state->error = 106; /* error: PNG file must have PLTE chunk if color type is palette */
   }
 
+  if(state->error) {
+    lodepng_free(buffer);
+    return;
+  }
+  *idat_out = idat;
+  *idatsize_out = idatsize;
+  *idat_buffer = buffer;
+}
+
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize) {
+  const unsigned char* idat; /*the data from idat chunks, zlib compressed*/
+  unsigned char* idat_buffer;
+  size_t idatsize = 0;
+  unsigned char* scanlines = 0;
+  size_t scanlines_size = 0, expected_size = 0;
+  size_t outsize = 0;
+
+  /* safe output values in case error happens */
+  *out = 0;
+
+  decodeChunks(&idat, &idatsize, &idat_buffer, w, h, state, in, insize);
+
   if(!state->error) {
     /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
     If the decompressed size does not match the prediction, the image must be corrupt.*/
@@ -5012,7 +5689,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     state->error = zlib_decompress(&scanlines, &scanlines_size, expected_size, idat, idatsize, &state->decoder.zlibsettings);
   }
   if(!state->error && scanlines_size != expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
-  lodepng_free(idat);
+  lodepng_free(idat_buffer);
 
   if(!state->error) {
     outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
@@ -5063,6 +5740,139 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+/*hands the rows of a fully decoded image to the row callback, used when the rows can not be streamed*/
+static unsigned decodeRowsFromImage(unsigned* w, unsigned* h, LodePNGState* state,
+                                    const unsigned char* in, size_t insize,
+                                    unsigned (*row_callback)(void*, unsigned, const unsigned char*), void* context) {
+  unsigned char* image = 0;
+  unsigned y;
+  size_t rowbits;
+  state->error = lodepng_decode(&image, w, h, state, in, insize);
+  rowbits = (size_t)(*w) * lodepng_get_bpp(&state->info_raw);
+  /*rows of less than 8 bit color types are not byte aligned in the raw image*/
+  if(!state->error && (rowbits & 7u) != 0) state->error = 56;
+  for(y = 0; y < *h && !state->error; ++y) {
+    state->error = row_callback(context, y, image + (rowbits >> 3u) * y);
+  }
+  lodepng_free(image);
+  return state->error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*InflateSink context of lodepng_decode_rows: unfilters and color converts the scanlines as they are inflated*/
+typedef struct RowDecoder {
+  unsigned w, h, y; /*image size and the row being received*/
+  size_t bytewidth, linebytes; /*see unfilter*/
+  unsigned char* scanline; /*filter type byte and filtered bytes of the row being received*/
+  size_t scanpos; /*amount of bytes of scanline received so far*/
+  unsigned char* recon; /*the unfiltered row*/
+  unsigned char* prevline; /*the unfiltered previous row*/
+  unsigned char* converted; /*the row in the color type of info_raw, or NULL if no conversion is needed*/
+  const LodePNGState* state;
+  unsigned (*row_callback)(void*, unsigned, const unsigned char*);
+  void* context;
+} RowDecoder;
+
+static unsigned rowDecoderConsume(void* context, const unsigned char* data, size_t size) {
+  RowDecoder* decoder = (RowDecoder*)context;
+  while(size != 0) {
+    size_t amount = LODEPNG_MIN(size, 1u + decoder->linebytes - decoder->scanpos);
+    if(decoder->y >= decoder->h) return 91; /*decompressed size doesn't match prediction*/
+    lodepng_memcpy(decoder->scanline + decoder->scanpos, data, amount);
+    decoder->scanpos += amount;
+    data += amount;
+    size -= amount;
+    if(decoder->scanpos == 1u + decoder->linebytes) {
+      unsigned char* temp;
+      CERROR_TRY_RETURN(unfilterScanline(decoder->recon, decoder->scanline + 1, decoder->y ? decoder->prevline : 0,
+                                         decoder->bytewidth, decoder->scanline[0], decoder->linebytes));
+      if(decoder->converted) {
+        CERROR_TRY_RETURN(lodepng_convert(decoder->converted, decoder->recon, &decoder->state->info_raw,
+                                          &decoder->state->info_png.color, decoder->w, 1));
+      }
+      CERROR_TRY_RETURN(decoder->row_callback(decoder->context, decoder->y,
+                                              decoder->converted ? decoder->converted : decoder->recon));
+      temp = decoder->prevline;
+      decoder->prevline = decoder->recon;
+      decoder->recon = temp;
+      decoder->scanpos = 0;
+      ++decoder->y;
+    }
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             unsigned (*row_callback)(void* context, unsigned y, const unsigned char* row),
+                             void* context) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  const unsigned char* idat = 0;
+  unsigned char* idat_buffer = 0;
+  size_t idatsize = 0;
+  RowDecoder decoder;
+  InflateSink sink;
+  unsigned bpp;
+
+  state->error = lodepng_inspect(w, h, state, in, insize);
+  if(state->error) return state->error;
+  /*Adam7 passes only form rows once the whole image is known, custom zlib decoders return the whole image anyway*/
+  if(state->info_png.interlace_method != 0 || state->decoder.zlibsettings.custom_zlib ||
+     state->decoder.zlibsettings.custom_inflate) {
+    return decodeRowsFromImage(w, h, state, in, insize, row_callback, context);
+  }
+
+  decodeChunks(&idat, &idatsize, &idat_buffer, w, h, state, in, insize);
+  if(state->error) return state->error;
+
+  lodepng_memset(&decoder, 0, sizeof(decoder));
+  bpp = lodepng_get_bpp(&state->info_png.color);
+  decoder.w = *w;
+  decoder.h = *h;
+  decoder.bytewidth = (bpp + 7u) / 8u;
+  decoder.linebytes = lodepng_get_raw_size_idat(*w, 1, bpp) - 1u;
+  decoder.state = state;
+  decoder.row_callback = row_callback;
+  decoder.context = context;
+  decoder.scanline = (unsigned char*)lodepng_malloc(decoder.linebytes + 1u);
+  decoder.recon = (unsigned char*)lodepng_malloc(decoder.linebytes);
+  decoder.prevline = (unsigned char*)lodepng_malloc(decoder.linebytes);
+  if(!decoder.scanline || !decoder.recon || !decoder.prevline) state->error = 83; /*alloc fail*/
+
+  /*same color mode handling as lodepng_decode*/
+  if(!state->error && !state->decoder.color_convert) {
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  } else if(!state->error && !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
+    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8)) {
+      state->error = 56; /*unsupported color mode conversion*/
+    } else {
+      decoder.converted = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(*w, 1, &state->info_raw));
+      if(!decoder.converted) state->error = 83; /*alloc fail*/
+    }
+  }
+
+  if(!state->error) {
+    sink.consume = rowDecoderConsume;
+    sink.context = &decoder;
+    state->error = zlib_decompress_sink(idat, idatsize, &state->decoder.zlibsettings, &sink);
+  }
+  if(!state->error && (decoder.y != *h || decoder.scanpos != 0)) {
+    state->error = 91; /*decompressed size doesn't match prediction*/
+  }
+
+  lodepng_free(idat_buffer);
+  lodepng_free(decoder.scanline);
+  lodepng_free(decoder.recon);
+  lodepng_free(decoder.prevline);
+  lodepng_free(decoder.converted);
+  return state->error;
+#else /*LODEPNG_COMPILE_ZLIB*/
+  return decodeRowsFromImage(w, h, state, in, insize, row_callback, context);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
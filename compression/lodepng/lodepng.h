@@ -353,6 +353,10 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*use the fast LZ77 matcher: a single-probe hash table with greedy matching that skips ahead over incompressible
+  data. Much faster but compresses less, windowsize still applies, minmatch, nicematch and lazymatching are
+  ignored. Default: false*/
+  unsigned fastmatch;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -887,6 +891,21 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Streaming variant of lodepng_decode: instead of returning the image, calls row_callback for every
+row, from top to bottom, as soon as it is inflated and unfiltered. The decoded image is never
+resident: only the compressed data, the 32KB inflate window and a few scanlines are in memory.
+Settings and color conversion are as in lodepng_decode, row has the color type of
+state->info_raw and is only valid during the call. *w and *h are set before the first
+row_callback. A non-zero return value of row_callback stops decoding and is returned as error.
+Interlaced images, custom zlib/inflate functions and less than 8 bit output rows that are not
+byte aligned are decoded fully first and then handed over row by row (or return error 56).
+*/
+unsigned lodepng_decode_rows(unsigned* w, unsigned* h, LodePNGState* state,
+                             const unsigned char* in, size_t insize,
+                             unsigned (*row_callback)(void* context, unsigned y, const unsigned char* row),
+                             void* context);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
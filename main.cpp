@@ -5,16 +5,249 @@
 // Description: Partial test of PA3 functionality
 //              Reads Point data from external files
 //              Produces PNG images of the point sets
+//              With arguments, compresses a batch of images (see usage)
 
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cache.h"
 #include "compression/PNG.h"
 #include "compression/RGBAPixel.h"
 #include "qtcount.h"
 #include "qtvar.h"
+#include "server.h"
+#include "trace.h"
 
 using namespace compression;
 using namespace std;
 
-int main() {
+static int usage() {
+    cerr << "usage: result [options] <directory|manifest>\n"
+            "       result --serve SOCKET [-j N] [--cache DIR] [--cache-mb N]\n"
+            "       result --load SOCKET SOURCE [-c CLIENTS] [-n REQUESTS] "
+            "[setting...]\n"
+            "  compresses every .png file of the directory, or the jobs of\n"
+            "  the manifest (lines of: input output [tol=N] [leaves=N]\n"
+            "  [bytes=N] [policy=var|count])\n"
+            "options:\n"
+            "  -o DIR            output directory (default images/out)\n"
+            "  --png             write rendered PNGs instead of .qtc files\n"
+            "  --tol N           prune tolerance (default 1000)\n"
+            "  --leaves N        prune to about N leaves instead\n"
+            "  --bytes N         prune to the most detail that fits in N bytes\n"
+            "  --policy var|count\n"
+            "  -j N              number of threads (default: all cores)\n"
+            "  --memory MB       memory budget (default: half of the RAM)\n"
+            "  --cache DIR       reuse the outputs cached in DIR, and add to them\n"
+            "  --cache-mb N      outputs kept in memory (default 256 MB)\n"
+            "  --trace FILE      write a timeline of the stages (Chrome trace JSON)\n"
+            "  --footprint       print the memory taken by every image"
+         << endl;
+    return 2;
+}
+
+// parses the value of a numeric option, which must be in [0, max]
+static bool parseCount(const string& option, const char* text, long max,
+                       long& value) {
+    istringstream in(text);
+    if (in >> value && in.eof() && value >= 0 && value <= max)
+        return true;
+    cerr << "result: invalid " << option << " value " << text << endl;
+    return false;
+}
+
+// parses --cache DIR and --cache-mb N at argv[i]; false for an invalid size
+static bool cacheOption(int argc, char* argv[], int& i, string& dir, size_t& mb) {
+    string arg = argv[i];
+    if (i + 1 >= argc || (arg != "--cache" && arg != "--cache-mb"))
+        return false;
+    long value;
+    if (arg == "--cache")
+        dir = argv[++i];
+    else if (parseCount(arg, argv[++i], LONG_MAX >> 20, value))
+        mb = value;
+    else
+        return false;
+    return true;
+}
+
+static void printCache(ResultCache* cache) {
+    if (cache == NULL)
+        return;
+    CacheStats counters = cache->stats();
+    cout << "cache: " << counters.hits << " hits (" << counters.diskHits
+         << " from disk), " << counters.misses << " misses, "
+         << counters.evictions << " evictions" << endl;
+}
+
+static int batchMain(int argc, char* argv[]) {
+    BatchJob defaults;
+    string cacheDir;
+    size_t cacheMB = 256;
+    string outDir = "images/out";
+    string source;
+    bool png = false;
+    unsigned int threads = 0;
+    size_t memoryBudget = defaultMemoryBudget();
+    string traceFile;
+    bool footprints = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--png") {
+            png = true;
+        } else if (arg == "-o" && hasValue) {
+            outDir = argv[++i];
+        } else if ((arg == "--tol" || arg == "--leaves" || arg == "--bytes"
+                    || arg == "--policy") && hasValue) {
+            // the same settings as a manifest line, checked the same way
+            if (!parseJobSetting(arg.substr(2) + "=" + argv[++i], defaults)) {
+                cerr << "result: invalid " << arg << " value " << argv[i]
+                     << endl;
+                return usage();
+            }
+        } else if (arg == "-j" && hasValue) {
+            long value;
+            if (!parseCount(arg, argv[++i], INT_MAX, value))
+                return usage();
+            threads = value;
+        } else if (arg == "--memory" && hasValue) {
+            long value;
+            if (!parseCount(arg, argv[++i], LONG_MAX >> 20, value))
+                return usage();
+            memoryBudget = (size_t)value << 20;
+        } else if (arg == "--footprint") {
+            footprints = true;
+        } else if (arg == "--trace" && hasValue) {
+            traceFile = argv[++i];
+        } else if (cacheOption(argc, argv, i, cacheDir, cacheMB)) {
+            continue;
+        } else if (arg[0] != '-' && source.empty()) {
+            source = arg;
+        } else {
+            return usage();
+        }
+    }
+    if (source.empty())
+        return usage();
+
+    vector<BatchJob> jobs;
+    struct stat info;
+    bool listed = stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode)
+                      ? listDirectory(source, outDir, png, defaults, jobs)
+                      : readManifest(source, defaults, jobs);
+    if (!listed)
+        return 1;
+
+    ResultCache* cache = NULL;
+    if (!cacheDir.empty())
+        cache = new ResultCache(cacheMB << 20, cacheDir);
+    if (!traceFile.empty())
+        startTrace(traceFile);
+    BatchStats totals = runBatch(jobs, threads, memoryBudget, cache,
+                                 footprints);
+    if (!traceFile.empty())
+        stopTrace();
+    double seconds = totals.seconds > 0 ? totals.seconds : 1e-9;
+    cout << totals.images << " images (" << totals.failed << " failed) in "
+         << seconds << " s: " << totals.images / seconds << " images/s, "
+         << totals.megapixels / seconds << " MP/s, peak memory "
+         << (totals.peakMemory >> 20) << " MB (estimated)" << endl;
+    printCache(cache);
+    delete cache;
+    return totals.failed == 0 ? 0 : 1;
+}
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+// serves compress requests until SIGINT or SIGTERM
+static int serveMain(int argc, char* argv[]) {
+    if (argc < 3)
+        return usage();
+    unsigned int threads = 0;
+    string cacheDir;
+    size_t cacheMB = 256;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        long value;
+        if (arg == "-j" && i + 1 < argc) {
+            if (!parseCount(arg, argv[++i], INT_MAX, value))
+                return usage();
+            threads = value;
+        } else if (!cacheOption(argc, argv, i, cacheDir, cacheMB)) {
+            return usage();
+        }
+    }
+    ResultCache* cache = NULL;
+    if (!cacheDir.empty())
+        cache = new ResultCache(cacheMB << 20, cacheDir);
+    CompressionServer server(argv[2], threads, cache);
+    if (!server.start()) {
+        delete cache;
+        return 1;
+    }
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    while (!stopRequested)
+        pause();
+    server.stop();
+    double p50, p99;
+    size_t requests = server.latency(p50, p99);
+    cout << requests << " requests, latency p50 " << p50 << " us, p99 "
+         << p99 << " us" << endl;
+    printCache(cache);
+    delete cache;
+    return 0;
+}
+
+// loads a server with concurrent clients
+static int loadMain(int argc, char* argv[]) {
+    if (argc < 4)
+        return usage();
+    unsigned int clients = 4;
+    unsigned int requests = 10;
+    string settings;
+    for (int i = 4; i < argc; i++) {
+        string arg = argv[i];
+        long value;
+        if ((arg == "-c" || arg == "-n") && i + 1 < argc) {
+            if (!parseCount(arg, argv[++i], INT_MAX, value))
+                return usage();
+            if (arg == "-c")
+                clients = value;
+            else
+                requests = value;
+        } else {
+            settings += arg + " ";
+        }
+    }
+    LoadStats totals = loadTest(argv[2], argv[3], settings, clients, requests);
+    double seconds = totals.seconds > 0 ? totals.seconds : 1e-9;
+    cout << totals.requests << " requests (" << totals.failed << " failed) in "
+         << seconds << " s: " << totals.requests / seconds
+         << " requests/s, latency p50 " << totals.p50 << " us, p99 "
+         << totals.p99 << " us" << endl;
+    return totals.failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--serve")
+        return serveMain(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--load")
+        return loadMain(argc, argv);
+    if (argc > 1)
+        return batchMain(argc, argv);
+
     // read in image
     PNG origIm1;
     origIm1.readFromFile("images/orig/flower.png");
@@ -51,6 +284,11 @@ int main() {
     ppic2.writeToFile("images/out/output-prunedgarden.png");
     ppic3.writeToFile("images/out/output-prunedsky.png");
 
+    // the pruned trees themselves, in the native format
+    tCopy1.writeQtc("images/out/output-prunedflower.qtc");
+    tCopy2.writeQtc("images/out/output-prunedgarden.qtc");
+    tCopy3.writeQtc("images/out/output-prunedsky.qtc");
+
     // use it to build a quadtree
     qtvar v1(origIm4);
     qtvar vCopy1(v1);
@@ -72,6 +310,10 @@ int main() {
     vpic2.writeToFile("images/out/output-prunedvancouverDowntown-var.png");
     vpic3.writeToFile("images/out/output-prunedflower-var.png");
 
+    vCopy1.writeQtc("images/out/output-prunedsnowMountain-var.qtc");
+    vCopy2.writeQtc("images/out/output-prunedvancouverDowntown-var.qtc");
+    vCopy3.writeQtc("images/out/output-prunedflower-var.qtc");
+
     // comparisons
 
     qtcount countcomp(origIm1);
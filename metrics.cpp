@@ -0,0 +1,159 @@
+/**
+ *
+ * metrics.cpp
+ *
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "metrics.h"
+using namespace std;
+
+namespace {
+thread_local Metrics counters;
+// the innermost timer running on the thread
+thread_local PhaseTimer *active = NULL;
+// bytes allocated by the thread so far
+thread_local size_t allocated = 0;
+
+// the largest residentBytes() sample so far
+atomic<size_t> residentPeak(0);
+
+const char *const PHASE_NAMES[NUM_PHASES] = {"decode", "stats",  "build",
+                                             "prune",  "render", "encode"};
+}
+
+#ifdef QTC_METRICS
+// counts the bytes allocated by the thread; every other form of new
+// (nothrow, arrays) ends up here
+void *operator new(size_t size) {
+  allocated += size;
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == NULL)
+    throw bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+void Metrics::reset() {
+  for (int i = 0; i < NUM_PHASES; i++) {
+    seconds[i] = 0;
+    bytes[i] = 0;
+    peakRss[i] = 0;
+  }
+  nodesAllocated = 0;
+  nodesFreed = 0;
+  prunableCalls = 0;
+  checkLeafVisits = 0;
+  idealPruneIterations = 0;
+}
+
+string Metrics::toJson() const {
+  ostringstream out;
+  out << "{\"phases\": {";
+  for (int i = 0; i < NUM_PHASES; i++)
+    out << (i ? ", " : "") << "\"" << PHASE_NAMES[i]
+        << "\": {\"seconds\": " << seconds[i] << ", \"bytes\": " << bytes[i]
+        << ", \"peakRss\": " << peakRss[i] << "}";
+  out << "}, \"nodesAllocated\": " << nodesAllocated
+      << ", \"nodesFreed\": " << nodesFreed
+      << ", \"prunableCalls\": " << prunableCalls
+      << ", \"checkLeafVisits\": " << checkLeafVisits
+      << ", \"idealPruneIterations\": " << idealPruneIterations << "}";
+  return out.str();
+}
+
+bool metricsEnabled() {
+#ifdef QTC_METRICS
+  return true;
+#else
+  return false;
+#endif
+}
+
+Metrics &metrics() { return counters; }
+
+size_t heapBlockBytes(size_t size) {
+  // requests from the mmap threshold up get pages of their own
+  const size_t mmapThreshold = 128 * 1024;
+  const size_t header = sizeof(size_t);
+  if (size >= mmapThreshold) {
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    return (size + 2 * header + page - 1) / page * page;
+  }
+  // chunks are multiples of 16 bytes, with an 8-byte header, at least 32
+  size_t chunk = (size + header + 15) & ~(size_t)15;
+  return chunk < 32 ? 32 : chunk;
+}
+
+size_t residentBytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL)
+    return 0;
+  unsigned long size = 0, resident = 0;
+  int fields = fscanf(statm, "%lu %lu", &size, &resident);
+  fclose(statm);
+  size_t bytes = fields == 2 ? resident * sysconf(_SC_PAGE_SIZE) : 0;
+  size_t peak = residentPeak.load();
+  while (bytes > peak && !residentPeak.compare_exchange_weak(peak, bytes)) {
+  }
+  return bytes;
+}
+
+size_t peakResidentBytes() {
+  // the kernel's high-water marks are sampled lazily and can lag behind
+  // what statm reported, so they are combined with our own samples
+  size_t peak = 0;
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status != NULL) {
+    char line[256];
+    unsigned long kb;
+    while (fgets(line, sizeof line, status) != NULL)
+      if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+        peak = (size_t)kb * 1024;
+        break;
+      }
+    fclose(status);
+  }
+  struct rusage usage;
+  if (peak == 0 && getrusage(RUSAGE_SELF, &usage) == 0)
+    peak = (size_t)usage.ru_maxrss * 1024; // in kilobytes on Linux
+  peak = max(peak, residentBytes());
+  return max(peak, residentPeak.load());
+}
+
+const char *phaseName(MetricsPhase phase) { return PHASE_NAMES[phase]; }
+
+PhaseTimer::PhaseTimer(MetricsPhase phase) : phase(phase), outer(active) {
+  if (outer != NULL)
+    outer->charge();
+  active = this;
+  restart();
+}
+
+PhaseTimer::~PhaseTimer() {
+  charge();
+  counters.peakRss[phase] = max(counters.peakRss[phase], residentBytes());
+  active = outer;
+  if (outer != NULL)
+    outer->restart();
+}
+
+void PhaseTimer::charge() {
+  counters.seconds[phase] += chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  counters.bytes[phase] += allocated - startBytes;
+}
+
+void PhaseTimer::restart() {
+  start = chrono::steady_clock::now();
+  startBytes = allocated;
+}
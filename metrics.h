@@ -0,0 +1,134 @@
+/**
+ *
+ * metrics.h
+ * Opt-in performance counters and phase timings, and memory accounting.
+ *
+ * Built with QTC_METRICS defined (make METRICS=1), quadtree, stats and PNG
+ * count their work into the Metrics of the calling thread. Without it the
+ * QTC_COUNT and QTC_PHASE macros expand to nothing, and metrics() stays at
+ * zero.
+ *
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+/**
+ * Phases of a compression. Time and allocations are charged to the
+ * innermost phase running, so nested phases are not counted twice: the
+ * stats built by a quadtree constructor are charged to PHASE_STATS, the
+ * rest of the constructor to PHASE_BUILD.
+ */
+enum MetricsPhase {
+    PHASE_DECODE, // PNG and .qtc decoding
+    PHASE_STATS,  // stats tables, including the PNG decoding they stream
+    PHASE_BUILD,  // quadtree construction
+    PHASE_PRUNE,  // prune, pruneSize and idealPrune
+    PHASE_RENDER, // render and renderRegion
+    PHASE_ENCODE, // PNG, .qtc and artifact encoding
+    NUM_PHASES
+};
+
+/**
+ * Counters of the work done by a thread since the last reset.
+ */
+struct Metrics {
+    double seconds[NUM_PHASES];  // wall time
+    size_t bytes[NUM_PHASES];    // bytes allocated with new (lodepng's
+                                 // malloc calls are not seen)
+    size_t nodesAllocated;
+    size_t nodesFreed;
+    size_t prunableCalls;
+    size_t checkLeafVisits;      // nodes visited by qtcount::checkLeaf
+    size_t idealPruneIterations; // pruneSize calls made by idealPrune
+    size_t peakRss[NUM_PHASES];  // largest resident set seen at the end
+                                 // of the phase, in bytes
+
+    Metrics() { reset(); }
+
+    void reset();
+
+    /**
+     * @return the counters as a JSON object.
+     */
+    string toJson() const;
+};
+
+/**
+ * @return true, if the library was built with QTC_METRICS.
+ */
+bool metricsEnabled();
+
+/**
+ * @return the counters of the calling thread. Reset them before an
+ * operation and read them after it.
+ */
+Metrics &metrics();
+
+/**
+ * Name of a phase, as used in the JSON output.
+ */
+const char *phaseName(MetricsPhase phase);
+
+/**
+ * PhaseTimer: charges the time and the allocations of its scope to a phase
+ * of the calling thread's Metrics. Timers nest; while an inner one runs,
+ * the outer one is paused.
+ */
+class PhaseTimer {
+public:
+    PhaseTimer(MetricsPhase phase);
+    ~PhaseTimer();
+
+private:
+    PhaseTimer(const PhaseTimer &other);
+    PhaseTimer &operator=(const PhaseTimer &other);
+
+    // charges the time and bytes since the last start to the phase
+    void charge();
+    void restart();
+
+    MetricsPhase phase;
+    PhaseTimer *outer;
+    chrono::steady_clock::time_point start;
+    size_t startBytes;
+};
+
+/**
+ * Size of the heap block that new/malloc takes for a request of size bytes,
+ * as glibc's malloc rounds it: its header, alignment, and whole pages for
+ * the large blocks it maps on their own. glibc raises its mmap threshold
+ * as large blocks are freed, so those may come from the heap instead,
+ * which is within a page of the estimate.
+ */
+size_t heapBlockBytes(size_t size);
+
+/**
+ * @return the resident set size of the process, in bytes, or 0 if it is
+ * not known.
+ */
+size_t residentBytes();
+
+/**
+ * @return the largest resident set size the process has had, in bytes;
+ * never less than any residentBytes() seen before.
+ */
+size_t peakResidentBytes();
+
+#ifdef QTC_METRICS
+#define QTC_COUNT(counter) (metrics().counter++)
+#define QTC_PHASE_NAME(line) phaseTimer##line
+#define QTC_PHASE_AT(phase, line) PhaseTimer QTC_PHASE_NAME(line)(phase)
+#define QTC_PHASE(phase) QTC_PHASE_AT(phase, __LINE__)
+#else
+#define QTC_COUNT(counter) ((void)0)
+#define QTC_PHASE(phase) ((void)0)
+#endif
+
+#endif
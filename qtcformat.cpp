@@ -0,0 +1,1031 @@
+/**
+ *
+ * qtcformat.cpp
+ * The native .qtc file format of a (pruned) quadtree.
+ *
+ * Layout, all integers little endian:
+ *   "QTC" magic, version byte, flags byte
+ *   edge of the image (4 bytes)
+ *   raw: number of structure bits, entropy coded: number of nodes (4 bytes)
+ * then, if the QTC_FLAG_ENTROPY flag is not set:
+ *   structure bits, MSB first, padded to a byte: for every node of dim > 0
+ *     in pre-order (NW, NE, SE, SW), 1 if it has children, 0 if it is a leaf
+ *   r, g, b of every leaf, in pre-order
+ * or, if it is set, a range coded stream (see rangecoder.h) with, for every
+ * node in pre-order:
+ *   the split flag if dim > 0, in the context of dim and of the number of
+ *     split earlier siblings
+ *   the r, g, b residuals of avg from its prediction: the parent's avg for
+ *     the first three children, 4 * parent's avg - the other three for the
+ *     last child (about the same cost as coding the leaves only), 128 for
+ *     the root
+ * If QTC_FLAG_DAG is set as well, the tree may share subtrees (see
+ * quadtree::dedupe). Once a split node has been coded, the split flag of
+ * every further split node is followed by a flag, in the context of its dim,
+ * telling whether it is a reference to an earlier split node; if so, the
+ * index of that node among the split nodes coded so far (references
+ * excluded) follows, in as many bits as the largest index needs, and
+ * nothing else.
+ * If QTC_FLAG_PROGRESSIVE is set instead, the nodes are coded the same way
+ * but breadth-first, in segments of a 4-byte length and a range coded stream
+ * of its own (the contexts carry over): the root, then the children of up
+ * to QTC_SEGMENT_PARENTS split nodes of the previous level per segment.
+ * If QTC_FLAG_INDEXED is set instead, the entropy coded tree is cut at the
+ * nodes of a chosen dim, the tile dim:
+ *   tile dim (1 byte)
+ *   4-byte length and range coded stream of the tree above the cut; split
+ *     nodes on the cut are coded without their children
+ *   number of split nodes on the cut, the tiles (4 byte)
+ *   per tile, in pre-order: offset of its stream in the file (8 bytes) and
+ *     its number of nodes (4 bytes)
+ *   per tile, the range coded stream of its children and their subtrees,
+ *     starting from the contexts as they are after the tree above the cut
+ *
+ */
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include "compression/MappedFile.h"
+#include "qtcstream.h"
+#include "quadtree.h"
+#include "rangecoder.h"
+#include "trace.h"
+using namespace std;
+
+// Adaptive contexts of the entropy coded format, shared by the encoder and
+// the decoder which update them identically.
+struct QtcModel {
+  static const int DIMS = 32;
+  // residual contexts are kept apart by dim and by whether the color is
+  // that of a last child, which is predicted much better (see encodeQtcNode)
+  static const int SLOTS = 2 * DIMS;
+  // residuals of g and b are coded as differences from the residual of the
+  // previous channel, so they lie in [-510, 510]
+  static const int EXPONENTS = 9;
+  static const int CLASSES = 4;
+  // a reference costs about as much as coding a few nodes
+  static const size_t MIN_REFERENCE_NODES = 9;
+
+  RCProb split[DIMS][4];
+  // the bits of a residual are modeled by channel, slot and the magnitude
+  // class of the previous channel's coded residual (flat regions vs. edges)
+  RCProb zero[3][SLOTS][CLASSES];
+  RCProb sign[3][SLOTS];
+  // Exp-Golomb binarization of the magnitude: unary exponent, then mantissa
+  RCProb exponent[3][SLOTS][CLASSES][EXPONENTS];
+  RCProb mantissa[3][EXPONENTS][EXPONENTS];
+  // back-references to shared subtrees, if dag is set
+  RCProb reference[DIMS];
+  RCProb referenceBits[32];
+
+  bool dag;
+  // split nodes coded so far, other than references; the encoder only keeps
+  // the ids of the shared ones it refers to
+  unsigned int numDefined;
+  map<const quadtree::Node *, unsigned int> ids;
+  vector<quadtree::Node *> defined;
+  // number of nodes of the shared subtrees, as coded without references
+  map<const quadtree::Node *, size_t> sizes;
+
+  QtcModel() : dag(false), numDefined(0) {
+    fill_n(&split[0][0], sizeof(split) / sizeof(RCProb), RC_PROB_INIT);
+    fill_n(&zero[0][0][0], sizeof(zero) / sizeof(RCProb), RC_PROB_INIT);
+    fill_n(&sign[0][0], sizeof(sign) / sizeof(RCProb), RC_PROB_INIT);
+    fill_n(&exponent[0][0][0][0], sizeof(exponent) / sizeof(RCProb), RC_PROB_INIT);
+    fill_n(&mantissa[0][0][0], sizeof(mantissa) / sizeof(RCProb), RC_PROB_INIT);
+    fill_n(reference, DIMS, RC_PROB_INIT);
+    fill_n(referenceBits, 32, RC_PROB_INIT);
+  }
+
+  /** Whether a split node is followed by a reference flag. */
+  bool referable() const {
+    return dag && numDefined > 0;
+  }
+
+  size_t subtreeSize(const quadtree::Node *node) {
+    if (node->packed)
+      return 5;
+    if (node->NW == NULL)
+      return 1;
+    map<const quadtree::Node *, size_t>::iterator known = sizes.find(node);
+    if (known != sizes.end())
+      return known->second;
+    size_t size = 1 + subtreeSize(node->NW) + subtreeSize(node->NE) +
+                  subtreeSize(node->SE) + subtreeSize(node->SW);
+    if (node->refs > 1)
+      sizes[node] = size;
+    return size;
+  }
+
+  // number of bits of a reference index
+  int referenceWidth() const {
+    int width = 0;
+    while (((numDefined - 1) >> width) != 0)
+      width++;
+    return width;
+  }
+
+  /** Codes the reference flag of a node and, if it is one, the index. */
+  void encodeReference(RangeEncoder &enc, int dim, bool isReference,
+                       unsigned int index) {
+    enc.encodeBit(reference[min(dim, DIMS - 1)], isReference);
+    if (!isReference)
+      return;
+    for (int i = referenceWidth() - 1; i >= 0; i--)
+      enc.encodeBit(referenceBits[i], (index >> i) & 1);
+  }
+
+  /** Returns the referenced node, or NULL if the node is not a reference. */
+  quadtree::Node *decodeReference(RangeDecoder &dec, int dim, bool &corrupt) {
+    corrupt = false;
+    if (!dec.decodeBit(reference[min(dim, DIMS - 1)]))
+      return NULL;
+    unsigned int index = 0;
+    for (int i = referenceWidth() - 1; i >= 0; i--)
+      index = (index << 1) | dec.decodeBit(referenceBits[i]);
+    if (index >= defined.size() || defined[index]->dim != dim) {
+      corrupt = true;
+      return NULL;
+    }
+    return defined[index];
+  }
+
+  static int slot(int dim, bool lastChild) {
+    return min(dim, DIMS - 1) + (lastChild ? DIMS : 0);
+  }
+
+  // 0 for 0, then 1, 2..3 and 4 or more
+  static int magnitudeClass(int residual) {
+    int value = residual < 0 ? -residual : residual;
+    return value < 2 ? value : (value < 4 ? 2 : 3);
+  }
+
+  void encodeResidual(RangeEncoder &enc, int channel, int slot, int cls,
+                      int residual) {
+    enc.encodeBit(zero[channel][slot][cls], residual == 0);
+    if (residual == 0)
+      return;
+    enc.encodeBit(sign[channel][slot], residual < 0);
+    int value = residual < 0 ? -residual : residual;
+    int exp = 0;
+    while ((value >> (exp + 1)) != 0)
+      exp++;
+    for (int i = 0; i < exp; i++)
+      enc.encodeBit(exponent[channel][slot][cls][i], 1);
+    if (exp < EXPONENTS - 1)
+      enc.encodeBit(exponent[channel][slot][cls][exp], 0);
+    for (int i = exp - 1; i >= 0; i--)
+      enc.encodeBit(mantissa[channel][exp][i], (value >> i) & 1);
+  }
+
+  int decodeResidual(RangeDecoder &dec, int channel, int slot, int cls) {
+    if (dec.decodeBit(zero[channel][slot][cls]))
+      return 0;
+    bool negative = dec.decodeBit(sign[channel][slot]);
+    int exp = 0;
+    while (exp < EXPONENTS - 1 &&
+           dec.decodeBit(exponent[channel][slot][cls][exp]))
+      exp++;
+    int value = 1;
+    for (int i = exp - 1; i >= 0; i--)
+      value = (value << 1) | dec.decodeBit(mantissa[channel][exp][i]);
+    return negative ? -value : value;
+  }
+
+  void encodeColor(RangeEncoder &enc, int slot, const RGBAPixel &color,
+                   const RGBAPixel &predicted) {
+    int residuals[3] = {color.r - predicted.r, color.g - predicted.g,
+                        color.b - predicted.b};
+    int cls = 0;
+    for (int c = 0; c < 3; c++) {
+      int coded = residuals[c] - (c > 0 ? residuals[c - 1] : 0);
+      encodeResidual(enc, c, slot, cls, coded);
+      cls = magnitudeClass(coded);
+    }
+  }
+
+  /** Returns false if the decoded color is out of range (corrupt data). */
+  bool decodeColor(RangeDecoder &dec, int slot, RGBAPixel &color,
+                   const RGBAPixel &predicted) {
+    int values[3] = {predicted.r, predicted.g, predicted.b};
+    int residual = 0;
+    int cls = 0;
+    for (int c = 0; c < 3; c++) {
+      int coded = decodeResidual(dec, c, slot, cls);
+      residual += coded;
+      values[c] += residual;
+      if (values[c] < 0 || values[c] > 255)
+        return false;
+      cls = magnitudeClass(coded);
+    }
+    color = RGBAPixel(values[0], values[1], values[2]);
+    return true;
+  }
+
+  void encodeSplit(RangeEncoder &enc, int dim, int splitSiblings, bool split) {
+    if (dim > 0)
+      enc.encodeBit(this->split[dim][splitSiblings], split);
+  }
+
+  bool decodeSplit(RangeDecoder &dec, int dim, int splitSiblings) {
+    return dim > 0 && dec.decodeBit(split[dim][splitSiblings]);
+  }
+
+  /** Codes the split flag (if dim > 0) and the avg of a node. */
+  void encodeNode(RangeEncoder &enc, int dim, int splitSiblings, bool split,
+                  bool lastChild, const RGBAPixel &avg,
+                  const RGBAPixel &predicted) {
+    encodeSplit(enc, dim, splitSiblings, split);
+    encodeColor(enc, slot(dim, lastChild), avg, predicted);
+  }
+
+  /** Returns false if the data is corrupt. */
+  bool decodeNode(RangeDecoder &dec, int dim, int splitSiblings,
+                  bool lastChild, const RGBAPixel &predicted, bool &split,
+                  RGBAPixel &avg) {
+    split = decodeSplit(dec, dim, splitSiblings);
+    return decodeColor(dec, slot(dim, lastChild), avg, predicted);
+  }
+
+  /**
+   * Prediction of the last of four siblings: the parent's avg is about the
+   * mean of its children's, so the last child is about 4 * parent minus the
+   * other three.
+   */
+  static RGBAPixel predictLast(const RGBAPixel &parent, const RGBAPixel &a,
+                               const RGBAPixel &b, const RGBAPixel &c) {
+    int values[3] = {4 * parent.r - a.r - b.r - c.r,
+                     4 * parent.g - a.g - b.g - c.g,
+                     4 * parent.b - a.b - b.b - c.b};
+    for (int c = 0; c < 3; c++)
+      values[c] = max(0, min(255, values[c]));
+    return RGBAPixel(values[0], values[1], values[2]);
+  }
+};
+
+namespace {
+const unsigned char QTC_MAGIC[3] = {'Q', 'T', 'C'};
+const unsigned char QTC_VERSION = 1;
+const unsigned char QTC_FLAG_ENTROPY = 1;
+const unsigned char QTC_FLAG_PROGRESSIVE = 2;
+const unsigned char QTC_FLAG_INDEXED = 4;
+const unsigned char QTC_FLAG_DAG = 8;
+const size_t QTC_INDEX_ENTRY_SIZE = 12;
+const size_t QTC_HEADER_SIZE = 13;
+// a segment holds about 4 KB of nodes: small enough to show progress often,
+// large enough for the 5-byte flush and 4-byte length not to matter
+const size_t QTC_SEGMENT_PARENTS = 512;
+
+void putUint32(vector<unsigned char> &out, unsigned int value) {
+  for (int i = 0; i < 4; i++)
+    out.push_back((value >> (8 * i)) & 255);
+}
+
+unsigned int getUint32(const unsigned char *in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+void putUint64(vector<unsigned char> &out, size_t value) {
+  for (int i = 0; i < 8; i++)
+    out.push_back((uint64_t(value) >> (8 * i)) & 255);
+}
+
+uint64_t getUint64(const unsigned char *in) {
+  return getUint32(in) | (uint64_t(getUint32(in + 4)) << 32);
+}
+
+void putSegment(vector<unsigned char> &out, const vector<unsigned char> &segment) {
+  putUint32(out, segment.size());
+  out.insert(out.end(), segment.begin(), segment.end());
+}
+
+// validates the parts of the header common to all kinds of .qtc files
+bool checkHeader(const unsigned char *data, size_t size, unsigned int &edge) {
+  if (size < QTC_HEADER_SIZE || !equal(QTC_MAGIC, QTC_MAGIC + 3, data) ||
+      data[3] != QTC_VERSION)
+    return false;
+  edge = getUint32(data + 5);
+  return (edge & (edge - 1)) == 0 && edge <= (1u << 30);
+}
+}
+
+quadtree::quadtree()
+    : root(NULL), edge(0), artifact(NULL), artifactNodes(NULL) {}
+
+void quadtree::encodeQtc(vector<unsigned char> &out, bool entropyCoded) const {
+  QTC_PHASE(PHASE_ENCODE);
+  TraceSpan span("encode");
+  out.assign(QTC_MAGIC, QTC_MAGIC + 3);
+  out.push_back(QTC_VERSION);
+  out.push_back(entropyCoded ? QTC_FLAG_ENTROPY | QTC_FLAG_DAG : 0);
+  putUint32(out, root == NULL ? 0 : edge);
+
+  if (entropyCoded) {
+    vector<unsigned char> payload;
+    size_t numNodes = 0;
+    if (root != NULL) {
+      QtcModel model;
+      model.dag = true;
+      RangeEncoder enc(payload);
+      encodeQtcNode(root, RGBAPixel(128, 128, 128), false, 0, enc, model,
+                    numNodes);
+      enc.finish();
+    }
+    putUint32(out, numNodes);
+    out.insert(out.end(), payload.begin(), payload.end());
+    return;
+  }
+
+  vector<unsigned char> bits;
+  vector<unsigned char> colors;
+  size_t numBits = 0;
+  encodeQtcHelper(root, bits, numBits, colors);
+  putUint32(out, numBits);
+  out.reserve(out.size() + bits.size() + colors.size());
+  out.insert(out.end(), bits.begin(), bits.end());
+  out.insert(out.end(), colors.begin(), colors.end());
+}
+
+void quadtree::encodeQtcProgressive(vector<unsigned char> &out) const {
+  QTC_PHASE(PHASE_ENCODE);
+  TraceSpan span("encode");
+  out.assign(QTC_MAGIC, QTC_MAGIC + 3);
+  out.push_back(QTC_VERSION);
+  out.push_back(QTC_FLAG_ENTROPY | QTC_FLAG_PROGRESSIVE);
+  putUint32(out, root == NULL ? 0 : edge);
+  size_t numNodesPos = out.size();
+  putUint32(out, 0); // number of nodes, filled in at the end
+  if (root == NULL)
+    return;
+
+  QtcModel model;
+  vector<unsigned char> segment;
+  size_t numNodes = 1;
+  RangeEncoder rootEnc(segment);
+  bool rootSplit = root->NW != NULL || root->packed;
+  model.encodeNode(rootEnc, root->dim, 0, rootSplit, false, root->avg,
+                   RGBAPixel(128, 128, 128));
+  rootEnc.finish();
+  putSegment(out, segment);
+
+  vector<Node *> frontier;
+  if (rootSplit)
+    frontier.push_back(root);
+  while (!frontier.empty()) {
+    vector<Node *> nextFrontier;
+    for (size_t start = 0; start < frontier.size();
+         start += QTC_SEGMENT_PARENTS) {
+      size_t stop = min(frontier.size(), start + QTC_SEGMENT_PARENTS);
+      segment.clear();
+      RangeEncoder enc(segment);
+      for (size_t i = start; i < stop; i++) {
+        Node *parent = frontier[i];
+        numNodes += 4;
+        if (parent->packed) {
+          RGBAPixel leaves[4];
+          for (int c = 0; c < 4; c++)
+            leaves[c] = pixelOf(parent, c);
+          for (int c = 0; c < 4; c++) {
+            RGBAPixel predicted = parent->avg;
+            if (c == 3)
+              predicted = QtcModel::predictLast(parent->avg, leaves[0],
+                                                leaves[1], leaves[2]);
+            model.encodeNode(enc, 0, 0, false, c == 3, leaves[c], predicted);
+          }
+          continue;
+        }
+        Node *children[4] = {parent->NW, parent->NE, parent->SE, parent->SW};
+        int childSplits = 0;
+        for (int c = 0; c < 4; c++) {
+          RGBAPixel predicted = parent->avg;
+          if (c == 3)
+            predicted = QtcModel::predictLast(parent->avg, children[0]->avg,
+                                              children[1]->avg,
+                                              children[2]->avg);
+          bool split = children[c]->NW != NULL || children[c]->packed;
+          model.encodeNode(enc, children[c]->dim, childSplits, split, c == 3,
+                           children[c]->avg, predicted);
+          if (split) {
+            childSplits++;
+            nextFrontier.push_back(children[c]);
+          }
+        }
+      }
+      enc.finish();
+      putSegment(out, segment);
+    }
+    frontier.swap(nextFrontier);
+  }
+
+  for (int i = 0; i < 4; i++)
+    out[numNodesPos + i] = (numNodes >> (8 * i)) & 255;
+}
+
+void quadtree::encodeQtcIndexed(vector<unsigned char> &out, int tileDim) const {
+  QTC_PHASE(PHASE_ENCODE);
+  TraceSpan span("encode");
+  out.assign(QTC_MAGIC, QTC_MAGIC + 3);
+  out.push_back(QTC_VERSION);
+  out.push_back(QTC_FLAG_ENTROPY | QTC_FLAG_INDEXED);
+  putUint32(out, root == NULL ? 0 : edge);
+  size_t numNodesPos = out.size();
+  putUint32(out, 0); // number of nodes, filled in at the end
+  if (root == NULL)
+    return;
+
+  tileDim = max(0, min(tileDim, QtcModel::DIMS - 1));
+  out.push_back(tileDim);
+  QtcModel model;
+  vector<Node *> tiles;
+  vector<unsigned char> segment;
+  size_t numNodes = 0;
+  RangeEncoder enc(segment);
+  encodeQtcNode(root, RGBAPixel(128, 128, 128), false, 0, enc, model,
+                numNodes, tileDim, &tiles);
+  enc.finish();
+  putSegment(out, segment);
+
+  putUint32(out, tiles.size());
+  size_t indexPos = out.size();
+  out.resize(out.size() + QTC_INDEX_ENTRY_SIZE * tiles.size());
+  for (size_t i = 0; i < tiles.size(); i++) {
+    vector<unsigned char> entry;
+    putUint64(entry, out.size());
+    QtcModel tileModel = model;
+    RangeEncoder tileEnc(out);
+    size_t tileNodes = 0;
+    encodeQtcChildren(tiles[i], tileEnc, tileModel, tileNodes);
+    tileEnc.finish();
+    putUint32(entry, tileNodes);
+    std::copy(entry.begin(), entry.end(),
+              out.begin() + indexPos + QTC_INDEX_ENTRY_SIZE * i);
+    numNodes += tileNodes;
+  }
+
+  for (int i = 0; i < 4; i++)
+    out[numNodesPos + i] = (numNodes >> (8 * i)) & 255;
+}
+
+void quadtree::encodeQtcNode(Node *node, const RGBAPixel &predicted,
+                             bool lastChild, int splitSiblings,
+                             RangeEncoder &enc, QtcModel &model,
+                             size_t &numNodes, int tileDim,
+                             vector<Node *> *tiles) const {
+  numNodes++;
+  bool split = node->NW != NULL || node->packed;
+  model.encodeSplit(enc, node->dim, splitSiblings, split);
+  if (split && model.referable()) {
+    map<const Node *, unsigned int>::iterator id = model.ids.find(node);
+    bool isReference = id != model.ids.end();
+    model.encodeReference(enc, node->dim, isReference,
+                          isReference ? id->second : 0);
+    if (isReference)
+      return;
+  }
+  if (split && model.dag) {
+    // small subtrees are cheaper to code again than to refer to
+    if (node->refs > 1 &&
+        model.subtreeSize(node) >= QtcModel::MIN_REFERENCE_NODES)
+      model.ids[node] = model.numDefined;
+    model.numDefined++;
+  }
+  model.encodeColor(enc, QtcModel::slot(node->dim, lastChild), node->avg,
+                    predicted);
+  if (!split)
+    return;
+  if (node->dim == tileDim) {
+    tiles->push_back(node);
+    return;
+  }
+  encodeQtcChildren(node, enc, model, numNodes, tileDim, tiles);
+}
+
+void quadtree::encodeQtcChildren(Node *node, RangeEncoder &enc,
+                                 QtcModel &model, size_t &numNodes,
+                                 int tileDim, vector<Node *> *tiles) const {
+  // the first three children are predicted by this node's avg, the last one
+  // by what the avg leaves for it
+  if (node->packed) {
+    // pixel leaves, coded as encodeQtcNode codes a leaf of dim 0
+    RGBAPixel leaves[4];
+    for (int i = 0; i < 4; i++)
+      leaves[i] = pixelOf(node, i);
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel childPredicted = node->avg;
+      if (i == 3)
+        childPredicted = QtcModel::predictLast(node->avg, leaves[0], leaves[1],
+                                               leaves[2]);
+      numNodes++;
+      model.encodeColor(enc, QtcModel::slot(0, i == 3), leaves[i],
+                        childPredicted);
+    }
+    return;
+  }
+  Node *children[4] = {node->NW, node->NE, node->SE, node->SW};
+  int childSplits = 0;
+  for (int i = 0; i < 4; i++) {
+    RGBAPixel childPredicted = node->avg;
+    if (i == 3)
+      childPredicted = QtcModel::predictLast(node->avg, children[0]->avg,
+                                             children[1]->avg, children[2]->avg);
+    encodeQtcNode(children[i], childPredicted, i == 3, childSplits, enc, model,
+                  numNodes, tileDim, tiles);
+    if (children[i]->NW != NULL || children[i]->packed)
+      childSplits++;
+  }
+}
+
+quadtree::Node *quadtree::decodeQtcNode(pair<int, int> ul, int dim,
+                                        const RGBAPixel &predicted,
+                                        bool lastChild, int splitSiblings,
+                                        RangeDecoder &dec, QtcModel &model,
+                                        size_t &nodesLeft, int tileDim,
+                                        vector<Node *> *tiles) {
+  if (nodesLeft == 0)
+    return NULL;
+  nodesLeft--;
+  bool split = model.decodeSplit(dec, dim, splitSiblings);
+  if (split && model.referable()) {
+    bool corrupt;
+    Node *shared = model.decodeReference(dec, dim, corrupt);
+    if (corrupt)
+      return NULL;
+    if (shared != NULL) {
+      shared->refs++;
+      return shared;
+    }
+  }
+  RGBAPixel avg;
+  if (!model.decodeColor(dec, QtcModel::slot(dim, lastChild), avg, predicted))
+    return NULL;
+
+  Node *node = new Node(ul, dim, avg, 0);
+  if (split && model.dag) {
+    model.defined.push_back(node);
+    model.numDefined++;
+  }
+  if (!split)
+    return node;
+  if (dim == tileDim) {
+    tiles->push_back(node);
+    return node;
+  }
+  if (!decodeQtcChildren(node, dec, model, nodesLeft, tileDim, tiles)) {
+    // the decoder stops at the first error, so no reference to node is left
+    delete node;
+    return NULL;
+  }
+  return node;
+}
+
+bool quadtree::decodeQtcChildren(Node *node, RangeDecoder &dec,
+                                 QtcModel &model, size_t &nodesLeft,
+                                 int tileDim, vector<Node *> *tiles) {
+  int dim = node->dim - 1;
+  int num = 1 << dim;
+  pair<int, int> ul = node->upLeft;
+  pair<int, int> childUL[4] = {ul, make_pair(ul.first + num, ul.second),
+                               make_pair(ul.first + num, ul.second + num),
+                               make_pair(ul.first, ul.second + num)};
+  Node *children[4] = {NULL, NULL, NULL, NULL};
+  int childSplits = 0;
+  for (int i = 0; i < 4; i++) {
+    RGBAPixel childPredicted = node->avg;
+    if (i == 3)
+      childPredicted = QtcModel::predictLast(node->avg, children[0]->avg,
+                                             children[1]->avg, children[2]->avg);
+    children[i] = decodeQtcNode(childUL[i], dim, childPredicted, i == 3,
+                                childSplits, dec, model, nodesLeft, tileDim,
+                                tiles);
+    if (children[i] == NULL) {
+      for (int j = 0; j < i; j++)
+        clearHelper(children[j]);
+      return false;
+    }
+    // a split node on the cut has no children yet, but is the last tile
+    if (children[i]->NW != NULL ||
+        (tiles != NULL && !tiles->empty() && tiles->back() == children[i]))
+      childSplits++;
+  }
+  node->NW = children[0];
+  node->NE = children[1];
+  node->SE = children[2];
+  node->SW = children[3];
+  return true;
+}
+
+void quadtree::encodeQtcHelper(Node *node, vector<unsigned char> &bits,
+                               size_t &numBits,
+                               vector<unsigned char> &colors) const {
+  if (node == NULL)
+    return;
+  bool leaf = node->NW == NULL && !node->packed;
+  if (node->dim > 0) {
+    if (numBits % 8 == 0)
+      bits.push_back(0);
+    if (!leaf)
+      bits.back() |= 128 >> (numBits % 8);
+    numBits++;
+  }
+  if (leaf) {
+    colors.push_back(node->avg.r);
+    colors.push_back(node->avg.g);
+    colors.push_back(node->avg.b);
+    return;
+  }
+  if (node->packed) {
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel pixel = pixelOf(node, i);
+      colors.push_back(pixel.r);
+      colors.push_back(pixel.g);
+      colors.push_back(pixel.b);
+    }
+    return;
+  }
+  encodeQtcHelper(node->NW, bits, numBits, colors);
+  encodeQtcHelper(node->NE, bits, numBits, colors);
+  encodeQtcHelper(node->SE, bits, numBits, colors);
+  encodeQtcHelper(node->SW, bits, numBits, colors);
+}
+
+bool quadtree::decodeQtc(const unsigned char *data, size_t size) {
+  QTC_PHASE(PHASE_DECODE);
+  TraceSpan span("decode");
+  if (size > 4 && data[4] == (QTC_FLAG_ENTROPY | QTC_FLAG_INDEXED))
+    return decodeQtcRegion(data, size, 0, 0, 1 << 30, 1 << 30);
+
+  unsigned int progressiveEdge;
+  if (checkHeader(data, size, progressiveEdge) &&
+      data[4] == (QTC_FLAG_ENTROPY | QTC_FLAG_PROGRESSIVE)) {
+    // decode in one go, keeping the current tree, its pixel block and its
+    // artifact apart until it succeeded, since the stream clears the tree
+    Node *oldRoot = root;
+    int oldEdge = edge;
+    vector<unsigned char> oldPixels;
+    oldPixels.swap(pixels);
+    compression::MappedFile *oldArtifact = artifact;
+    const ArtifactNode *oldArtifactNodes = artifactNodes;
+    string oldArtifactFile = artifactFile;
+    root = NULL;
+    edge = 0;
+    artifact = NULL;
+    artifactNodes = NULL;
+    QtcStreamDecoder stream(*this);
+    if (!stream.push(data, size) || !stream.done()) {
+      clear();
+      root = oldRoot;
+      edge = oldEdge;
+      pixels.swap(oldPixels);
+      artifact = oldArtifact;
+      artifactNodes = oldArtifactNodes;
+      artifactFile = oldArtifactFile;
+      cerr << "QTC decoder error: corrupt tree data" << endl;
+      return false;
+    }
+    clearHelper(oldRoot);
+    delete oldArtifact;
+    return true;
+  }
+
+  if (size < QTC_HEADER_SIZE || !equal(QTC_MAGIC, QTC_MAGIC + 3, data)) {
+    cerr << "QTC decoder error: not a .qtc file" << endl;
+    return false;
+  }
+  if (data[3] != QTC_VERSION || (data[4] & ~(QTC_FLAG_ENTROPY | QTC_FLAG_DAG)) != 0 ||
+      data[4] == QTC_FLAG_DAG) {
+    cerr << "QTC decoder error: unsupported version " << (int)data[3] << endl;
+    return false;
+  }
+  unsigned int newEdge = getUint32(data + 5);
+  size_t numBits = getUint32(data + 9);
+  const unsigned char *bits = data + QTC_HEADER_SIZE;
+  const unsigned char *end = data + size;
+  if ((newEdge & (newEdge - 1)) != 0 || newEdge > (1u << 30) ||
+      (!(data[4] & QTC_FLAG_ENTROPY) &&
+       (size - QTC_HEADER_SIZE) < (numBits + 7) / 8)) {
+    cerr << "QTC decoder error: corrupt header" << endl;
+    return false;
+  }
+
+  Node *newRoot = NULL;
+  bool valid;
+  if (data[4] & QTC_FLAG_ENTROPY) {
+    size_t nodesLeft = numBits;
+    if (newEdge > 0) {
+      QtcModel model;
+      model.dag = (data[4] & QTC_FLAG_DAG) != 0;
+      RangeDecoder dec(bits, end - bits);
+      newRoot = decodeQtcNode(make_pair(0, 0), log2(newEdge),
+                              RGBAPixel(128, 128, 128), false, 0, dec, model,
+                              nodesLeft);
+      valid = newRoot != NULL && !dec.corrupt();
+    } else {
+      valid = bits == end;
+    }
+    valid = valid && nodesLeft == 0;
+  } else {
+    const unsigned char *colors = bits + (numBits + 7) / 8;
+    size_t bitPos = 0;
+    if (newEdge > 0) {
+      newRoot = decodeQtcHelper(make_pair(0, 0), log2(newEdge), bits, numBits,
+                                bitPos, colors, end);
+    }
+    valid = (newEdge == 0 || newRoot != NULL) && bitPos == numBits &&
+            colors == end;
+  }
+  if (!valid) {
+    clearHelper(newRoot);
+    cerr << "QTC decoder error: corrupt tree data" << endl;
+    return false;
+  }
+
+  clear();
+  root = newRoot;
+  edge = newEdge;
+  return true;
+}
+
+quadtree::Node *quadtree::decodeQtcHelper(pair<int, int> ul, int dim,
+                                          const unsigned char *bits,
+                                          size_t numBits, size_t &bitPos,
+                                          const unsigned char *&colors,
+                                          const unsigned char *end) {
+  bool leaf = true;
+  if (dim > 0) {
+    if (bitPos >= numBits)
+      return NULL;
+    leaf = ((bits[bitPos / 8] >> (7 - bitPos % 8)) & 1) == 0;
+    bitPos++;
+  }
+  if (leaf) {
+    if (end - colors < 3)
+      return NULL;
+    Node *node = new Node(ul, dim, RGBAPixel(colors[0], colors[1], colors[2]), 0);
+    colors += 3;
+    return node;
+  }
+
+  int num = pow(2, dim - 1);
+  Node *node = new Node(ul, dim, RGBAPixel(), 0);
+  node->NW = decodeQtcHelper(ul, dim - 1, bits, numBits, bitPos, colors, end);
+  if (node->NW != NULL)
+    node->NE = decodeQtcHelper(make_pair(ul.first + num, ul.second), dim - 1,
+                               bits, numBits, bitPos, colors, end);
+  if (node->NE != NULL)
+    node->SE = decodeQtcHelper(make_pair(ul.first + num, ul.second + num),
+                               dim - 1, bits, numBits, bitPos, colors, end);
+  if (node->SE != NULL)
+    node->SW = decodeQtcHelper(make_pair(ul.first, ul.second + num), dim - 1,
+                               bits, numBits, bitPos, colors, end);
+  if (node->SW == NULL) {
+    clearHelper(node);
+    return NULL;
+  }
+
+  // the internal averages are not stored, use the average of the children
+  Node *children[4] = {node->NW, node->NE, node->SE, node->SW};
+  int r = 0, g = 0, b = 0;
+  for (int i = 0; i < 4; i++) {
+    r += children[i]->avg.r;
+    g += children[i]->avg.g;
+    b += children[i]->avg.b;
+  }
+  node->avg = RGBAPixel(r / 4, g / 4, b / 4);
+  return node;
+}
+
+bool quadtree::writeQtc(const string &fileName, bool entropyCoded) const {
+  vector<unsigned char> data;
+  encodeQtc(data, entropyCoded);
+  ofstream file(fileName.c_str(), ios::out | ios::binary);
+  file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  if (!file) {
+    cerr << "QTC encoder error: could not write " << fileName << endl;
+    return false;
+  }
+  return true;
+}
+
+bool quadtree::decodeQtcRegion(const unsigned char *data, size_t size, int x,
+                               int y, int width, int height) {
+  QTC_PHASE(PHASE_DECODE);
+  TraceSpan span("decode");
+  unsigned int newEdge;
+  if (!checkHeader(data, size, newEdge) ||
+      data[4] != (QTC_FLAG_ENTROPY | QTC_FLAG_INDEXED)) {
+    cerr << "QTC decoder error: not an indexed .qtc file" << endl;
+    return false;
+  }
+  size_t nodesLeft = getUint32(data + 9);
+  if (newEdge == 0) {
+    clear();
+    return size == QTC_HEADER_SIZE;
+  }
+
+  // the tree above the cut, always decoded
+  size_t pos = QTC_HEADER_SIZE;
+  size_t topSize = 0;
+  if (size - pos >= 5)
+    topSize = getUint32(data + pos + 1);
+  if (size - pos < 5 || size - pos - 5 < topSize) {
+    cerr << "QTC decoder error: corrupt header" << endl;
+    return false;
+  }
+  int tileDim = data[pos];
+  QtcModel model;
+  vector<Node *> tiles;
+  RangeDecoder dec(data + pos + 5, topSize);
+  Node *newRoot = decodeQtcNode(make_pair(0, 0), log2(newEdge),
+                                RGBAPixel(128, 128, 128), false, 0, dec, model,
+                                nodesLeft, tileDim, &tiles);
+  pos += 5 + topSize;
+  bool valid = newRoot != NULL && !dec.corrupt() && size - pos >= 4 &&
+               getUint32(data + pos) == tiles.size() &&
+               (size - pos - 4) / QTC_INDEX_ENTRY_SIZE >= tiles.size();
+  pos += 4;
+
+  // the tiles that intersect the rectangle, from their index entries
+  for (size_t i = 0; valid && i < tiles.size(); i++) {
+    Node *tile = tiles[i];
+    int side = 1 << tile->dim;
+    if (tile->upLeft.first >= x + width || tile->upLeft.first + side <= x ||
+        tile->upLeft.second >= y + height || tile->upLeft.second + side <= y)
+      continue;
+    const unsigned char *entry = data + pos + QTC_INDEX_ENTRY_SIZE * i;
+    uint64_t start = getUint64(entry);
+    uint64_t end = i + 1 < tiles.size() ? getUint64(entry + QTC_INDEX_ENTRY_SIZE) : size;
+    size_t tileNodes = getUint32(entry + 8);
+    if (start > end || end > size || tileNodes > nodesLeft) {
+      valid = false;
+      break;
+    }
+    QtcModel tileModel = model;
+    RangeDecoder tileDec(data + start, end - start);
+    valid = decodeQtcChildren(tile, tileDec, tileModel, tileNodes) &&
+            !tileDec.corrupt() && tileNodes == 0;
+  }
+  if (!valid) {
+    clearHelper(newRoot);
+    cerr << "QTC decoder error: corrupt tree data" << endl;
+    return false;
+  }
+
+  clear();
+  root = newRoot;
+  edge = newEdge;
+  return true;
+}
+
+bool quadtree::readQtc(const string &fileName) {
+  MappedFile file(fileName);
+  if (file.error()) {
+    cerr << "QTC decoder error: could not open " << fileName << endl;
+    return false;
+  }
+  return decodeQtc(file.data(), file.size());
+}
+
+bool quadtree::readQtcRegion(const string &fileName, int x, int y, int width,
+                             int height) {
+  MappedFile file(fileName, false);
+  if (file.error()) {
+    cerr << "QTC decoder error: could not open " << fileName << endl;
+    return false;
+  }
+  return decodeQtcRegion(file.data(), file.size(), x, y, width, height);
+}
+
+QtcStreamDecoder::QtcStreamDecoder(quadtree &tree)
+    : tree(tree), model(new QtcModel), consumed(0), headerRead(false),
+      failed(false), edge(0), nodesLeft(0), frontierPos(0) {}
+
+QtcStreamDecoder::~QtcStreamDecoder() { delete model; }
+
+bool QtcStreamDecoder::push(const unsigned char *data, size_t size) {
+  QTC_PHASE(PHASE_DECODE);
+  TraceSpan span("decode");
+  if (failed)
+    return false;
+  buffer.insert(buffer.end(), data, data + size);
+
+  size_t pos = 0;
+  if (!headerRead) {
+    if (buffer.size() < QTC_HEADER_SIZE)
+      return true;
+    if (!checkHeader(buffer.data(), buffer.size(), edge) ||
+        buffer[4] != (QTC_FLAG_ENTROPY | QTC_FLAG_PROGRESSIVE)) {
+      failed = true;
+      return false;
+    }
+    nodesLeft = getUint32(buffer.data() + 9);
+    tree.clear();
+    headerRead = true;
+    pos = QTC_HEADER_SIZE;
+  }
+
+  while (buffer.size() - pos >= 4) {
+    size_t length = getUint32(buffer.data() + pos);
+    if (buffer.size() - pos - 4 < length)
+      break;
+    // a segment after the last one is corrupt data too
+    if (done() || !decodeSegment(buffer.data() + pos + 4, length)) {
+      failed = true;
+      return false;
+    }
+    pos += 4 + length;
+  }
+  buffer.erase(buffer.begin(), buffer.begin() + pos);
+  consumed += pos;
+  return true;
+}
+
+bool QtcStreamDecoder::done() const {
+  return headerRead && !failed && nodesLeft == 0 &&
+         (edge == 0 || (tree.root != NULL && frontier.empty()));
+}
+
+size_t QtcStreamDecoder::bytesDecoded() const { return consumed; }
+
+bool QtcStreamDecoder::decodeSegment(const unsigned char *data, size_t size) {
+  RangeDecoder dec(data, size);
+  bool split;
+  RGBAPixel avg;
+
+  if (tree.root == NULL) {
+    if (edge == 0 || nodesLeft == 0)
+      return false;
+    int dim = log2(edge);
+    if (!model->decodeNode(dec, dim, 0, false, RGBAPixel(128, 128, 128), split,
+                           avg) ||
+        dec.corrupt())
+      return false;
+    nodesLeft--;
+    tree.root = new quadtree::Node(make_pair(0, 0), dim, avg, 0);
+    tree.edge = edge;
+    if (split)
+      frontier.push_back(tree.root);
+    return true;
+  }
+
+  size_t stop = min(frontier.size(), frontierPos + QTC_SEGMENT_PARENTS);
+  if (frontierPos >= stop || nodesLeft < 4 * (stop - frontierPos))
+    return false;
+
+  // decode all the children of the segment before attaching any, so that
+  // corrupt data leaves the tree as it was
+  vector<quadtree::Node *> children;
+  vector<bool> splits;
+  bool valid = true;
+  for (size_t i = frontierPos; i < stop && valid; i++) {
+    quadtree::Node *parent = frontier[i];
+    int dim = parent->dim - 1;
+    int num = 1 << dim;
+    pair<int, int> ul = parent->upLeft;
+    pair<int, int> childUL[4] = {ul, make_pair(ul.first + num, ul.second),
+                                 make_pair(ul.first + num, ul.second + num),
+                                 make_pair(ul.first, ul.second + num)};
+    size_t first = children.size();
+    int childSplits = 0;
+    for (int c = 0; c < 4 && valid; c++) {
+      RGBAPixel predicted = parent->avg;
+      if (c == 3)
+        predicted = QtcModel::predictLast(parent->avg, children[first]->avg,
+                                          children[first + 1]->avg,
+                                          children[first + 2]->avg);
+      valid = model->decodeNode(dec, dim, childSplits, c == 3, predicted,
+                                split, avg);
+      if (valid) {
+        children.push_back(new quadtree::Node(childUL[c], dim, avg, 0));
+        splits.push_back(split);
+        childSplits += split;
+      }
+    }
+  }
+  if (!valid || dec.corrupt()) {
+    for (size_t i = 0; i < children.size(); i++)
+      delete children[i];
+    return false;
+  }
+
+  for (size_t i = frontierPos; i < stop; i++) {
+    size_t first = 4 * (i - frontierPos);
+    quadtree::Node *parent = frontier[i];
+    parent->NW = children[first];
+    parent->NE = children[first + 1];
+    parent->SE = children[first + 2];
+    parent->SW = children[first + 3];
+  }
+  for (size_t i = 0; i < children.size(); i++) {
+    if (splits[i])
+      nextFrontier.push_back(children[i]);
+  }
+  nodesLeft -= children.size();
+  frontierPos = stop;
+  if (frontierPos == frontier.size()) {
+    frontier.swap(nextFrontier);
+    nextFrontier.clear();
+    frontierPos = 0;
+  }
+  return true;
+}
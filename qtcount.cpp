@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <climits>
+
 #include "qtcount.h"
 #include "compression/RGBAPixel.h"
 
@@ -6,12 +9,13 @@
 //within tolerance of its average. Distances between colours are computed as the sum, 
 //over each colour channel, of the pixel value differences, squared. 
 bool qtcount::prunable(Node *node, const int tol) const {
+  QTC_COUNT(prunableCalls);
   // if node is empty, not prunable
   if (node == NULL)
     return false;
 
   // if come to leave, is prunable
-  if (node->NW == NULL)
+  if (node->NW == NULL && !node->packed)
     return true;
 
   return checkLeaf(node, node, tol);
@@ -19,6 +23,17 @@ bool qtcount::prunable(Node *node, const int tol) const {
 
 bool qtcount::checkLeaf(Node* cur, Node* root, const int tol) const {
   if(cur == NULL) return true;
+  QTC_COUNT(checkLeafVisits);
+  // the pixel leaves of a packed node are read from the block
+  if (cur->packed) {
+    const unsigned char *pixels = pixelsOf(cur);
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel pixel(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2]);
+      if (colrDist(pixel, root->avg) > tol)
+        return false;
+    }
+    return true;
+  }
   //arrive at leave, check
   if(cur->NW == NULL){
     return colrDist(cur->avg, root->avg) <= tol;
@@ -32,6 +47,30 @@ bool qtcount::checkLeaf(Node* cur, Node* root, const int tol) const {
 
 
 
+// A leaf is always prunable, an internal node once tol reaches the largest
+// distance of its leaves.
+int64_t qtcount::pruneTolerance(Node *node) const {
+  if (node->NW == NULL && !node->packed)
+    return INT_MIN;
+  return maxLeafDist(node, node);
+}
+
+long qtcount::maxLeafDist(Node* cur, Node* root) const {
+  if (cur == NULL) return 0;
+  if (cur->packed) {
+    const unsigned char *pixels = pixelsOf(cur);
+    long dist = 0;
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel pixel(pixels[3 * i], pixels[3 * i + 1], pixels[3 * i + 2]);
+      dist = std::max(dist, colrDist(pixel, root->avg));
+    }
+    return dist;
+  }
+  if (cur->NW == NULL) return colrDist(cur->avg, root->avg);
+  return std::max(std::max(maxLeafDist(cur->NW, root), maxLeafDist(cur->NE, root)),
+                  std::max(maxLeafDist(cur->SE, root), maxLeafDist(cur->SW, root)));
+}
+
 // Distances between colours are computed as the sum, over each colour channel,
 //  of the pixel value differences, squared.
 long qtcount::colrDist(RGBAPixel &a1, RGBAPixel &a2) const {
@@ -39,4 +78,4 @@ long qtcount::colrDist(RGBAPixel &a1, RGBAPixel &a2) const {
   long g = a1.g - a2.g;
   long b = a1.b - a2.b;
   return (r * r + g * g + b * b);
-}
\ No newline at end of file
+}
@@ -14,13 +14,18 @@ using namespace compression;
 class qtcount : public quadtree {
 public:
     qtcount(PNG& im) : quadtree(im) {}
+    qtcount() {}
+    qtcount(const string& fileName) : quadtree(fileName) {}
 
 private:
     bool prunable(Node* node, const int tol) const;
+    int64_t pruneTolerance(Node* node) const;
     //ADD
     long colrDist(RGBAPixel& a1, RGBAPixel& a2) const;
     //ADD
     bool checkLeaf(Node* cur, Node* root, const int tol) const;
+    //ADD
+    long maxLeafDist(Node* cur, Node* root) const;
 };
 
 #endif
@@ -0,0 +1,79 @@
+/**
+ *
+ * qtcstream.h
+ * Incremental decoder of progressive .qtc files.
+ *
+ */
+
+#ifndef _QTCSTREAM_H_
+#define _QTCSTREAM_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "quadtree.h"
+
+using namespace std;
+
+/**
+ * QtcStreamDecoder: decodes a progressive .qtc file (see
+ * quadtree::encodeQtcProgressive) as its bytes arrive, for example from a
+ * slow network connection.
+ *
+ * The file is made of segments, each holding the children of a run of nodes
+ * of the previous level, so the tree grows from the root downward. After
+ * every push the target tree holds all the segments received so far and can
+ * be rendered: nodes whose children have not arrived yet are drawn in their
+ * own avg, the average of the region they cover.
+ */
+class QtcStreamDecoder {
+public:
+    /**
+     * Creates a decoder that fills the given tree. The current contents
+     * of the tree are discarded on the first push.
+     * @param tree The tree to decode into.
+     */
+    QtcStreamDecoder(quadtree &tree);
+
+    ~QtcStreamDecoder();
+
+    /**
+     * Feeds the next bytes of the file to the decoder, in any chunk size.
+     * Decodes every segment that is complete into the tree.
+     * @return false, if the data is corrupt. Decoding stops; the tree keeps
+     * the segments decoded before the error.
+     */
+    bool push(const unsigned char *data, size_t size);
+
+    /**
+     * @return true, once the whole tree has been decoded.
+     */
+    bool done() const;
+
+    /**
+     * @return the number of bytes that have been decoded into the tree,
+     * including the header.
+     */
+    size_t bytesDecoded() const;
+
+private:
+    QtcStreamDecoder(const QtcStreamDecoder &other);
+    QtcStreamDecoder &operator=(const QtcStreamDecoder &other);
+
+    // decodes the segment data[0, size) into the tree
+    bool decodeSegment(const unsigned char *data, size_t size);
+
+    quadtree &tree;
+    QtcModel *model;              // contexts, carried from segment to segment
+    vector<unsigned char> buffer; // received bytes not decoded yet
+    size_t consumed;              // bytes decoded so far
+    bool headerRead;
+    bool failed;
+    unsigned int edge;
+    size_t nodesLeft;             // number of nodes announced by the header, not decoded yet
+    vector<quadtree::Node *> frontier;     // split nodes of the deepest complete level
+    vector<quadtree::Node *> nextFrontier; // split nodes of the level being decoded
+    size_t frontierPos;           // first node of frontier whose children are not decoded
+};
+
+#endif
@@ -1,8 +1,23 @@
+#include <algorithm>
+#include <climits>
+
 #include "qtvar.h"
 
 
 //A node is pruned if its variance is less than tolerance.
 bool qtvar::prunable(Node* node, const int tol) const {
+    QTC_COUNT(prunableCalls);
     if(node->var < tol) return true;
     return false;
 }
+
+// the var of a node is known before its children are built
+bool qtvar::prunableAtBuild(const RGBAPixel& avg, double var, const int tol) const {
+    return var < tol;
+}
+
+// prunable when tol > var
+int64_t qtvar::pruneTolerance(Node* node) const {
+    double tol = floor(node->var) + 1;
+    return tol > INT_MAX ? (int64_t)INT_MAX + 1 : (int64_t)max(tol, (double)INT_MIN);
+}
@@ -14,9 +14,21 @@ using namespace compression;
 class qtvar : public quadtree {
 public:
     qtvar(PNG& im) : quadtree(im) {}
+    qtvar() {}
+    qtvar(const string& fileName) : quadtree(fileName) {}
+
+    /**
+     * Builds the tree for prunes at minTol or above only: nodes with var
+     * below minTol are built as leaves (see quadtree::build). Prunes at
+     * minTol or above give the same tree as with the full build.
+     */
+    qtvar(PNG& im, int minTol) { build(im, minTol); }
+    qtvar(const string& fileName, int minTol) { build(fileName, minTol); }
 
 private:
     bool prunable(Node* node, const int tol) const;
+    bool prunableAtBuild(const RGBAPixel& avg, double var, const int tol) const;
+    int64_t pruneTolerance(Node* node) const;
 };
 
 #endif
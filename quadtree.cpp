@@ -5,20 +5,54 @@
  * quadtree.cpp
  *
  */
+#include <climits>
+#include <functional>
 #include <iostream>
+#include <queue>
+#include <typeinfo>
 #include "quadtree.h"
+#include "trace.h"
+#include "compression/MappedFile.h"
 #include "compression/RGBAPixel.h"
 using namespace std;
 
 // Node constructor
 quadtree::Node::Node(pair<int, int> ul, int d, RGBAPixel a, double v)
-    : upLeft(ul), dim(d), avg(a), var(v), NW(nullptr), NE(nullptr), SE(nullptr),
-      SW(nullptr) {}
+    : upLeft(ul), dim(d), packed(false), refs(1), avg(a), var(v), NW(nullptr),
+      NE(nullptr), SE(nullptr), SW(nullptr) {}
+
+namespace {
+// the pixel of leaf i (NW, NE, SE, SW) of the node of dim 1 at ul
+pair<int, int> pixelPos(pair<int, int> ul, int i) {
+  return make_pair(ul.first + (i == 1 || i == 2), ul.second + (i >= 2));
+}
+
+// the bits of v, spaced out to the even bits
+uint64_t spreadBits(uint64_t v) {
+  v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+  v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+  v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+  v = (v | (v << 2)) & 0x3333333333333333ull;
+  v = (v | (v << 1)) & 0x5555555555555555ull;
+  return v;
+}
+
+// Where the pixel of leaf i of the node of dim 1 at ul is in the pixel
+// block. The nodes of dim 1 are laid out in Z-order, so the pixels of a
+// subtree are close together, as its nodes were.
+size_t pixelIndex(pair<int, int> ul, int i) {
+  uint64_t z = spreadBits(ul.first / 2) | (spreadBits(ul.second / 2) << 1);
+  return 12 * z + 3 * i;
+}
+}
 
 // quadtree destructor
 quadtree::~quadtree() { clear(); }
 // quadtree copy constructor
-quadtree::quadtree(const quadtree &other) { copy(other); }
+quadtree::quadtree(const quadtree &other)
+    : artifact(NULL), artifactNodes(NULL) {
+  copy(other);
+}
 // quadtree assignment operator
 quadtree &quadtree::operator=(const quadtree &rhs) {
   if (this != &rhs) {
@@ -29,7 +63,21 @@ quadtree &quadtree::operator=(const quadtree &rhs) {
 }
 
 // Node* buildTree(stats& s, pair<int, int> ul, int dim);
-quadtree::quadtree(PNG &imIn) {
+quadtree::quadtree(PNG &imIn)
+    : root(NULL), edge(0), artifact(NULL), artifactNodes(NULL) {
+  // prunableAtBuild can not be called before the derived class exists
+  build(imIn, INT_MIN);
+}
+
+quadtree::quadtree(const string &fileName)
+    : root(NULL), edge(0), artifact(NULL), artifactNodes(NULL) {
+  build(fileName, INT_MIN);
+}
+
+void quadtree::build(PNG &imIn, const int minTol) {
+  QTC_PHASE(PHASE_BUILD);
+  TraceSpan span("build");
+  clear();
   // Find the smaller dimension, becasue the image maybe not a square
   edge = min(imIn.width(), imIn.height());
   // Find the largest power of 2 that fits within this dimension
@@ -37,59 +85,213 @@ quadtree::quadtree(PNG &imIn) {
    // Set edge to be 2^dim
   edge = pow(2, dim);
   stats s(imIn);
-  root = buildTree(s, make_pair(0, 0), dim);
+  if (edge > 1)
+    pixels.assign(3 * (size_t)edge * edge, 0);
+  root = buildTree(s, make_pair(0, 0), dim, minTol);
+  releasePixels();
+}
+
+void quadtree::build(const string &fileName, const int minTol) {
+  QTC_PHASE(PHASE_BUILD);
+  TraceSpan span("build");
+  clear();
+  unsigned int width, height;
+  stats s(fileName, width, height);
+  if (width == 0 || height == 0)
+    return;
+  edge = min(width, height);
+  int dim = log2(edge);
+  edge = pow(2, dim);
+  if (edge > 1)
+    pixels.assign(3 * (size_t)edge * edge, 0);
+  root = buildTree(s, make_pair(0, 0), dim, minTol);
+  releasePixels();
 }
 
-quadtree::Node *quadtree::buildTree(stats &s, pair<int, int> ul, int dim) {
+bool quadtree::prunableAtBuild(const RGBAPixel &avg, double var,
+                               const int tol) const {
+  return false;
+}
+
+size_t quadtree::buildFootprint(unsigned int width, unsigned int height) {
+  size_t edge = 0;
+  if (width > 0 && height > 0)
+    edge = pow(2, (int)log2(min(width, height)));
+  // a full tree has (edge^2 - 1) / 3 nodes above its pixel leaves
+  size_t nodes = edge > 1 ? (edge * edge - 1) / 3 : edge;
+  size_t pixelBytes = edge > 1 ? heapBlockBytes(3 * edge * edge) : 0;
+  return PNG::footprint(width, height) + stats::footprint(width, height) +
+         nodes * heapBlockBytes(sizeof(Node)) + pixelBytes;
+}
+
+TreeFootprint quadtree::footprint() const {
+  TreeFootprint total;
+  total.nodeBytes = heapBlockBytes(sizeof(Node));
+  if (artifact != NULL) {
+    // the records are in pre-order, and the root holds the whole array
+    int rootDim = artifactNodes[0].dim;
+    for (size_t i = 0; i < artifactNodes[0].size; i++) {
+      size_t level = rootDim - artifactNodes[i].dim;
+      if (level >= total.nodesByLevel.size())
+        total.nodesByLevel.resize(level + 1, 0);
+      total.nodesByLevel[level]++;
+    }
+    total.nodes = artifactNodes[0].size;
+    total.mappedBytes = artifact->size();
+    return total;
+  }
+  set<Node *> shared;
+  footprintHelper(root, 0, total, shared);
+  if (pixels.capacity() > 0)
+    total.pixelBytes = heapBlockBytes(pixels.capacity());
+  total.bytes = total.nodes * total.nodeBytes + total.pixelBytes;
+  return total;
+}
+
+void quadtree::footprintHelper(Node *node, size_t level, TreeFootprint &total,
+                               set<Node *> &shared) const {
+  if (node == NULL)
+    return;
+  if (node->refs > 1 && !shared.insert(node).second)
+    return;
+  if (level >= total.nodesByLevel.size())
+    total.nodesByLevel.resize(level + 1, 0);
+  total.nodesByLevel[level]++;
+  total.nodes++;
+  if (node->packed)
+    total.pixelLeaves += 4;
+  footprintHelper(node->NW, level + 1, total, shared);
+  footprintHelper(node->NE, level + 1, total, shared);
+  footprintHelper(node->SE, level + 1, total, shared);
+  footprintHelper(node->SW, level + 1, total, shared);
+}
+
+quadtree::Node *quadtree::buildTree(stats &s, pair<int, int> ul, int dim,
+                                    const int minTol) {
   RGBAPixel avg = s.getAvg(ul, dim);
   double var = s.getVar(ul, dim);
   Node *node = new Node(ul, dim, avg, var);
   if (dim == 0)
     return node;
+  // no prune at minTol or above would keep the subtree
+  if (minTol != INT_MIN && prunableAtBuild(avg, var, minTol))
+    return node;
+  if (dim == 1) {
+    node->packed = true;
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel pixel = s.getAvg(pixelPos(ul, i), 0);
+      unsigned char *p = &pixels[pixelIndex(ul, i)];
+      p[0] = pixel.r;
+      p[1] = pixel.g;
+      p[2] = pixel.b;
+    }
+    return node;
+  }
   int childrenDim = dim - 1;
   int num = pow(2, childrenDim);
 
-  node->NW = buildTree(s, ul, childrenDim);
-  node->NE = buildTree(s, make_pair(ul.first + num, ul.second), childrenDim);
-  node->SE =
-      buildTree(s, make_pair(ul.first + num, ul.second + num), childrenDim);
-  node->SW = buildTree(s, make_pair(ul.first, ul.second + num), childrenDim);
+  node->NW = buildTree(s, ul, childrenDim, minTol);
+  node->NE = buildTree(s, make_pair(ul.first + num, ul.second), childrenDim,
+                       minTol);
+  node->SE = buildTree(s, make_pair(ul.first + num, ul.second + num),
+                       childrenDim, minTol);
+  node->SW = buildTree(s, make_pair(ul.first, ul.second + num), childrenDim,
+                       minTol);
 
   return node;
 }
 
 PNG quadtree::render() const {
+  QTC_PHASE(PHASE_RENDER);
+  TraceSpan span("render");
   PNG ret(edge, edge);
-  renderHelper(root, ret);
+  if (artifact != NULL)
+    renderArtifact(0, ret, 0, 0);
+  else
+    renderHelper(root, ret, 0, 0);
   return ret;
 }
 
-void quadtree::renderHelper(Node *node, PNG &img) const {
+// (x, y) is the upper left corner of the node's square. It is passed down
+// rather than read from upLeft, because a shared node (see dedupe) is drawn
+// at several places.
+void quadtree::renderHelper(Node *node, PNG &img, int x, int y) const {
   if (node == NULL)
     return;
- if (node->NW == NULL) {
-    int size = pow(2, node->dim);
-    for (int x = node->upLeft.first; x < (node->upLeft.first + size); x++) {
-      for (int y = node->upLeft.second; y < (node->upLeft.second + size); y++) {
-        *img.getPixel(x, y) = node->avg;
+  int size = pow(2, node->dim);
+  if (node->packed) {
+    for (int i = 0; i < 4; i++) {
+      pair<int, int> pos = pixelPos(make_pair(x, y), i);
+      *img.getPixel(pos.first, pos.second) = pixelOf(node, i);
+    }
+  } else if (node->NW == NULL) {
+    for (int px = x; px < (x + size); px++) {
+      for (int py = y; py < (y + size); py++) {
+        *img.getPixel(px, py) = node->avg;
       }
     }
 
   } else {
-    renderHelper(node->NW, img);
-    renderHelper(node->NE, img);
-    renderHelper(node->SE, img);
-    renderHelper(node->SW, img);
+    int half = size / 2;
+    renderHelper(node->NW, img, x, y);
+    renderHelper(node->NE, img, x + half, y);
+    renderHelper(node->SE, img, x + half, y + half);
+    renderHelper(node->SW, img, x, y + half);
+  }
+}
+
+PNG quadtree::renderRegion(int x, int y, int width, int height) const {
+  QTC_PHASE(PHASE_RENDER);
+  TraceSpan span("render");
+  PNG ret(width, height);
+  renderRegionHelper(root, ret, x, y, 0, 0);
+  return ret;
+}
+
+void quadtree::renderRegionHelper(Node *node, PNG &img, int x, int y,
+                                  int nodeX, int nodeY) const {
+  if (node == NULL)
+    return;
+  int size = pow(2, node->dim);
+  // the part of the node's square inside the region
+  int left = max(nodeX, x);
+  int top = max(nodeY, y);
+  int right = min(nodeX + size, x + (int)img.width());
+  int bottom = min(nodeY + size, y + (int)img.height());
+  if (left >= right || top >= bottom)
+    return;
+  if (node->packed) {
+    for (int i = 0; i < 4; i++) {
+      pair<int, int> pos = pixelPos(make_pair(nodeX, nodeY), i);
+      if (pos.first >= left && pos.first < right && pos.second >= top &&
+          pos.second < bottom)
+        *img.getPixel(pos.first - x, pos.second - y) = pixelOf(node, i);
+    }
+  } else if (node->NW == NULL) {
+    for (int px = left; px < right; px++) {
+      for (int py = top; py < bottom; py++) {
+        *img.getPixel(px - x, py - y) = node->avg;
+      }
+    }
+  } else {
+    int half = size / 2;
+    renderRegionHelper(node->NW, img, x, y, nodeX, nodeY);
+    renderRegionHelper(node->NE, img, x, y, nodeX + half, nodeY);
+    renderRegionHelper(node->SE, img, x, y, nodeX + half, nodeY + half);
+    renderRegionHelper(node->SW, img, x, y, nodeX, nodeY + half);
   }
 }
 
 // binary search
 // the inverse of the pruneSize function.
 int quadtree::idealPrune(const int leaves) const {
+  QTC_PHASE(PHASE_PRUNE);
+  TraceSpan span("prune");
   int low = 0;
   int high = 255 * 255 * 3;
   while (low < high) {
     int mid = (low + high) / 2;
+    QTC_COUNT(idealPruneIterations);
 
     // Current tolerance too high, try lower half
     if (pruneSize(mid) <= leaves) {
@@ -103,6 +305,9 @@ int quadtree::idealPrune(const int leaves) const {
 }
 
 int quadtree::pruneSize(const int tol) const {
+  QTC_PHASE(PHASE_PRUNE);
+  if (artifact != NULL)
+    return artifactPruneSize(0, tol);
   return pruneSizeHelper(root, tol);
 }
 
@@ -111,6 +316,14 @@ int quadtree::pruneSizeHelper(Node *node, const int tol) const {
     return 0;
   if (prunable(node, tol)) {
     return 1;
+  } else if (node->packed) {
+    // counted as the leaves of var 0 they stand for
+    int leaves = 0;
+    for (int i = 0; i < 4; i++) {
+      Node leaf(pixelPos(node->upLeft, i), 0, pixelOf(node, i), 0);
+      leaves += prunable(&leaf, tol);
+    }
+    return leaves;
   } else {
     return pruneSizeHelper(node->NW, tol) + pruneSizeHelper(node->NE, tol) +
            pruneSizeHelper(node->SE, tol) + pruneSizeHelper(node->SW, tol);
@@ -118,22 +331,251 @@ int quadtree::pruneSizeHelper(Node *node, const int tol) const {
 }
 
 void quadtree::prune(const int tol) {
+  QTC_PHASE(PHASE_PRUNE);
+  TraceSpan span("prune");
+  if (artifact != NULL) {
+    root = artifactTree(0, make_pair(0, 0), tol);
+    closeArtifact();
+    return;
+  }
   pruneHelper(root, tol);
+  releasePixels();
+}
+
+int quadtree::pruneToLeaves(const int leaves) {
+  return collapseGreedily(leaves, INFINITY);
+}
+
+int quadtree::pruneToQuality(const double psnr) {
+  return collapseGreedily(1, maxDistortion(psnr));
+}
+
+double quadtree::qualityOf(const int tol) const {
+  if (artifact != NULL)
+    return psnrOf(artifactDistortion(0, tol));
+  return psnrOf(pruneDistortion(root, tol));
+}
+
+double quadtree::pruneDistortion(Node *node, const int tol) const {
+  if (node == NULL)
+    return 0;
+  if ((node->NW == NULL && !node->packed) || prunable(node, tol))
+    return node->var;
+  // pixel leaves are exact
+  if (node->packed)
+    return 0;
+  return pruneDistortion(node->NW, tol) + pruneDistortion(node->NE, tol) +
+         pruneDistortion(node->SE, tol) + pruneDistortion(node->SW, tol);
+}
+
+// squared errors are summed over the three channels of every pixel
+double quadtree::psnrOf(const double distortion) const {
+  if (distortion <= 0 || edge == 0)
+    return INFINITY;
+  double mse = distortion / (3.0 * edge * edge);
+  return 10 * log10(255.0 * 255.0 / mse);
+}
+
+double quadtree::maxDistortion(const double psnr) const {
+  return 3.0 * edge * edge * 255.0 * 255.0 / pow(10, psnr / 10);
+}
+
+int quadtree::collapseGreedily(const int leaves, const double maxError) {
+  QTC_PHASE(PHASE_PRUNE);
+  TraceSpan span("prune");
+  if (artifact != NULL)
+    prune(INT_MIN);
+  // every node with its parent and its number of children that are not
+  // leaves (yet), in pre-order
+  vector<Node *> nodes;
+  vector<size_t> parents;
+  vector<unsigned char> pending;
+  int count = 0;
+  double error = 0;
+  vector<pair<Node *, size_t> > stack;
+  if (root != NULL)
+    stack.push_back(make_pair(root, (size_t)-1));
+  while (!stack.empty()) {
+    Node *node = stack.back().first;
+    size_t parent = stack.back().second;
+    stack.pop_back();
+    if (node->refs > 1) {
+      cerr << "quadtree: can not prune a tree with shared nodes" << endl;
+      return -1;
+    }
+    size_t index = nodes.size();
+    nodes.push_back(node);
+    parents.push_back(parent);
+    pending.push_back(0);
+    if (node->packed) {
+      count += 4;
+      continue;
+    }
+    if (node->NW == NULL) {
+      count++;
+      error += node->var;
+      continue;
+    }
+    Node *children[] = {node->SW, node->SE, node->NE, node->NW};
+    for (Node *child : children) {
+      stack.push_back(make_pair(child, index));
+      if (child->NW != NULL || child->packed)
+        pending[index]++;
+    }
+  }
+
+  // the collapsible nodes by added error; ties go to the first in pre-order.
+  // The heap only grows with collapses, so once its cheapest node does not
+  // fit in maxError, none will.
+  typedef pair<double, size_t> Candidate;
+  vector<Candidate> candidates;
+  for (size_t i = 0; i < nodes.size(); i++)
+    if ((nodes[i]->NW != NULL || nodes[i]->packed) && pending[i] == 0)
+      candidates.push_back(Candidate(collapseCost(nodes[i]), i));
+  priority_queue<Candidate, vector<Candidate>, greater<Candidate> > heap(
+      greater<Candidate>(), candidates);
+  // collapses are only marked here; the nodes are freed below, a whole
+  // subtree at a time
+  vector<bool> collapsed(nodes.size(), false);
+  while (count > max(leaves, 1) && !heap.empty() &&
+         error + heap.top().first <= maxError) {
+    size_t i = heap.top().second;
+    error += heap.top().first;
+    heap.pop();
+    collapsed[i] = true;
+    count -= 3;
+    size_t parent = parents[i];
+    if (parent != (size_t)-1 && --pending[parent] == 0)
+      heap.push(Candidate(collapseCost(nodes[parent]), parent));
+  }
+
+  // in pre-order, parents come first: free below the topmost collapses,
+  // and skip the nodes freed with them
+  vector<bool> freed(nodes.size(), false);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    size_t parent = parents[i];
+    if (parent != (size_t)-1 && (freed[parent] || collapsed[parent])) {
+      freed[i] = true;
+      continue;
+    }
+    if (collapsed[i])
+      collapse(nodes[i]);
+  }
+  releasePixels();
+  return count;
+}
+
+double quadtree::distortion() const {
+  return distortionHelper(root);
+}
+
+double quadtree::distortionHelper(Node *node) const {
+  if (node == NULL || node->packed)
+    return 0;
+  if (node->NW == NULL)
+    return node->var;
+  return distortionHelper(node->NW) + distortionHelper(node->NE) +
+         distortionHelper(node->SE) + distortionHelper(node->SW);
+}
+
+void quadtree::optimalPrune(const double lambda) {
+  QTC_PHASE(PHASE_PRUNE);
+  TraceSpan span("prune");
+  if (artifact != NULL)
+    prune(INT_MIN);
+  optimalPruneHelper(root, lambda);
+  releasePixels();
+}
+
+// The best cut of a subtree does not depend on its ancestors, so each
+// subtree is pruned to its best cut on the way up; a shared node gets the
+// same cut from every parent.
+double quadtree::optimalPruneHelper(Node *node, const double lambda) {
+  if (node == NULL)
+    return 0;
+  double leaf = node->var + lambda;
+  // four exact pixel leaves cost 4 * lambda
+  if (node->packed && node->var > 3 * lambda)
+    return 4 * lambda;
+  if (node->NW != NULL && node->var > 3 * lambda) {
+    double split = optimalPruneHelper(node->NW, lambda) +
+                   optimalPruneHelper(node->NE, lambda) +
+                   optimalPruneHelper(node->SE, lambda) +
+                   optimalPruneHelper(node->SW, lambda);
+    if (split < leaf)
+      return split;
+  }
+  collapse(node);
+  return leaf;
+}
+
+int quadtree::optimalPruneSize(const double lambda) const {
+  QTC_PHASE(PHASE_PRUNE);
+  int leaves = 0;
+  optimalCost(root, lambda, leaves);
+  return leaves;
+}
+
+double quadtree::optimalCost(Node *node, const double lambda,
+                             int &leaves) const {
+  if (node == NULL)
+    return 0;
+  double leaf = node->var + lambda;
+  if (node->packed && node->var > 3 * lambda) {
+    leaves += 4;
+    return 4 * lambda;
+  }
+  if (node->NW != NULL && node->var > 3 * lambda) {
+    int splitLeaves = 0;
+    double split = optimalCost(node->NW, lambda, splitLeaves) +
+                   optimalCost(node->NE, lambda, splitLeaves) +
+                   optimalCost(node->SE, lambda, splitLeaves) +
+                   optimalCost(node->SW, lambda, splitLeaves);
+    if (split < leaf) {
+      leaves += splitLeaves;
+      return split;
+    }
+  }
+  leaves++;
+  return leaf;
+}
+
+double quadtree::idealLambda(const int leaves) const {
+  QTC_PHASE(PHASE_PRUNE);
+  TraceSpan span("prune");
+  if (root == NULL || optimalPruneSize(0) <= leaves)
+    return 0;
+  // at var(root) / 3 the root is the only leaf
+  double low = 0;
+  double high = root->var / 3 + 1;
+  // the leaf counts change at the lambdas where two cuts cost the same,
+  // which need not be integers; stop once the interval is relatively tiny
+  for (int i = 0; i < 64 && high - low > 1e-9 * high; i++) {
+    double mid = (low + high) / 2;
+    QTC_COUNT(idealPruneIterations);
+    int size = optimalPruneSize(mid);
+    if (size == leaves)
+      return mid;
+    if (size < leaves)
+      high = mid;
+    else
+      low = mid;
+  }
+  return high;
+}
+
+double quadtree::collapseCost(Node *node) {
+  if (node->packed)
+    return node->var;
+  return node->var - node->NW->var - node->NE->var - node->SE->var -
+         node->SW->var;
 }
 
 void quadtree::pruneHelper(Node *node, const int tol) {
   if (node == NULL)
     return;
   if (prunable(node, tol)) {
-    clearHelper(node->NW);
-    clearHelper(node->NE);
-    clearHelper(node->SE);
-    clearHelper(node->SW);
-
-    node->NW = NULL;
-    node->NE = NULL;
-    node->SE = NULL;
-    node->SW = NULL;
+    collapse(node);
   } else {
     pruneHelper(node->NW, tol);
     pruneHelper(node->NE, tol);
@@ -146,11 +588,16 @@ void quadtree::clear() {
   clearHelper(root);
   root = NULL;
   edge = 0;
+  vector<unsigned char>().swap(pixels);
+  closeArtifact();
 }
 
 void quadtree::clearHelper(Node *root) {
   if (root == NULL)
     return;
+  // a shared node is freed with its last parent
+  if (--root->refs > 0)
+    return;
   clearHelper(root->NW);
   clearHelper(root->NE);
   clearHelper(root->SE);
@@ -159,19 +606,125 @@ void quadtree::clearHelper(Node *root) {
   // root = NULL;
 }
 
+void quadtree::collapse(Node *node) {
+  clearHelper(node->NW);
+  clearHelper(node->NE);
+  clearHelper(node->SE);
+  clearHelper(node->SW);
+
+  node->NW = NULL;
+  node->NE = NULL;
+  node->SE = NULL;
+  node->SW = NULL;
+  node->packed = false;
+}
+
+void quadtree::releasePixels() {
+  if (!pixels.empty() && !hasPacked(root))
+    vector<unsigned char>().swap(pixels);
+}
+
+bool quadtree::hasPacked(Node *node) const {
+  if (node == NULL)
+    return false;
+  return node->packed || hasPacked(node->NW) || hasPacked(node->NE) ||
+         hasPacked(node->SE) || hasPacked(node->SW);
+}
+
+// shared nodes read the pixels of their first occurrence, which dedupe
+// found identical
+const unsigned char *quadtree::pixelsOf(const Node *node) const {
+  return &pixels[pixelIndex(node->upLeft, 0)];
+}
+
 void quadtree::copy(const quadtree &orig) {
   edge = orig.edge;
-  root = copyHelper(orig.root);
+  pixels = orig.pixels;
+  map<Node *, Node *> shared;
+  root = copyHelper(orig.root, shared);
+  if (orig.artifact != NULL)
+    mapArtifact(orig.artifactFile, typeid(orig).name());
 }
 
-quadtree::Node *quadtree::copyHelper(Node *node) {
+// shared maps the shared nodes of the original to their copies, so the
+// copy of a DAG is a DAG
+quadtree::Node *quadtree::copyHelper(Node *node, map<Node *, Node *> &shared) {
   if (node == NULL)
     return NULL;
+  if (node->refs > 1) {
+    map<Node *, Node *>::iterator it = shared.find(node);
+    if (it != shared.end()) {
+      it->second->refs++;
+      return it->second;
+    }
+  }
   Node *newNode = new Node(node->upLeft, node->dim, node->avg, node->var);
-  newNode->NW = copyHelper(node->NW);
-  newNode->NE = copyHelper(node->NE);
-  newNode->SE = copyHelper(node->SE);
-  newNode->SW = copyHelper(node->SW);
+  newNode->packed = node->packed;
+  if (node->refs > 1)
+    shared[node] = newNode;
+  newNode->NW = copyHelper(node->NW, shared);
+  newNode->NE = copyHelper(node->NE, shared);
+  newNode->SE = copyHelper(node->SE, shared);
+  newNode->SW = copyHelper(node->SW, shared);
 
   return newNode;
 }
+
+int quadtree::dedupe() {
+  map<vector<long>, Node *> unique;
+  int freed = 0;
+  root = dedupeHelper(root, unique, freed);
+  return freed;
+}
+
+// Returns the node that stands for node's subtree: node itself, or an
+// identical subtree met before, in which case node is freed. Children are
+// deduplicated first, so identical subtrees have identical child pointers.
+quadtree::Node *quadtree::dedupeHelper(Node *node,
+                                       map<vector<long>, Node *> &unique,
+                                       int &freed) {
+  if (node == NULL)
+    return NULL;
+  // the children of a node already shared were deduplicated through its
+  // first parent
+  if (node->refs == 1) {
+    node->NW = dedupeHelper(node->NW, unique, freed);
+    node->NE = dedupeHelper(node->NE, unique, freed);
+    node->SE = dedupeHelper(node->SE, unique, freed);
+    node->SW = dedupeHelper(node->SW, unique, freed);
+  }
+
+  // leaves are identified by dim and color, packed nodes by their pixels,
+  // internal nodes by dim and children
+  vector<long> key;
+  key.push_back(node->dim);
+  if (node->packed) {
+    key.push_back(-1);
+    for (int i = 0; i < 4; i++) {
+      RGBAPixel pixel = pixelOf(node, i);
+      key.push_back(pixel.r);
+      key.push_back(pixel.g);
+      key.push_back(pixel.b);
+    }
+  } else if (node->NW == NULL) {
+    key.push_back(node->avg.r);
+    key.push_back(node->avg.g);
+    key.push_back(node->avg.b);
+  } else {
+    key.push_back((long)node->NW);
+    key.push_back((long)node->NE);
+    key.push_back((long)node->SE);
+    key.push_back((long)node->SW);
+  }
+  pair<map<vector<long>, Node *>::iterator, bool> found =
+      unique.insert(make_pair(key, node));
+  Node *same = found.first->second;
+  if (same == node)
+    return node;
+
+  same->refs++;
+  if (node->refs == 1)
+    freed++;
+  clearHelper(node);
+  return same;
+}
@@ -9,14 +9,44 @@
 #define _QUADTREE_H_
 
 #include <cmath>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "compression/PNG.h"
 #include "compression/RGBAPixel.h"
+#include "metrics.h"
 #include "stats.h"
 using namespace std;
 using namespace compression;
 
+class RangeEncoder;
+class RangeDecoder;
+struct QtcModel;
+namespace compression {
+class MappedFile;
+}
+
+/**
+ * Memory held by a quadtree (see quadtree::footprint).
+ */
+struct TreeFootprint {
+    vector<size_t> nodesByLevel; // nodes at each depth; the root is level 0
+    size_t nodes;
+    size_t pixelLeaves; // leaves of dim 0 read from the pixel block instead
+    size_t nodeBytes;   // heap bytes per node, with the allocator's overhead
+    size_t pixelBytes;  // heap bytes of the pixel block
+    size_t bytes;       // heap bytes of all the nodes and the pixel block
+    size_t mappedBytes; // size of the mapped artifact, if any (see openArtifact)
+
+    TreeFootprint()
+        : nodes(0), pixelLeaves(0), nodeBytes(0), pixelBytes(0), bytes(0),
+          mappedBytes(0) {}
+};
+
 /**
  * quadtree: This is a structure used in decomposing an image
  * into squares of similarly colored pixels.
@@ -68,8 +98,24 @@ Each child has dim = 2 (4x4)
         // a is the average color of the square
         // v is the variance of the color of the square
         Node(pair<int, int> ul, int d, RGBAPixel a, double v); // Node constructor
-        pair<int, int> upLeft;
-        int dim;
+#ifdef QTC_METRICS
+        // only the nodes of the heap are counted, not the pixel leaves
+        // made on the stack
+        static void *operator new(size_t size) {
+            QTC_COUNT(nodesAllocated);
+            return ::operator new(size);
+        }
+        static void operator delete(void *p) {
+            QTC_COUNT(nodesFreed);
+            ::operator delete(p);
+        }
+#endif
+        pair<int, int> upLeft; // of the first occurrence, if the node is shared
+        short dim;
+        // a node of dim 1 whose four pixel leaves are not allocated, but
+        // read from the tree's pixel block (see pixelOf)
+        bool packed;
+        int refs; // number of parents pointing to the node: more than 1 after dedupe
         RGBAPixel avg;
         double var;
         Node *NW; // ptr to NW subtree
@@ -97,7 +143,7 @@ public:
      *
      * @see quadtree.cpp
      */
-    ~quadtree(); // allows for derived class destructor
+    virtual ~quadtree(); // allows for derived class destructor
 
     /**
      * Overloaded assignment operator for quadtree.
@@ -124,11 +170,44 @@ public:
      * current node's square is split in half horizontally
      * and vertically to produce the 4 children.
      *
+     * The leaves of single pixels, three quarters of the nodes, are not
+     * allocated: the nodes of dim 1 are built packed, with their pixels
+     * in a block of 3 bytes per pixel that the tree keeps until no packed
+     * node is left. They behave as the four leaves in every member
+     * function, and become plain leaves when pruned.
+     *
      * This function will also build the stats object used to compute
      * average pixel color and variability, over the squares.
      */
     quadtree(PNG &imIn);
 
+    /**
+     * Constructor that builds the same quadtree as quadtree(PNG&) directly
+     * from a PNG file. The rows of the image are streamed into the stats
+     * tables as they are decoded, so the decoded image is never resident.
+     * If the file can not be read, the tree is empty.
+     *
+     * @param fileName The PNG file to build the tree from.
+     */
+    quadtree(const string &fileName);
+
+    /**
+     * Estimates the peak memory, in bytes, of building a tree with
+     * quadtree(PNG&) from a width x height image: the decoded PNG, the
+     * stats tables and the full tree with its pixel block, which are all
+     * resident at the end of the build. Allocator overhead is included.
+     */
+    static size_t buildFootprint(unsigned int width, unsigned int height);
+
+    /**
+     * Counts the nodes of the tree by level and the heap bytes they hold.
+     * Nodes shared by dedupe are counted once, and the pixel leaves of
+     * packed nodes are not nodes. A mapped artifact counts
+     * its records as nodes, and its file as mappedBytes instead of heap
+     * bytes.
+     */
+    TreeFootprint footprint() const;
+
     /**
      * Render returns a PNG image consisting of the pixels
      * stored in the tree. It may be used on pruned trees. Draws
@@ -137,6 +216,16 @@ public:
      */
     PNG render() const;
 
+    /**
+     * Renders only the given rectangle of the image, as render() would draw
+     * it; parts of the rectangle outside the image are left white. Only the
+     * nodes that intersect the rectangle are visited.
+     *
+     * @param x,y Upper left corner of the rectangle.
+     * @param width,height Size of the rectangle, and of the returned PNG.
+     */
+    PNG renderRegion(int x, int y, int width, int height) const;
+
     /**
      *  Prune function trims subtrees as high as possible in the tree.
      *  A subtree is pruned (cleared) if prunable returns true.
@@ -163,7 +252,303 @@ public:
      */
     int idealPrune(const int leaves) const;
 
+    /**
+     * Prunes the tree to at most the given number of leaves, whatever the
+     * policy: repeatedly collapses the node whose children are all leaves
+     * and whose collapse adds the least error, var(node) minus the var of
+     * its children, until one more collapse would be needed to fit. Each
+     * collapse removes 3 leaves, so the result is exactly leaves when the
+     * tree has 1 + 3k leaves for some k between them; otherwise it is the
+     * largest count below. Runs in O(n log n), with one traversal.
+     * Must be called before dedupe.
+     *
+     * @return the number of leaves left, or -1 if the tree has shared
+     * nodes, in which case it is unchanged.
+     */
+    int pruneToLeaves(const int leaves);
+
+    /**
+     * Returns the quality of prune(tol) as its PSNR, in dB, computed from
+     * the var of the nodes that would become leaves (see distortion), with
+     * no render: 10 log10(255^2 / MSE), where MSE is the squared error per
+     * channel of a pixel. Infinite for a lossless prune.
+     */
+    double qualityOf(const int tol) const;
+
+    /**
+     * Prunes the tree to about the fewest leaves that keep its PSNR (see
+     * qualityOf) at or above psnr, by collapsing the nodes that add the
+     * least error first, as pruneToLeaves does, until the next collapse
+     * would drop below the target. A tree already below it is unchanged.
+     * Must be called before dedupe.
+     *
+     * @return the number of leaves left, or -1 if the tree has shared
+     * nodes, in which case it is unchanged.
+     */
+    int pruneToQuality(const double psnr);
+
+    /**
+     * Estimates the size, in bytes, of the .qtc file of prune(tol) from the
+     * nodes that would be left, without pruning or encoding: exactly for
+     * the raw format, and for the entropy coded one as the empirical
+     * entropy of the split flags and color residuals encodeQtc would code.
+     */
+    size_t estimateQtcBytes(const int tol, bool entropyCoded = true) const;
+
+    /**
+     * Estimates the size, in bytes, of the PNG of render() after prune(tol),
+     * from the leaves that would be left: the rows they span, which are
+     * the runs of one color deflate codes, times the entropy of their
+     * colors, with factors measured on natural images. Off by up to a few
+     * times, mostly for very few leaves; pruneToPngBytes calibrates it per
+     * image.
+     */
+    size_t estimatePngBytes(const int tol) const;
+
+    /**
+     * Prunes the tree at the smallest tolerance whose .qtc file, as
+     * encodeQtc writes it, fits in budget bytes. The tolerance is searched
+     * on estimateQtcBytes; only the candidates it settles on are encoded,
+     * each correcting the estimate for the next, so the result is checked
+     * exactly. At most a few candidates are encoded, and the raw format,
+     * whose estimate is exact, only encodes the one. Must be called
+     * before dedupe.
+     *
+     * @return the tolerance of the prune, or -1 if even the coarsest prune
+     * does not fit or the tree is empty, in which case it is unchanged.
+     */
+    int pruneToBytes(const size_t budget, bool entropyCoded = true);
+
+    /**
+     * Prunes the tree at the smallest tolerance whose rendered PNG, as
+     * writeToMemory encodes it, fits in budget bytes, searched on
+     * estimatePngBytes as pruneToBytes does.
+     *
+     * @return the tolerance of the prune, or -1 if even the coarsest prune
+     * does not fit or the tree is empty, in which case it is unchanged.
+     */
+    int pruneToPngBytes(const size_t budget);
+
+    /**
+     * Returns the distortion of the tree: the sum of the squared errors of
+     * its leaves. As var is the sum of squared deviations from the avg over
+     * a node's square, this is the sum of the var of the leaves (before the
+     * avg is rounded to a pixel), computed without rendering.
+     */
+    double distortion() const;
+
+    /**
+     * Prunes the tree to the rate-distortion optimal cut for lambda: the
+     * one minimizing distortion + lambda * leaves, found in one bottom-up
+     * pass that keeps a node as a leaf if var + lambda is no more than the
+     * best cost of its children. No cut with as few leaves has a lower
+     * distortion. Nodes with var <= 3 * lambda are kept as leaves without
+     * visiting their subtree, since a split node costs at least 4 * lambda.
+     *
+     * @param lambda The price of a leaf, in squared error; 0 keeps every
+     * node whose children lower the error.
+     */
+    void optimalPrune(const double lambda);
+
+    /**
+     * Returns the number of leaves optimalPrune(lambda) would leave.
+     */
+    int optimalPruneSize(const double lambda) const;
+
+    /**
+     * The inverse of optimalPruneSize, as idealPrune is for pruneSize:
+     * bisects lambda for one whose optimal cut has as many leaves as
+     * possible, but no more than the given number. The leaf count only
+     * takes the values of the cuts on the lower convex hull of distortion
+     * against leaves, so it may fall short of the budget.
+     */
+    double idealLambda(const int leaves) const;
+
+    /**
+     * Turns the tree into a DAG by sharing structurally identical subtrees:
+     * subtrees of the same dim, shape and leaf colors are replaced by a
+     * single copy, with the duplicates freed. Rendering is unchanged, since
+     * it places nodes by their position in the traversal. Meant for pruned
+     * trees of repetitive images (flat backgrounds, repeated tiles);
+     * internal nodes that are merged keep the avg and var of one of them,
+     * so prune before deduplicating. encodeQtc codes shared subtrees of more
+     * than a few nodes once and refers back to them afterwards.
+     *
+     * @return The number of nodes freed.
+     */
+    int dedupe();
+
+    /**
+     * Writes the (pruned) tree in the native .qtc format. O(leaves); the
+     * pixels are not rendered.
+     *
+     * By default the tree is entropy coded: in pre-order, every node's split
+     * flag is range coded in the context of its dim and of how many of its
+     * earlier siblings were split, followed by its avg as a residual from
+     * its parent's avg. Otherwise the file holds one raw structure bit per
+     * node (nodes of dim 0 are always leaves and take no bit), then the RGB
+     * color of every leaf in the same order.
+     *
+     * @param fileName Name of the file to be written.
+     * @param entropyCoded Whether to entropy code the tree.
+     * @return true, if the file was successfully written.
+     */
+    bool writeQtc(const string &fileName, bool entropyCoded = true) const;
+
+    /**
+     * Replaces the tree by the one stored in a .qtc file, of either kind.
+     * The rebuilt tree can be rendered. var is 0, and for raw files the avg
+     * of an internal node is the average of its children, since only the
+     * leaves are stored.
+     *
+     * @param fileName Name of the file to be read.
+     * @return true, if the file was successfully read.
+     */
+    bool readQtc(const string &fileName);
+
+    /**
+     * In-memory variants of writeQtc and readQtc.
+     */
+    void encodeQtc(vector<unsigned char> &out, bool entropyCoded = true) const;
+    bool decodeQtc(const unsigned char *data, size_t size);
+
+    /**
+     * Writes the tree as a progressive .qtc file, for clients that show the
+     * image while it downloads (see QtcStreamDecoder). The nodes are
+     * entropy coded as by encodeQtc, but breadth-first: the root first,
+     * then level by level, in length-prefixed segments that each decode on
+     * their own once received. readQtc and decodeQtc read these files too.
+     *
+     * @param out Receives the file contents.
+     */
+    void encodeQtcProgressive(vector<unsigned char> &out) const;
+
+    /**
+     * Writes the tree as an indexed .qtc file, for reading regions of very
+     * large images with readQtcRegion. The tree is cut at the nodes of dim
+     * tileDim: the part above the cut is entropy coded as by encodeQtc,
+     * followed by an offset index of the split nodes on the cut and their
+     * subtrees, each coded on its own. readQtc and decodeQtc read these
+     * files too.
+     *
+     * @param out Receives the file contents.
+     * @param tileDim The dim of the nodes that are indexed; their subtrees
+     * are the units of a region decode.
+     */
+    void encodeQtcIndexed(vector<unsigned char> &out, int tileDim = 8) const;
+
+    /**
+     * Replaces the tree by the part of an indexed .qtc file needed to
+     * render the given rectangle: the tree above the index cut, plus the
+     * indexed subtrees that intersect the rectangle. The other nodes on the
+     * cut stay leaves, drawn in their avg. The file is memory mapped, and
+     * only the pages of the decoded subtrees are read, so the time taken
+     * depends on the size of the region rather than of the file.
+     *
+     * @param fileName Name of an indexed .qtc file.
+     * @param x,y Upper left corner of the rectangle.
+     * @param width,height Size of the rectangle.
+     * @return true, if the file was successfully read.
+     */
+    bool readQtcRegion(const string &fileName, int x, int y, int width, int height);
+
+    /**
+     * In-memory variant of readQtcRegion.
+     */
+    bool decodeQtcRegion(const unsigned char *data, size_t size, int x, int y, int width,
+                         int height);
+
+    /**
+     * Saves the tree as a build artifact, for re-pruning it in a later
+     * process without the PNG (see openArtifact). The artifact is a flat,
+     * position independent array of the nodes in pre-order, with their avg,
+     * var, number of descendants and the smallest tolerance at which they
+     * are prunable, so it only fits the class that wrote it. 24 bytes per
+     * node, in the byte order of the machine.
+     *
+     * @param fileName Name of the file to be written.
+     * @return true, if the file was successfully written.
+     */
+    bool writeArtifact(const string &fileName) const;
+
+    /**
+     * Replaces the tree by a memory mapping of an artifact written by
+     * writeArtifact from the same class. The structure of the records is
+     * checked in one pass over the file, and nothing else is computed up
+     * front. Until the tree is pruned, pruneSize, idealPrune and render
+     * work on the mapped nodes; prune then builds the pruned tree from
+     * them and releases the mapping. Other member functions see an empty
+     * tree until the first prune. The avg, var and minTol of the records
+     * are not checked.
+     *
+     * @param fileName Name of the file to be mapped.
+     * @return true, if the file is a valid artifact of this class.
+     */
+    bool openArtifact(const string &fileName);
+
+protected:
+    /**
+     * Creates an empty tree, to be filled by readQtc.
+     */
+    quadtree();
+
+    /**
+     * Replaces the tree by the one quadtree(PNG&) builds, except that the
+     * nodes prunableAtBuild finds prunable at minTol are built as leaves:
+     * their subtrees, which no prune at minTol or above keeps, are never
+     * allocated. For high tolerances, most of the nodes of a full tree.
+     * Meant for derived constructors, since the base constructors can not
+     * call prunableAtBuild; INT_MIN builds every node. Prunes below minTol
+     * keep the floor leaves as they are.
+     *
+     * @param imIn The image to build the tree from.
+     * @param minTol The smallest tolerance the tree will be pruned at.
+     */
+    void build(PNG &imIn, const int minTol);
+
+    /**
+     * Builds the tree from a PNG file as quadtree(const string&) does, with
+     * the floor of build(PNG&, int).
+     */
+    void build(const string &fileName, const int minTol);
+
+    /**
+     * Returns true if a node with the given avg and var, from the stats of
+     * its square, is known to be prunable at tol before its subtree is
+     * built: then prune(t) clears its subtree for every t >= tol, and its
+     * ancestors are pruned as on the full tree. The default, false, builds
+     * every node; a policy whose prunable reads the leaves of the subtree,
+     * as qtcount's does, can not tell from avg and var.
+     */
+    virtual bool prunableAtBuild(const RGBAPixel &avg, double var, const int tol) const;
+
+    /**
+     * Returns the smallest tolerance at which node is prunable: prunable
+     * must be monotone in tol, as idealPrune assumes. INT_MAX + 1 means
+     * never. The default searches with prunable; derived classes may
+     * compute it directly. Stored by writeArtifact.
+     */
+    virtual int64_t pruneTolerance(Node *node) const;
+
+    /**
+     * Returns the r, g, b of the four pixel leaves of a packed node, in the
+     * order of the children: NW, NE, SE, SW. Policies read the leaves of a
+     * packed node here where they would read the avg of its children.
+     */
+    const unsigned char *pixelsOf(const Node *node) const;
+
+    /**
+     * Returns the color of pixel leaf i of a packed node (see pixelsOf).
+     */
+    RGBAPixel pixelOf(const Node *node, int i) const {
+        const unsigned char *p = pixelsOf(node) + 3 * i;
+        return RGBAPixel(p[0], p[1], p[2]);
+    }
+
 private:
+    friend class QtcStreamDecoder;
+    friend struct QtcModel;
+
     /*
      * Private member variables.
      *
@@ -173,6 +558,44 @@ private:
 
     int edge; // side length of the square image
 
+    // r, g, b of every pixel of the square, by node of dim 1, read by the
+    // packed nodes; released once none is left
+    vector<unsigned char> pixels;
+
+    // A node of a build artifact. size is the number of records of its
+    // subtree: its children follow it, each after the subtree of the
+    // previous one.
+    struct ArtifactNode {
+        unsigned char r, g, b, dim;
+        uint32_t size;
+        double var;
+        int64_t minTol; // see pruneTolerance
+    };
+
+    // The outputs whose size pruneToBudget can target.
+    enum BudgetFormat { BUDGET_QTC, BUDGET_QTC_RAW, BUDGET_PNG };
+
+    // What the size of an output is modeled from: the nodes left by a
+    // prune, and the residuals of their colors from the prediction
+    // encodeQtc makes, by whether they are a last child and by channel.
+    struct CutStats {
+        size_t leaves;
+        size_t flags;  // nodes of dim > 0, which code whether they split
+        size_t splits;
+        size_t runs;   // rows of the leaves: the runs of one color in a render
+        vector<size_t> residuals[2][3];
+
+        CutStats();
+        void count(const RGBAPixel &avg, const RGBAPixel &predicted, bool lastChild);
+        // the prediction of the last of four siblings, as QtcModel makes it
+        static RGBAPixel predictLast(const RGBAPixel &parent, const RGBAPixel &a,
+                                     const RGBAPixel &b, const RGBAPixel &c);
+    };
+
+    compression::MappedFile *artifact; // the artifact, until the first prune
+    const ArtifactNode *artifactNodes;
+    string artifactFile;
+
     /**
      * Destroys all dynamically allocated memory associated with the
      * current quadtree class.
@@ -180,11 +603,22 @@ private:
     void clear();
 
     // ADD
-    void renderHelper(Node *node, PNG &img) const;
+    void renderHelper(Node *node, PNG &img, int x, int y) const;
 
     // ADD
     void clearHelper(Node *root);
 
+    // ADD
+    // makes node a leaf, freeing its children
+    void collapse(Node *node);
+
+    // ADD
+    // frees the pixel block if no packed node is left
+    void releasePixels();
+
+    // ADD
+    bool hasPacked(Node *node) const;
+
     /**
      * Copies the parameter other quadtree into the current quadtree.
      * Does not free any memory. Called by copy constructor and op=.
@@ -193,7 +627,10 @@ private:
     void copy(const quadtree &other);
 
     // ADD
-    Node *copyHelper(Node *node);
+    Node *copyHelper(Node *node, map<Node *, Node *> &shared);
+
+    // ADD
+    Node *dedupeHelper(Node *node, map<vector<long>, Node *> &unique, int &freed);
 
     // ADD
     void pruneHelper(Node *node, const int tol);
@@ -201,6 +638,37 @@ private:
     // ADD
     int pruneSizeHelper(Node *node, const int tol) const;
 
+    // ADD
+    void encodeQtcHelper(Node *node, vector<unsigned char> &bits, size_t &numBits,
+                         vector<unsigned char> &colors) const;
+
+    // ADD
+    Node *decodeQtcHelper(pair<int, int> ul, int dim, const unsigned char *bits, size_t numBits,
+                          size_t &bitPos, const unsigned char *&colors, const unsigned char *end);
+
+    // ADD
+    // Nodes of dim tileDim are coded without their children, which are
+    // left to the caller and listed in tiles.
+    void encodeQtcNode(Node *node, const RGBAPixel &predicted, bool lastChild, int splitSiblings,
+                       RangeEncoder &enc, QtcModel &model, size_t &numNodes, int tileDim = -1,
+                       vector<Node *> *tiles = NULL) const;
+
+    // ADD
+    void encodeQtcChildren(Node *node, RangeEncoder &enc, QtcModel &model, size_t &numNodes,
+                           int tileDim = -1, vector<Node *> *tiles = NULL) const;
+
+    // ADD
+    Node *decodeQtcNode(pair<int, int> ul, int dim, const RGBAPixel &predicted, bool lastChild,
+                        int splitSiblings, RangeDecoder &dec, QtcModel &model, size_t &nodesLeft,
+                        int tileDim = -1, vector<Node *> *tiles = NULL);
+
+    // ADD
+    bool decodeQtcChildren(Node *node, RangeDecoder &dec, QtcModel &model, size_t &nodesLeft,
+                           int tileDim = -1, vector<Node *> *tiles = NULL);
+
+    // ADD
+    void renderRegionHelper(Node *node, PNG &img, int x, int y, int nodeX, int nodeY) const;
+
     /**
      * Private helper function for the constructor. Recursively builds
      * the tree according to the specification of the constructor.
@@ -208,7 +676,88 @@ private:
      * @param ul upper left point of current node's square.
      * @param dim reflects the size of the current square
      */
-    Node *buildTree(stats &s, pair<int, int> ul, int dim);
+    Node *buildTree(stats &s, pair<int, int> ul, int dim, const int minTol);
+
+    // ADD
+    // collapses the cheapest nodes while there are more than leaves leaves
+    // and the distortion stays within maxError; returns the leaves left
+    int collapseGreedily(const int leaves, const double maxError);
+
+    // ADD
+    double pruneDistortion(Node *node, const int tol) const;
+
+    // ADD
+    int pruneToBudget(const size_t budget, const BudgetFormat format);
+
+    // ADD
+    CutStats cutStats(const int tol) const;
+
+    // ADD
+    void cutStatsHelper(Node *node, const int tol, const RGBAPixel &predicted, bool lastChild,
+                        CutStats &cut) const;
+
+    // ADD
+    double modelBytes(const CutStats &cut, const BudgetFormat format) const;
+
+    // ADD
+    // the size of the output of prune(tol), encoded from a copy of the cut
+    size_t encodedBytes(const int tol, const BudgetFormat format);
+
+    // ADD
+    Node *cutTree(Node *node, const int tol) const;
+
+    // ADD
+    double psnrOf(const double distortion) const;
+
+    // ADD
+    // the largest distortion with at least the given PSNR
+    double maxDistortion(const double psnr) const;
+
+    // ADD
+    double artifactDistortion(size_t index, const int tol) const;
+
+    // ADD
+    // the error added by collapsing a node whose children are leaves
+    static double collapseCost(Node *node);
+
+    // ADD
+    double distortionHelper(Node *node) const;
+
+    // ADD
+    // best cost of node's subtree, and its number of leaves
+    double optimalCost(Node *node, const double lambda, int &leaves) const;
+
+    // ADD
+    double optimalPruneHelper(Node *node, const double lambda);
+
+    // ADD
+    void footprintHelper(Node *node, size_t level, TreeFootprint &total,
+                         set<Node *> &shared) const;
+
+    // ADD
+    void writeArtifactHelper(Node *node, vector<ArtifactNode> &nodes) const;
+
+    // ADD
+    int artifactPruneSize(size_t index, const int tol) const;
+
+    // ADD
+    Node *artifactTree(size_t index, pair<int, int> ul, const int tol) const;
+
+    // ADD
+    void artifactCutStats(size_t index, const int tol, const RGBAPixel &predicted,
+                          bool lastChild, CutStats &cut) const;
+
+    // ADD
+    void renderArtifact(size_t index, PNG &img, int x, int y) const;
+
+    // ADD
+    bool mapArtifact(const string &fileName, const char *className);
+
+    // ADD
+    static bool validArtifact(const ArtifactNode *nodes, size_t index, size_t end);
+
+    // ADD
+    void closeArtifact();
 
     /* prunable is a pure virtual function, and as such it must
      * be implemented in a derived class. Prunable takes parameters
@@ -0,0 +1,141 @@
+/**
+ *
+ * rangecoder.h
+ * Adaptive binary range coder, used to entropy code .qtc files.
+ *
+ * Every coded bit has a context: a probability (of the bit being 0) that
+ * adapts towards the bits seen so far. Predictable bits, such as split
+ * flags deep in a flat region, cost a small fraction of a bit each.
+ * The coder is carry-less on the decoder side and works a byte at a time,
+ * in the style of the LZMA range coder.
+ *
+ */
+
+#ifndef _RANGECODER_H_
+#define _RANGECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/** Probability that the next bit is 0, scaled to RC_PROB_ONE. */
+typedef uint16_t RCProb;
+
+const int RC_PROB_BITS = 11;
+const uint32_t RC_PROB_ONE = 1u << RC_PROB_BITS;
+const RCProb RC_PROB_INIT = RC_PROB_ONE / 2;
+// adaptation speed: each bit moves the probability 1/32 of the way
+const int RC_ADAPT_SHIFT = 5;
+const uint32_t RC_TOP = 1u << 24;
+
+class RangeEncoder {
+public:
+    /** Appends the coded bits to out. */
+    RangeEncoder(vector<unsigned char> &out)
+        : out(out), low(0), range(0xFFFFFFFFu), cache(0), cacheSize(1) {}
+
+    /** Codes bit (0 or 1) with the probability of context p, then adapts p. */
+    void encodeBit(RCProb &p, int bit) {
+        uint32_t bound = (range >> RC_PROB_BITS) * p;
+        if (bit == 0) {
+            range = bound;
+            p += (RC_PROB_ONE - p) >> RC_ADAPT_SHIFT;
+        } else {
+            low += bound;
+            range -= bound;
+            p -= p >> RC_ADAPT_SHIFT;
+        }
+        while (range < RC_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    /** Writes out the remaining state. Must be called once, after the last bit. */
+    void finish() {
+        for (int i = 0; i < 5; i++)
+            shiftLow();
+    }
+
+private:
+    vector<unsigned char> &out;
+    uint64_t low;
+    uint32_t range;
+    unsigned char cache;
+    uint64_t cacheSize;
+
+    // outputs the top byte of low, resolving a pending carry into the
+    // bytes held back in cache
+    void shiftLow() {
+        if ((uint32_t)low < 0xFF000000u || (low >> 32) != 0) {
+            unsigned char carry = (unsigned char)(low >> 32);
+            unsigned char temp = cache;
+            do {
+                out.push_back((unsigned char)(temp + carry));
+                temp = 0xFF;
+            } while (--cacheSize != 0);
+            cache = (unsigned char)(low >> 24);
+        }
+        cacheSize++;
+        low = (low & 0x00FFFFFFu) << 8;
+    }
+};
+
+class RangeDecoder {
+public:
+    /** Decodes the bits coded by a RangeEncoder in data[0, size). */
+    RangeDecoder(const unsigned char *data, size_t size)
+        : pos(data), end(data + size), overrun(0), range(0xFFFFFFFFu), code(0) {
+        for (int i = 0; i < 5; i++)
+            code = (code << 8) | nextByte();
+    }
+
+    /** Decodes a bit with the probability of context p, then adapts p. */
+    int decodeBit(RCProb &p) {
+        uint32_t bound = (range >> RC_PROB_BITS) * p;
+        int bit;
+        if (code < bound) {
+            range = bound;
+            p += (RC_PROB_ONE - p) >> RC_ADAPT_SHIFT;
+            bit = 0;
+        } else {
+            code -= bound;
+            range -= bound;
+            p -= p >> RC_ADAPT_SHIFT;
+            bit = 1;
+        }
+        while (range < RC_TOP) {
+            range <<= 8;
+            code = (code << 8) | nextByte();
+        }
+        return bit;
+    }
+
+    /**
+     * Whether the decoder read past the end of its data, which means the
+     * data was truncated or corrupt. The encoder flushes enough bytes that
+     * a valid stream is never overrun.
+     */
+    bool corrupt() const { return overrun > 0; }
+
+    /** Position of the next byte to be read. */
+    const unsigned char *position() const { return pos; }
+
+private:
+    const unsigned char *pos;
+    const unsigned char *end;
+    size_t overrun;
+    uint32_t range;
+    uint32_t code;
+
+    unsigned char nextByte() {
+        if (pos < end)
+            return *pos++;
+        overrun++;
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,448 @@
+/**
+ *
+ * server.cpp
+ *
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "batch.h"
+#include "cache.h"
+#include "compression/MappedFile.h"
+#include "server.h"
+using namespace std;
+
+namespace {
+// longest request or response line accepted
+const size_t MAX_LINE = 4096;
+// time a client has to send its whole request line, so that idle or slow
+// connections do not hold the workers
+const int REQUEST_TIMEOUT_MS = 2000;
+
+bool socketAddress(const string &path, sockaddr_un &address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    return false;
+  strcpy(address.sun_path, path.c_str());
+  return true;
+}
+
+// reads up to a newline, which is dropped along with anything after it (a
+// connection carries one line each way); with a timeout, the whole line must
+// arrive within timeoutMs milliseconds
+bool readLine(int fd, string &line, int timeoutMs = -1) {
+  line.clear();
+  chrono::steady_clock::time_point deadline =
+      chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+  char buffer[512];
+  while (line.size() <= MAX_LINE) {
+    if (timeoutMs >= 0) {
+      long left = chrono::duration_cast<chrono::milliseconds>(
+                      deadline - chrono::steady_clock::now()).count();
+      if (left <= 0)
+        return false;
+      pollfd ready;
+      ready.fd = fd;
+      ready.events = POLLIN;
+      ready.revents = 0;
+      int polled = poll(&ready, 1, (int)left);
+      if (polled < 0 && errno == EINTR)
+        continue;
+      if (polled <= 0)
+        return false;
+    }
+    ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    const char *end = (const char *)memchr(buffer, '\n', got);
+    line.append(buffer, end != NULL ? end - buffer : got);
+    if (end != NULL)
+      return line.size() <= MAX_LINE;
+  }
+  return false;
+}
+
+bool writeLine(int fd, const string &line) {
+  string data = line + "\n";
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t put = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put <= 0)
+      return false;
+    sent += put;
+  }
+  return true;
+}
+
+// creates the shared memory object name holding data[0, size)
+bool writeShared(const string &name, const unsigned char *data, size_t size) {
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0)
+    return false;
+  bool ok = ftruncate(fd, size) == 0;
+  if (ok && size > 0) {
+    void *mapping = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+    ok = mapping != MAP_FAILED;
+    if (ok) {
+      memcpy(mapping, data, size);
+      munmap(mapping, size);
+    }
+  }
+  close(fd);
+  if (!ok)
+    shm_unlink(name.c_str());
+  return ok;
+}
+
+// Read-only mapping of a shared memory object.
+class SharedMapping {
+public:
+  SharedMapping(const string &name) : data(NULL), size(0) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      return;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapping != MAP_FAILED) {
+        data = (const unsigned char *)mapping;
+        size = info.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~SharedMapping() {
+    if (data != NULL)
+      munmap((void *)data, size);
+  }
+
+  const unsigned char *data;
+  size_t size;
+
+private:
+  SharedMapping(const SharedMapping &other);
+  SharedMapping &operator=(const SharedMapping &other);
+};
+
+// buckets of a LatencyHistogram, up to about 19 hours
+const int LATENCY_BUCKETS = 512;
+const double LATENCY_GROWTH = 1.05;
+
+// a process-wide counter, for the names of shared memory objects
+unsigned long nextSharedId() {
+  static mutex lock;
+  static unsigned long id = 0;
+  lock_guard<mutex> guard(lock);
+  return id++;
+}
+}
+
+LatencyHistogram::LatencyHistogram() : buckets(LATENCY_BUCKETS), total(0) {}
+
+void LatencyHistogram::add(double micros) {
+  int bucket = micros < 1 ? 0 : (int)(log(micros) / log(LATENCY_GROWTH));
+  buckets[min(bucket, LATENCY_BUCKETS - 1)]++;
+  total++;
+}
+
+size_t LatencyHistogram::count() const { return total; }
+
+double LatencyHistogram::percentile(double fraction) const {
+  if (total == 0)
+    return 0;
+  // the bucket of the value at that rank, as nth_element would find it
+  size_t rank = min(total - 1, (size_t)(fraction * total));
+  size_t seen = 0;
+  int bucket = 0;
+  while (seen + buckets[bucket] <= rank)
+    seen += buckets[bucket++];
+  // the middle of the bucket
+  return pow(LATENCY_GROWTH, bucket + 0.5);
+}
+
+CompressionServer::CompressionServer(const string &socketPath,
+                                     unsigned int numThreads,
+                                     ResultCache *cache)
+    : socketPath(socketPath), cache(cache), pool(numThreads), listener(-1),
+      results(0) {}
+
+CompressionServer::~CompressionServer() { stop(); }
+
+bool CompressionServer::start() {
+  sockaddr_un address;
+  if (listener >= 0 || !socketAddress(socketPath, address)) {
+    cerr << "server: invalid socket path " << socketPath << endl;
+    return false;
+  }
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str());
+  if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 128) != 0) {
+    cerr << "server: can not listen on " << socketPath << ": "
+         << strerror(errno) << endl;
+    if (listener >= 0)
+      close(listener);
+    listener = -1;
+    return false;
+  }
+  acceptor = thread(&CompressionServer::acceptLoop, this);
+  return true;
+}
+
+void CompressionServer::stop() {
+  if (listener < 0)
+    return;
+  // wakes up the accept call
+  shutdown(listener, SHUT_RDWR);
+  acceptor.join();
+  close(listener);
+  listener = -1;
+  pool.wait();
+  unlink(socketPath.c_str());
+}
+
+size_t CompressionServer::latency(double &p50, double &p99) {
+  lock_guard<mutex> guard(lock);
+  p50 = latencies.percentile(0.5);
+  p99 = latencies.percentile(0.99);
+  return latencies.count();
+}
+
+void CompressionServer::acceptLoop() {
+  while (true) {
+    int connection = accept(listener, NULL, NULL);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    pool.submit([this, connection]() { serve(connection); });
+  }
+}
+
+void CompressionServer::serve(int connection) {
+  string request;
+  if (readLine(connection, request, REQUEST_TIMEOUT_MS)) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (request == "stats") {
+      double p50, p99;
+      size_t count = latency(p50, p99);
+      ostringstream response;
+      CacheStats cached;
+      if (cache != NULL)
+        cached = cache->stats();
+      response << "ok " << count << " " << p50 << " " << p99 << " "
+               << cached.hits << " " << cached.misses << " "
+               << cached.evictions;
+      writeLine(connection, response.str());
+    } else if (request.compare(0, 9, "compress ") == 0) {
+      string response = compress(request);
+      double micros = chrono::duration<double, micro>(
+                          chrono::steady_clock::now() - start).count();
+      {
+        // before the response, so a client's next stats request sees it
+        lock_guard<mutex> guard(lock);
+        latencies.add(micros);
+      }
+      // a client that is gone will never unlink the result
+      if (!writeLine(connection, response) &&
+          response.compare(0, 3, "ok ") == 0) {
+        istringstream fields(response.substr(3));
+        string name;
+        fields >> name;
+        shm_unlink(name.c_str());
+      }
+    } else {
+      writeLine(connection, "error unknown request");
+    }
+  }
+  close(connection);
+}
+
+string CompressionServer::compress(const string &request) {
+  istringstream fields(request);
+  string command, source, setting;
+  fields >> command >> source;
+  BatchJob job;
+  bool png = false;
+  while (fields >> setting) {
+    if (setting == "format=png" || setting == "format=qtc")
+      png = setting == "format=png";
+    else if (!parseJobSetting(setting, job))
+      return "error invalid setting " + setting;
+  }
+
+  vector<unsigned char> out;
+  string error = compressSource(source, job, png, out);
+  if (!error.empty())
+    return "error " + error;
+
+  ostringstream name;
+  {
+    lock_guard<mutex> guard(lock);
+    name << "/qtcd-" << getpid() << "-" << results++;
+  }
+  if (!writeShared(name.str(), out.data(), out.size()))
+    return "error can not create shared memory " + name.str();
+  ostringstream response;
+  response << "ok " << name.str() << " " << out.size();
+  return response.str();
+}
+
+string CompressionServer::compressSource(const string &source,
+                                         const BatchJob &job, bool png,
+                                         vector<unsigned char> &out) {
+  const unsigned char *data = NULL;
+  size_t size = 0;
+  SharedMapping *shared = NULL;
+  MappedFile *file = NULL;
+  if (source.compare(0, 4, "shm:") == 0) {
+    shared = new SharedMapping(source.substr(4));
+    data = shared->data;
+    size = shared->size;
+  } else {
+    file = new MappedFile(source);
+    if (!file->error()) {
+      data = file->data();
+      size = file->size();
+    }
+  }
+
+  string error;
+  if (data == NULL)
+    error = "can not read " + source;
+  string key;
+  bool cached = false;
+  if (error.empty() && cache != NULL) {
+    key = ResultCache::key(data, size, job, png);
+    cached = cache->get(key, out);
+  }
+  PNG image;
+  if (error.empty() && !cached && !image.readFromMemory(data, size))
+    error = "can not read " + source;
+  delete shared;
+  delete file;
+  if (!error.empty() || cached)
+    return error;
+
+  quadtree *tree = compressImage(image, job, png);
+  bool encoded = true;
+  if (png)
+    encoded = tree->render().writeToMemory(out);
+  else
+    tree->encodeQtc(out);
+  delete tree;
+  if (!encoded)
+    return "can not encode the result";
+  if (cache != NULL)
+    cache->put(key, out);
+  return "";
+}
+
+bool sendRequest(const string &socketPath, const string &request,
+                 string &response) {
+  sockaddr_un address;
+  if (!socketAddress(socketPath, address))
+    return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  bool ok = connect(fd, (sockaddr *)&address, sizeof(address)) == 0 &&
+            writeLine(fd, request) && readLine(fd, response);
+  close(fd);
+  return ok;
+}
+
+bool compressRemote(const string &socketPath, const string &source,
+                    const string &settings, vector<unsigned char> &result) {
+  string response;
+  if (!sendRequest(socketPath, "compress " + source + " " + settings,
+                   response)) {
+    cerr << "server: no response from " << socketPath << endl;
+    return false;
+  }
+  istringstream fields(response);
+  string status, name;
+  size_t size = 0;
+  fields >> status >> name >> size;
+  if (status != "ok") {
+    cerr << "server: " << response << endl;
+    return false;
+  }
+  bool ok;
+  {
+    SharedMapping shared(name);
+    ok = shared.data != NULL && shared.size == size;
+    if (ok)
+      result.assign(shared.data, shared.data + size);
+  }
+  shm_unlink(name.c_str());
+  if (!ok)
+    cerr << "server: can not read the result " << name << endl;
+  return ok;
+}
+
+bool compressRemote(const string &socketPath, const unsigned char *png,
+                    size_t size, const string &settings,
+                    vector<unsigned char> &result) {
+  ostringstream name;
+  name << "/qtcc-" << getpid() << "-" << nextSharedId();
+  if (!writeShared(name.str(), png, size)) {
+    cerr << "server: can not create shared memory " << name.str() << endl;
+    return false;
+  }
+  bool ok = compressRemote(socketPath, "shm:" + name.str(), settings, result);
+  shm_unlink(name.str().c_str());
+  return ok;
+}
+
+LoadStats loadTest(const string &socketPath, const string &source,
+                   const string &settings, unsigned int clients,
+                   unsigned int requestsPerClient) {
+  LoadStats totals;
+  LatencyHistogram latencies;
+  mutex lock;
+  vector<thread> threads;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int c = 0; c < clients; c++) {
+    threads.push_back(thread([&]() {
+      for (unsigned int i = 0; i < requestsPerClient; i++) {
+        chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+        vector<unsigned char> result;
+        bool ok = compressRemote(socketPath, source, settings, result);
+        double micros = chrono::duration<double, micro>(
+                            chrono::steady_clock::now() - sent).count();
+        lock_guard<mutex> guard(lock);
+        if (ok) {
+          totals.requests++;
+          latencies.add(micros);
+        } else {
+          totals.failed++;
+        }
+      }
+    }));
+  }
+  for (size_t c = 0; c < threads.size(); c++)
+    threads[c].join();
+  totals.seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  totals.p50 = latencies.percentile(0.5);
+  totals.p99 = latencies.percentile(0.99);
+  return totals;
+}
@@ -0,0 +1,183 @@
+/**
+ *
+ * server.h
+ * Resident compression service over a Unix domain socket, and its client.
+ *
+ * Protocol: a client connects, sends one request line and reads one
+ * response line, then the connection is closed.
+ *   compress <source> [policy=var|count] [tol=N] [leaves=N] [bytes=N]
+ *            [format=qtc|png]
+ *     source is the path of a PNG file, or shm:<name> for a POSIX shared
+ *     memory object holding the contents of a PNG file. The tree is built,
+ *     pruned as by the batch jobs (see batch.h), and encoded as a .qtc file
+ *     (the default) or rendered to a PNG file.
+ *     Response: ok <name> <size>, where name is a shared memory object
+ *     holding the size bytes of the result. The client unlinks it.
+ *     With a cache, results found there are returned without decoding the
+ *     source.
+ *   stats
+ *     Response: ok <requests> <p50> <p99> <hits> <misses> <evictions>, the
+ *     latencies of the compress requests served so far, in microseconds,
+ *     and the counters of the cache (0 without a cache).
+ * On failure the response is: error <message>.
+ * A connection that sends no request line within 2 seconds is closed
+ * without a response.
+ *
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "threadpool.h"
+
+using namespace std;
+
+struct BatchJob;
+class ResultCache;
+
+/**
+ * LatencyHistogram: counts of latencies in buckets 5% wide, so the
+ * percentiles of any number of requests take the same memory. Not thread
+ * safe.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    /** Counts a latency, in microseconds. */
+    void add(double micros);
+
+    /** @return the number of latencies counted. */
+    size_t count() const;
+
+    /**
+     * @return the latency that the given fraction of those counted do not
+     * exceed, to within 5%; 0 if none were counted.
+     */
+    double percentile(double fraction) const;
+
+private:
+    vector<size_t> buckets; // bucket i counts [1.05^i, 1.05^(i+1)) us
+    size_t total;
+};
+
+/**
+ * CompressionServer: serves compress requests on a Unix domain socket
+ * with a pool of threads that lives as long as the server, so requests do
+ * not pay for process startup or thread creation, and the workers' malloc
+ * arenas stay warm from one tree to the next.
+ */
+class CompressionServer {
+public:
+    /**
+     * @param socketPath Path of the socket; an existing file there is replaced.
+     * @param numThreads Number of worker threads; 0 for one per hardware thread.
+     * @param cache Cache of results (see cache.h), or NULL.
+     */
+    CompressionServer(const string &socketPath, unsigned int numThreads = 0,
+                      ResultCache *cache = NULL);
+
+    /** Stops the server. */
+    ~CompressionServer();
+
+    /**
+     * Starts accepting requests, on a thread of its own.
+     * @return false, if the socket can not be created.
+     */
+    bool start();
+
+    /**
+     * Stops accepting requests, waits for the requests being served and
+     * removes the socket.
+     */
+    void stop();
+
+    /**
+     * Latencies of the compress requests served so far, from the request
+     * being read to the response being ready, in microseconds.
+     * @return the number of requests.
+     */
+    size_t latency(double &p50, double &p99);
+
+private:
+    CompressionServer(const CompressionServer &other);
+    CompressionServer &operator=(const CompressionServer &other);
+
+    void acceptLoop();
+    void serve(int connection);
+    // runs a compress request; returns the response line
+    string compress(const string &request);
+    // compresses a file or shared memory source into out, or takes the
+    // result from the cache; returns an error message, or ""
+    string compressSource(const string &source, const BatchJob &job, bool png,
+                          vector<unsigned char> &out);
+
+    string socketPath;
+    ResultCache *cache;
+    ThreadPool pool;
+    int listener;
+    thread acceptor;
+    mutex lock;              // guards latencies and results
+    LatencyHistogram latencies;
+    unsigned long results;   // number of result objects created, for their names
+};
+
+/**
+ * Sends a request to a server and waits for the response.
+ * @param socketPath Path of the server's socket.
+ * @param request The request line, without the newline.
+ * @param response Receives the response line.
+ * @return false, if the server can not be reached.
+ */
+bool sendRequest(const string &socketPath, const string &request,
+                 string &response);
+
+/**
+ * Compresses an image on a server, and fetches the result from shared
+ * memory.
+ * @param socketPath Path of the server's socket.
+ * @param source A PNG file, or shm:<name>.
+ * @param settings Settings of the request, such as "policy=var tol=1000".
+ * @param result Receives the .qtc or PNG file.
+ * @return false, if the request failed; the reason is reported on cerr.
+ */
+bool compressRemote(const string &socketPath, const string &source,
+                    const string &settings, vector<unsigned char> &result);
+
+/**
+ * Like compressRemote, but sends a PNG file held in memory, through a
+ * shared memory object.
+ */
+bool compressRemote(const string &socketPath, const unsigned char *png,
+                    size_t size, const string &settings,
+                    vector<unsigned char> &result);
+
+/**
+ * Totals of a load test.
+ */
+struct LoadStats {
+    size_t requests; // requests that succeeded
+    size_t failed;
+    double seconds;  // wall clock time of the test
+    double p50, p99; // latencies seen by the clients, in microseconds
+
+    LoadStats() : requests(0), failed(0), seconds(0), p50(0), p99(0) {}
+};
+
+/**
+ * Loads a server with the same compress request from concurrent clients.
+ * @param clients Number of client threads.
+ * @param requestsPerClient Number of requests each client sends, one
+ * after the other.
+ */
+LoadStats loadTest(const string &socketPath, const string &source,
+                   const string &settings, unsigned int clients,
+                   unsigned int requestsPerClient);
+
+#endif
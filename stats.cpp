@@ -1,10 +1,14 @@
 
 #include "stats.h"
 #include "compression/RGBAPixel.h"
+#include "metrics.h"
+#include "trace.h"
 #include <vector>
 
 stats::stats(PNG &im)
 {
+  QTC_PHASE(PHASE_STATS);
+  TraceSpan span("stats");
   int width = im.width();
   int height = im.height();
 
@@ -53,6 +57,68 @@ stats::stats(PNG &im)
   }
 }
 
+namespace {
+// Fills the cumulative tables of a stats object as the rows of the image arrive.
+// Row y only needs row y - 1 of the tables, so no pixel is kept after its row.
+class SumRowReader : public PNG::RowReader {
+public:
+  SumRowReader(stats &s) : s(s), width(0), height(0) {}
+
+  void begin(unsigned int w, unsigned int h)
+  {
+    width = w;
+    height = h;
+    s.sumRed.assign(width, vector<long>(height));
+    s.sumGreen.assign(width, vector<long>(height));
+    s.sumBlue.assign(width, vector<long>(height));
+    s.sumsqRed.assign(width, vector<long>(height));
+    s.sumsqGreen.assign(width, vector<long>(height));
+    s.sumsqBlue.assign(width, vector<long>(height));
+  }
+
+  void row(unsigned int y, const RGBAPixel *row)
+  {
+    // sums of the row up to and including x, added to the table entry above
+    long rowRed = 0, rowGreen = 0, rowBlue = 0;
+    long rowsqRed = 0, rowsqGreen = 0, rowsqBlue = 0;
+    for (unsigned int x = 0; x < width; x++)
+    {
+      const RGBAPixel &pixel = row[x];
+      rowRed += pixel.r;
+      rowGreen += pixel.g;
+      rowBlue += pixel.b;
+      rowsqRed += pixel.r * pixel.r;
+      rowsqGreen += pixel.g * pixel.g;
+      rowsqBlue += pixel.b * pixel.b;
+
+      s.sumRed[x][y] = rowRed + (y > 0 ? s.sumRed[x][y - 1] : 0);
+      s.sumGreen[x][y] = rowGreen + (y > 0 ? s.sumGreen[x][y - 1] : 0);
+      s.sumBlue[x][y] = rowBlue + (y > 0 ? s.sumBlue[x][y - 1] : 0);
+      s.sumsqRed[x][y] = rowsqRed + (y > 0 ? s.sumsqRed[x][y - 1] : 0);
+      s.sumsqGreen[x][y] = rowsqGreen + (y > 0 ? s.sumsqGreen[x][y - 1] : 0);
+      s.sumsqBlue[x][y] = rowsqBlue + (y > 0 ? s.sumsqBlue[x][y - 1] : 0);
+    }
+  }
+
+  stats &s;
+  unsigned int width;
+  unsigned int height;
+};
+}
+
+stats::stats(const string &fileName, unsigned int &width, unsigned int &height)
+{
+  QTC_PHASE(PHASE_STATS);
+  TraceSpan span("stats");
+  SumRowReader reader(*this);
+  if (!PNG::readRows(fileName, reader))
+  {
+    reader.begin(0, 0);
+  }
+  width = reader.width;
+  height = reader.height;
+}
+
 long stats::getSum(char channel, pair<int, int> ul, int dim)
 {
   int x = ul.first;
@@ -156,3 +222,30 @@ RGBAPixel stats::getAvg(pair<int, int> ul, int dim)
 
   return RGBAPixel(redSum / R, greenSum / R, blueSum / R);
 }
+
+size_t stats::footprint() const
+{
+  const vector<vector<long> > *tables[] = {&sumRed, &sumGreen, &sumBlue,
+                                           &sumsqRed, &sumsqGreen, &sumsqBlue};
+  size_t bytes = 0;
+  for (const vector<vector<long> > *table : tables)
+  {
+    if (table->capacity() > 0)
+      bytes += heapBlockBytes(table->capacity() * sizeof(vector<long>));
+    for (size_t x = 0; x < table->size(); x++)
+      if ((*table)[x].capacity() > 0)
+        bytes += heapBlockBytes((*table)[x].capacity() * sizeof(long));
+  }
+  return bytes;
+}
+
+size_t stats::footprint(unsigned int width, unsigned int height)
+{
+  if (width == 0)
+    return 0;
+  // one vector of columns, and one column of height sums per x
+  size_t table = heapBlockBytes(width * sizeof(vector<long>));
+  if (height > 0)
+    table += width * heapBlockBytes(height * sizeof(long));
+  return 6 * table;
+}
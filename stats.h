@@ -3,6 +3,7 @@
 #define _STATS_H
 
 #include <cmath>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -40,6 +41,12 @@ public:
     // sum of squares in the rectangle from (0,0) to (x,y).
     stats(PNG& im);
 
+    /** Builds the same tables as stats(PNG&) while the image in the given PNG file is
+     * decoded, one row at a time, so the decoded image is never held in memory.
+     * @param fileName is the PNG file to read
+     * @param width,height are set to the size of the image (0 if it could not be read) */
+    stats(const string& fileName, unsigned int& width, unsigned int& height);
+
     /** Given a square, compute its sum of squared deviations from mean, over all color channels.
      * @param ul is (x,y) of the upper left corner of the square
      * @param dim is log of side length of the square*/
@@ -55,6 +62,14 @@ public:
     /** Given a square, return the number of pixels in the square
      * @param dim is log of side length of the square */
     long rectArea(int dim);
+
+    /** Returns the heap bytes held by the six tables, including the allocator's
+     * overhead of every block (see heapBlockBytes in metrics.h). */
+    size_t footprint() const;
+
+    /** Returns what footprint() is for the tables of a width x height image,
+     * without building them. */
+    static size_t footprint(unsigned int width, unsigned int height);
 };
 
 #endif
@@ -1,19 +1,57 @@
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 
+#include "batch.h"
+#include "cache.h"
 #include "compression/PNG.h"
 #include "compression/RGBAPixel.h"
 #include "compression/catch.hpp"
+#include "compression/lodepng/lodepng.h"
+#include "metrics.h"
 #include "qtcount.h"
+#include "qtcstream.h"
 #include "qtvar.h"
 #include "quadtree.h"
+#include "server.h"
 #include "stats.h"
+#include "trace.h"
 
 using namespace std;
 using namespace compression;
 
+// Builds a deterministic test image with flat areas, gradients and noise,
+// so the tests do not depend on image files.
+static PNG makeTestImage(unsigned int w, unsigned int h) {
+    PNG img(w, h);
+    unsigned int seed = 12345;
+    for (unsigned int x = 0; x < w; x++) {
+        for (unsigned int y = 0; y < h; y++) {
+            RGBAPixel* p = img.getPixel(x, y);
+            seed = seed * 1103515245 + 12345;
+            if (x < w / 2 && y < h / 2) {
+                *p = RGBAPixel(40, 90, 200);
+            } else if (x >= w / 2 && y < h / 2) {
+                *p = RGBAPixel(x % 256, y % 256, (x + y) % 256);
+            } else {
+                *p = RGBAPixel((seed >> 16) % 256, (seed >> 8) % 256, (x * 7) % 256);
+            }
+        }
+    }
+    return img;
+}
+
 TEST_CASE("stats::basic rectArea", "[weight=1][part=stats]") {
     PNG data;
     data.resize(2, 2);
@@ -164,3 +202,985 @@ TEST_CASE("qtvar::basic idealPrune", "[weight=1][part=qtvar]") {
 
     REQUIRE(result == expected);
 }
+
+TEST_CASE("png::inflate round trip", "[weight=1][part=png]") {
+    PNG img = makeTestImage(300, 200);
+    vector<unsigned char> raw;
+    for (unsigned int y = 0; y < img.height(); y++) {
+        for (unsigned int x = 0; x < img.width(); x++) {
+            RGBAPixel* p = img.getPixel(x, y);
+            raw.push_back(p->r);
+            raw.push_back(p->g);
+            raw.push_back(p->b);
+            raw.push_back(255);
+        }
+    }
+    vector<unsigned char> encoded, decoded;
+    REQUIRE(lodepng::encode(encoded, raw, img.width(), img.height()) == 0);
+
+    unsigned int w, h;
+    REQUIRE(lodepng::decode(decoded, w, h, encoded) == 0);
+    REQUIRE(w == img.width());
+    REQUIRE(h == img.height());
+    REQUIRE(decoded == raw);
+}
+
+TEST_CASE("png::crc32 check values", "[weight=1][part=png]") {
+    const unsigned char check[] = "123456789";
+    REQUIRE(lodepng_crc32(check, 9) == 0xCBF43926u);
+
+    // lengths around the vector tail and block boundaries, compared against a bitwise CRC
+    vector<unsigned char> data(12000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (unsigned char)(i * 131 + (i >> 7));
+    }
+    const size_t lengths[] = {0, 1, 15, 16, 17, 63, 64, 255, 256, 257, 333, 5552, 5553, 11104, 12000};
+    for (size_t len : lengths) {
+        unsigned int crc = 0xffffffffu;
+        for (size_t i = 0; i < len; i++) {
+            crc ^= data[i];
+            for (int k = 0; k < 8; k++) {
+                crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+            }
+        }
+        REQUIRE(lodepng_crc32(data.data(), len) == (crc ^ 0xffffffffu));
+    }
+}
+
+// the Adler-32 of a zlib stream is its last four bytes, big-endian
+static unsigned int zlibAdler32(const unsigned char *data, size_t len) {
+    unsigned char *out = NULL;
+    size_t outsize = 0;
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    REQUIRE(lodepng_zlib_compress(&out, &outsize, data, len, &settings) == 0);
+    REQUIRE(outsize >= 4);
+    unsigned int adler = ((unsigned int)out[outsize - 4] << 24) | ((unsigned int)out[outsize - 3] << 16)
+                         | ((unsigned int)out[outsize - 2] << 8) | out[outsize - 1];
+    free(out);
+    return adler;
+}
+
+TEST_CASE("png::adler32 check values", "[weight=1][part=png]") {
+    const unsigned char check[] = "Wikipedia";
+    REQUIRE(zlibAdler32(check, 9) == 0x11E60398u);
+
+    // all 0xff is the worst case for the deferred modulo
+    vector<unsigned char> data(12000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (i & 1) ? 0xff : (unsigned char)(i * 131 + (i >> 7));
+    }
+    vector<unsigned char> ones(12000, 0xff);
+    const size_t lengths[] = {0, 1, 15, 16, 17, 31, 32, 63, 64, 65, 5552, 5553, 11104, 12000};
+    for (const vector<unsigned char> *buf : {&data, &ones}) {
+        for (size_t len : lengths) {
+            unsigned int a = 1, b = 0;
+            for (size_t i = 0; i < len; i++) {
+                a = (a + (*buf)[i]) % 65521u;
+                b = (b + a) % 65521u;
+            }
+            REQUIRE(zlibAdler32(buf->data(), len) == ((b << 16) | a));
+        }
+    }
+}
+
+TEST_CASE("png::fast deflate round trip", "[weight=1][part=png]") {
+    vector<unsigned char> data;
+    for (int i = 0; i < 200000; i++) {
+        // runs, a repeating pattern and pseudo-random bytes
+        if (i < 50000) data.push_back(0);
+        else if (i < 120000) data.push_back((unsigned char)((i / 7) % 256));
+        else data.push_back((unsigned char)((i * 2654435761u) >> 24));
+    }
+    for (unsigned btype = 1; btype <= 2; btype++) {
+        LodePNGCompressSettings settings;
+        lodepng_compress_settings_init(&settings);
+        settings.fastmatch = 1;
+        settings.btype = btype;
+
+        vector<unsigned char> compressed, decompressed;
+        REQUIRE(lodepng::compress(compressed, data, settings) == 0);
+        REQUIRE(compressed.size() < data.size());
+        REQUIRE(lodepng::decompress(decompressed, compressed) == 0);
+        REQUIRE(decompressed == data);
+    }
+}
+
+TEST_CASE("stats::streaming ctor", "[weight=1][part=stats]") {
+    // several times the decoder's flush threshold, so rows arrive over many flushes
+    PNG img = makeTestImage(800, 600);
+    REQUIRE(img.writeToFile("streamtest.png"));
+
+    stats s(img);
+    unsigned int w, h;
+    stats streamed("streamtest.png", w, h);
+    remove("streamtest.png");
+    REQUIRE(w == 800);
+    REQUIRE(h == 600);
+    REQUIRE(streamed.sumRed == s.sumRed);
+    REQUIRE(streamed.sumGreen == s.sumGreen);
+    REQUIRE(streamed.sumBlue == s.sumBlue);
+    REQUIRE(streamed.sumsqRed == s.sumsqRed);
+    REQUIRE(streamed.sumsqGreen == s.sumsqGreen);
+    REQUIRE(streamed.sumsqBlue == s.sumsqBlue);
+    REQUIRE(streamed.getVar(make_pair(64, 64), 6) == s.getVar(make_pair(64, 64), 6));
+    REQUIRE(streamed.getVar(make_pair(0, 0), 9) == s.getVar(make_pair(0, 0), 9));
+    REQUIRE(streamed.getVar(make_pair(544, 344), 8) == s.getVar(make_pair(544, 344), 8));
+
+    // a missing file leaves empty tables
+    stats missing("nosuchfile.png", w, h);
+    REQUIRE(w == 0);
+    REQUIRE(h == 0);
+    REQUIRE(missing.sumRed.empty());
+}
+
+TEST_CASE("png::readFromFile single and split IDAT", "[weight=1][part=png]") {
+    PNG img = makeTestImage(120, 90);
+    REQUIRE(img.writeToFile("idattest.png"));
+    PNG single;
+    REQUIRE(single.readFromFile("idattest.png"));
+    REQUIRE(single == img);
+
+    // rewrite the file with its image data split over two IDAT chunks
+    vector<unsigned char> png, split;
+    REQUIRE(lodepng::load_file(png, "idattest.png") == 0);
+    split.insert(split.end(), png.begin(), png.begin() + 8);
+    for (const unsigned char* chunk = png.data() + 8; chunk < png.data() + png.size();
+         chunk = lodepng_chunk_next_const(chunk, png.data() + png.size())) {
+        unsigned length = lodepng_chunk_length(chunk);
+        if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+            const unsigned char* data = lodepng_chunk_data_const(chunk);
+            size_t outsize = split.size();
+            unsigned char* out = (unsigned char*)malloc(outsize);
+            memcpy(out, split.data(), outsize);
+            REQUIRE(lodepng_chunk_create(&out, &outsize, length / 2, "IDAT", data) == 0);
+            REQUIRE(lodepng_chunk_create(&out, &outsize, length - length / 2, "IDAT", data + length / 2) == 0);
+            split.assign(out, out + outsize);
+            free(out);
+        } else {
+            split.insert(split.end(), chunk, chunk + length + 12);
+        }
+    }
+    REQUIRE(split.size() == png.size() + 12);
+    REQUIRE(lodepng::save_file(split, "idattest.png") == 0);
+    PNG twoChunks;
+    REQUIRE(twoChunks.readFromFile("idattest.png"));
+    remove("idattest.png");
+    REQUIRE(twoChunks == img);
+}
+
+TEST_CASE("qtvar::qtc round trip", "[weight=1][part=qtc]") {
+    PNG img = makeTestImage(256, 256);
+    qtvar t(img);
+    int leaves = t.pruneSize(5000);
+    t.prune(5000);
+    PNG expected = t.render();
+
+    vector<unsigned char> raw;
+    t.encodeQtc(raw, false);
+    // 3 bytes per leaf, less than a byte of structure per leaf, and the header
+    REQUIRE(raw.size() < 13 + 4 * (size_t)leaves);
+    qtvar decodedRaw;
+    REQUIRE(decodedRaw.decodeQtc(raw.data(), raw.size()));
+    REQUIRE(decodedRaw.render() == expected);
+
+    vector<unsigned char> data;
+    t.encodeQtc(data);
+    qtvar decoded;
+    REQUIRE(decoded.decodeQtc(data.data(), data.size()));
+    REQUIRE(decoded.render() == expected);
+
+    REQUIRE(t.writeQtc("qtctest.qtc"));
+    qtvar fromFile;
+    REQUIRE(fromFile.readQtc("qtctest.qtc"));
+    remove("qtctest.qtc");
+    REQUIRE(fromFile.render() == expected);
+
+    // truncated data is rejected and leaves the tree untouched
+    REQUIRE_FALSE(decoded.decodeQtc(data.data(), data.size() - 1));
+    REQUIRE(decoded.render() == expected);
+}
+
+TEST_CASE("qtvar::qtc entropy coding", "[weight=1][part=qtc]") {
+    // smooth gradients: colors are well predicted from the parents
+    PNG img(256, 256);
+    for (unsigned int x = 0; x < 256; x++) {
+        for (unsigned int y = 0; y < 256; y++) {
+            *img.getPixel(x, y) = RGBAPixel(x, (x + y) / 2, 255 - y);
+        }
+    }
+    qtvar t(img);
+    t.prune(200);
+
+    vector<unsigned char> raw, coded;
+    t.encodeQtc(raw, false);
+    t.encodeQtc(coded);
+    REQUIRE(coded.size() * 2 < raw.size());
+
+    qtvar decoded;
+    REQUIRE(decoded.decodeQtc(coded.data(), coded.size()));
+    REQUIRE(decoded.render() == t.render());
+    REQUIRE_FALSE(decoded.decodeQtc(coded.data(), coded.size() / 2));
+}
+
+TEST_CASE("qtvar::qtc progressive stream", "[weight=1][part=qtc]") {
+    PNG img = makeTestImage(256, 256);
+    qtvar t(img);
+    t.prune(2000);
+    PNG expected = t.render();
+
+    vector<unsigned char> data;
+    t.encodeQtcProgressive(data);
+
+    qtvar partial;
+    QtcStreamDecoder stream(partial);
+    size_t firstPaint = 0;
+    for (size_t pos = 0; pos < data.size(); pos += 100) {
+        REQUIRE_FALSE(stream.done());
+        REQUIRE(stream.push(data.data() + pos, min((size_t)100, data.size() - pos)));
+        if (firstPaint == 0 && stream.bytesDecoded() > 0) {
+            firstPaint = pos + 100;
+            // the root alone renders the whole image in its average color
+            REQUIRE(partial.render().width() == 256);
+        }
+    }
+    REQUIRE(firstPaint <= 100);
+    REQUIRE(stream.done());
+    REQUIRE(stream.bytesDecoded() == data.size());
+    REQUIRE(partial.render() == expected);
+
+    qtvar decoded;
+    REQUIRE(decoded.decodeQtc(data.data(), data.size()));
+    REQUIRE(decoded.render() == expected);
+    REQUIRE_FALSE(decoded.decodeQtc(data.data(), data.size() - 1));
+    REQUIRE(decoded.render() == expected);
+
+    // so does a built tree, with its pixel block, and a mapped artifact
+    qtvar built(img);
+    PNG full = built.render();
+    size_t pixelBytes = built.footprint().pixelBytes;
+    REQUIRE(pixelBytes > 0);
+    REQUIRE_FALSE(built.decodeQtc(data.data(), data.size() - 1));
+    REQUIRE(built.footprint().pixelBytes == pixelBytes);
+    REQUIRE(built.render() == full);
+    REQUIRE(built.writeArtifact("streamtest.qta"));
+    qtvar mapped;
+    REQUIRE(mapped.openArtifact("streamtest.qta"));
+    int leaves = mapped.pruneSize(100);
+    REQUIRE(leaves > 0);
+    REQUIRE_FALSE(mapped.decodeQtc(data.data(), data.size() - 1));
+    REQUIRE(mapped.pruneSize(100) == leaves);
+    REQUIRE(mapped.decodeQtc(data.data(), data.size()));
+    REQUIRE(mapped.render() == expected);
+    remove("streamtest.qta");
+}
+
+TEST_CASE("qtvar::qtc region decode", "[weight=1][part=qtc]") {
+    PNG img = makeTestImage(256, 256);
+    qtvar t(img);
+    t.prune(2000);
+    PNG expected = t.render();
+
+    vector<unsigned char> data;
+    t.encodeQtcIndexed(data, 5);
+
+    qtvar full;
+    REQUIRE(full.decodeQtc(data.data(), data.size()));
+    REQUIRE(full.render() == expected);
+
+    // a region across tile borders renders as in the whole tree
+    qtvar region;
+    REQUIRE(region.decodeQtcRegion(data.data(), data.size(), 20, 40, 50, 30));
+    REQUIRE(region.renderRegion(20, 40, 50, 30) == t.renderRegion(20, 40, 50, 30));
+    PNG crop = t.renderRegion(20, 40, 50, 30);
+    REQUIRE(*crop.getPixel(0, 0) == *expected.getPixel(20, 40));
+    REQUIRE(*crop.getPixel(49, 29) == *expected.getPixel(69, 69));
+
+    vector<unsigned char> indexed;
+    t.encodeQtcIndexed(indexed);
+    REQUIRE(lodepng::save_file(indexed, "regiontest.qtc") == 0);
+    qtvar fromFile;
+    REQUIRE(fromFile.readQtcRegion("regiontest.qtc", 200, 200, 56, 56));
+    remove("regiontest.qtc");
+    REQUIRE(fromFile.renderRegion(200, 200, 56, 56) == t.renderRegion(200, 200, 56, 56));
+}
+
+TEST_CASE("qtvar::dedupe", "[weight=1][part=qtc]") {
+    // a 16x16 tile repeated all over the image
+    PNG img(256, 256);
+    for (unsigned int x = 0; x < 256; x++) {
+        for (unsigned int y = 0; y < 256; y++) {
+            int u = x % 16, v = y % 16;
+            *img.getPixel(x, y) = RGBAPixel(u * 16, v * 16, (u * v) % 256);
+        }
+    }
+    qtvar t(img);
+    t.prune(0);
+    PNG expected = t.render();
+    vector<unsigned char> tree;
+    t.encodeQtc(tree);
+
+    // of the 21845 nodes above the pixel leaves
+    REQUIRE(t.dedupe() > 20000);
+    REQUIRE(t.dedupe() == 0);
+    REQUIRE(t.render() == expected);
+
+    vector<unsigned char> dag;
+    t.encodeQtc(dag);
+    REQUIRE(dag.size() * 10 < tree.size());
+
+    qtvar decoded;
+    REQUIRE(decoded.decodeQtc(dag.data(), dag.size()));
+    REQUIRE(decoded.render() == expected);
+    REQUIRE_FALSE(decoded.decodeQtc(dag.data(), dag.size() - 8));
+
+    // copies keep the sharing, and both trees free their nodes on their own
+    qtvar copied(t);
+    t = qtvar();
+    REQUIRE(copied.render() == expected);
+    vector<unsigned char> progressive;
+    copied.encodeQtcProgressive(progressive);
+    qtvar expanded;
+    REQUIRE(expanded.decodeQtc(progressive.data(), progressive.size()));
+    REQUIRE(expanded.render() == expected);
+}
+
+TEST_CASE("batch::manifest pipeline", "[weight=1][part=batch]") {
+    PNG img = makeTestImage(128, 128);
+    REQUIRE(img.writeToFile("batchtest1.png"));
+    REQUIRE(img.writeToFile("batchtest2.png"));
+    FILE* manifest = fopen("batchtest.txt", "w");
+    REQUIRE(manifest != NULL);
+    fputs("# two good jobs and a missing input\n"
+          "batchtest1.png batchtest1.qtc tol=500\n"
+          "\n"
+          "batchtest2.png batchtest2-out.png policy=count leaves=100\n"
+          "missing.png missing.qtc\n",
+          manifest);
+    fclose(manifest);
+
+    vector<BatchJob> jobs;
+    REQUIRE(readManifest("batchtest.txt", BatchJob(), jobs));
+    REQUIRE(jobs.size() == 3);
+    REQUIRE(jobs[1].leaves == 100);
+    REQUIRE_FALSE(jobs[1].var);
+    BatchStats totals = runBatch(jobs, 2);
+    REQUIRE(totals.images == 2);
+    REQUIRE(totals.failed == 1);
+
+    // a budget smaller than any image admits one image at a time
+    size_t footprint = estimateFootprint("batchtest1.png");
+    REQUIRE(footprint == quadtree::buildFootprint(128, 128));
+    REQUIRE(estimateFootprint("missing.png") == 0);
+    REQUIRE(totals.peakMemory == 2 * footprint);
+    totals = runBatch(jobs, 2, footprint / 2);
+    REQUIRE(totals.images == 2);
+    REQUIRE(totals.peakMemory == footprint);
+
+    qtvar expected(img);
+    expected.prune(500);
+    qtvar decoded;
+    REQUIRE(decoded.readQtc("batchtest1.qtc"));
+    REQUIRE(decoded.render() == expected.render());
+    PNG rendered;
+    REQUIRE(rendered.readFromFile("batchtest2-out.png"));
+
+    remove("batchtest1.png");
+    remove("batchtest2.png");
+    remove("batchtest.txt");
+    remove("batchtest1.qtc");
+    remove("batchtest2-out.png");
+}
+
+// a connection to a server that sends nothing by itself
+static int connectRaw(const string& socketPath) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath.c_str());
+    if (fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+TEST_CASE("server::concurrent requests", "[weight=1][part=server]") {
+    PNG img = makeTestImage(128, 128);
+    vector<unsigned char> png;
+    REQUIRE(img.writeToMemory(png));
+    REQUIRE(img.writeToFile("servertest.png"));
+    string socketPath = "servertest.sock";
+    CompressionServer server(socketPath, 2);
+    REQUIRE(server.start());
+
+    qtvar expected(img);
+    expected.prune(500);
+    vector<unsigned char> expectedQtc;
+    expected.encodeQtc(expectedQtc);
+
+    // a file, and the same file in shared memory
+    vector<unsigned char> result;
+    REQUIRE(compressRemote(socketPath, "servertest.png", "tol=500", result));
+    REQUIRE(result == expectedQtc);
+    result.clear();
+    REQUIRE(compressRemote(socketPath, png.data(), png.size(),
+                           "policy=var tol=500", result));
+    REQUIRE(result == expectedQtc);
+    REQUIRE(compressRemote(socketPath, png.data(), png.size(),
+                           "tol=500 format=png", result));
+    PNG rendered;
+    REQUIRE(rendered.readFromMemory(result.data(), result.size()));
+    REQUIRE(rendered == expected.render());
+    REQUIRE_FALSE(compressRemote(socketPath, "missing.png", "", result));
+    REQUIRE_FALSE(compressRemote(socketPath, "servertest.png", "tol=x", result));
+
+    LoadStats load = loadTest(socketPath, "servertest.png", "tol=500", 4, 3);
+    REQUIRE(load.requests == 12);
+    REQUIRE(load.failed == 0);
+    REQUIRE(load.p50 > 0);
+    REQUIRE(load.p99 >= load.p50);
+
+    // idle connections on every worker time out instead of stalling it
+    int idle[2];
+    for (int i = 0; i < 2; i++) {
+        idle[i] = connectRaw(socketPath);
+        REQUIRE(idle[i] >= 0);
+    }
+    string response;
+    REQUIRE(sendRequest(socketPath, "stats", response));
+    REQUIRE(response.compare(0, 6, "ok 17 ") == 0);
+    for (int i = 0; i < 2; i++)
+        close(idle[i]);
+    server.stop();
+    double p50, p99;
+    REQUIRE(server.latency(p50, p99) == 17);
+    REQUIRE_FALSE(sendRequest(socketPath, "stats", response));
+    remove("servertest.png");
+}
+
+TEST_CASE("server::latency histogram", "[weight=1][part=server]") {
+    LatencyHistogram latencies;
+    REQUIRE(latencies.percentile(0.5) == 0);
+    for (int i = 1; i <= 1000; i++)
+        latencies.add(i);
+    latencies.add(0);
+    latencies.add(1e12); // past the last bucket
+    REQUIRE(latencies.count() == 1002);
+    REQUIRE(latencies.percentile(0.5) == Approx(500).epsilon(0.05));
+    REQUIRE(latencies.percentile(0.99) == Approx(990).epsilon(0.05));
+    REQUIRE(latencies.percentile(0) < 1.05);
+}
+
+TEST_CASE("server::slow request", "[weight=1][part=server]") {
+    string socketPath = "slowtest.sock";
+    CompressionServer server(socketPath, 1);
+    REQUIRE(server.start());
+
+    // every byte comes well within the timeout, the whole line does not
+    int fd = connectRaw(socketPath);
+    REQUIRE(fd >= 0);
+    const char request[] = "stats\n";
+    for (int i = 0; i < 6; i++) {
+        usleep(500000);
+        send(fd, request + i, 1, MSG_NOSIGNAL);
+    }
+    char c;
+    REQUIRE(recv(fd, &c, 1, 0) <= 0);
+    close(fd);
+
+    // and the worker is free again
+    string response;
+    REQUIRE(sendRequest(socketPath, "stats", response));
+    REQUIRE(response.compare(0, 5, "ok 0 ") == 0);
+
+    // the result of a client that left before the response is not kept
+    PNG img = makeTestImage(64, 64);
+    REQUIRE(img.writeToFile("slowtest.png"));
+    fd = connectRaw(socketPath);
+    REQUIRE(fd >= 0);
+    const char compress[] = "compress slowtest.png\n";
+    REQUIRE(send(fd, compress, sizeof(compress) - 1, MSG_NOSIGNAL) ==
+            (ssize_t)sizeof(compress) - 1);
+    close(fd);
+    server.stop();
+    remove("slowtest.png");
+    string leaked = "/dev/shm/qtcd-" + to_string(getpid()) + "-0";
+    struct stat info;
+    REQUIRE(stat(leaked.c_str(), &info) != 0);
+}
+
+static string sha256Hex(const string &text) {
+    unsigned char digest[32];
+    sha256((const unsigned char *)text.data(), text.size(), digest);
+    string hex;
+    for (int i = 0; i < 32; i++) {
+        hex += "0123456789abcdef"[digest[i] >> 4];
+        hex += "0123456789abcdef"[digest[i] & 15];
+    }
+    return hex;
+}
+
+TEST_CASE("cache::sha256 check values", "[weight=1][part=cache]") {
+    REQUIRE(sha256Hex("") ==
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    REQUIRE(sha256Hex("abc") ==
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    // the padding spills into a second block
+    REQUIRE(sha256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    REQUIRE(sha256Hex(string(1000000, 'a')) ==
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST_CASE("cache::lru and disk", "[weight=1][part=cache]") {
+    unsigned char source[100];
+    for (int i = 0; i < 100; i++)
+        source[i] = i;
+    BatchJob job;
+    string key = ResultCache::key(source, 100, job, false);
+    REQUIRE(key.compare(0, 3, "v2-") == 0);
+    REQUIRE(key == ResultCache::key(source, 100, job, false));
+    REQUIRE(key != ResultCache::key(source, 100, job, true));
+    REQUIRE(key != ResultCache::key(source, 99, job, false));
+    source[50]++;
+    REQUIRE(key != ResultCache::key(source, 100, job, false));
+    job.tol++;
+    REQUIRE(ResultCache::key(source, 100, job, false) !=
+            ResultCache::key(source, 100, BatchJob(), false));
+
+    mkdir("cachetest", 0700);
+    vector<unsigned char> a(40, 'a'), b(40, 'b'), c(40, 'c'), out;
+    {
+        ResultCache cache(100, "cachetest");
+        REQUIRE_FALSE(cache.get("a", out));
+        cache.put("a", a);
+        cache.put("b", b);
+        REQUIRE(cache.get("a", out));
+        REQUIRE(out == a);
+        cache.put("c", c); // evicts b, the least recently used
+        CacheStats counters = cache.stats();
+        REQUIRE(counters.evictions == 1);
+        REQUIRE(counters.entries == 2);
+        REQUIRE(counters.bytes == 80);
+        REQUIRE(cache.get("b", out)); // from disk
+        REQUIRE(out == b);
+        counters = cache.stats();
+        REQUIRE(counters.hits == 2);
+        REQUIRE(counters.diskHits == 1);
+        REQUIRE(counters.misses == 1);
+    }
+    // a new cache on the same directory
+    ResultCache reopened(100, "cachetest");
+    REQUIRE(reopened.get("c", out));
+    REQUIRE(out == c);
+    remove("cachetest/a");
+    remove("cachetest/b");
+    remove("cachetest/c");
+    rmdir("cachetest");
+}
+
+TEST_CASE("server::cached requests", "[weight=1][part=cache]") {
+    PNG img = makeTestImage(128, 128);
+    vector<unsigned char> png;
+    REQUIRE(img.writeToMemory(png));
+    ResultCache cache(1 << 20);
+    CompressionServer server("cachetest.sock", 2, &cache);
+    REQUIRE(server.start());
+    vector<unsigned char> first, second, other;
+    REQUIRE(compressRemote("cachetest.sock", png.data(), png.size(), "tol=500", first));
+    REQUIRE(compressRemote("cachetest.sock", png.data(), png.size(), "tol=500", second));
+    REQUIRE(compressRemote("cachetest.sock", png.data(), png.size(), "tol=5000", other));
+    REQUIRE(first == second);
+    REQUIRE(first != other);
+    string response;
+    REQUIRE(sendRequest("cachetest.sock", "stats", response));
+    REQUIRE(response.substr(response.size() - 6) == " 1 2 0");
+    server.stop();
+}
+
+TEST_CASE("quadtree::build artifact", "[weight=1][part=artifact]") {
+    PNG img = makeTestImage(256, 256);
+    qtvar var(img);
+    qtcount count(img);
+    REQUIRE(var.writeArtifact("vartest.qta"));
+    REQUIRE(count.writeArtifact("counttest.qta"));
+
+    qtvar mappedVar;
+    qtcount mappedCount;
+    REQUIRE(mappedVar.openArtifact("vartest.qta"));
+    REQUIRE(mappedCount.openArtifact("counttest.qta"));
+    REQUIRE_FALSE(mappedVar.openArtifact("counttest.qta"));
+
+    // records that do not nest are rejected: a wrong size or dim of the
+    // first child, in 24-byte records after a 64-byte header
+    vector<unsigned char> data;
+    REQUIRE(lodepng::load_file(data, "vartest.qta") == 0);
+    size_t offsets[] = {64 + 24 + 4, 64 + 24 + 3};
+    for (size_t offset : offsets) {
+        vector<unsigned char> corrupt = data;
+        corrupt[offset] = offset % 24 == 3 ? corrupt[offset] + 1 : 0;
+        REQUIRE(lodepng::save_file(corrupt, "corrupttest.qta") == 0);
+        qtvar rejected;
+        REQUIRE_FALSE(rejected.openArtifact("corrupttest.qta"));
+    }
+    remove("corrupttest.qta");
+    int tols[] = {0, 1, 500, 5000, 100000};
+    for (int tol : tols) {
+        REQUIRE(mappedVar.pruneSize(tol) == var.pruneSize(tol));
+        REQUIRE(mappedCount.pruneSize(tol) == count.pruneSize(tol));
+    }
+    REQUIRE(mappedVar.idealPrune(1000) == var.idealPrune(1000));
+    REQUIRE(mappedCount.idealPrune(1000) == count.idealPrune(1000));
+    REQUIRE(mappedVar.render() == var.render());
+
+    // a copy maps the artifact again
+    qtcount copied(mappedCount);
+    mappedVar.prune(5000);
+    mappedCount.prune(500);
+    copied.prune(2000);
+    var.prune(5000);
+    REQUIRE(mappedVar.render() == var.render());
+    REQUIRE(mappedVar.pruneSize(10000) == var.pruneSize(10000));
+    qtcount expected(img);
+    expected.prune(2000);
+    REQUIRE(copied.render() == expected.render());
+    count.prune(500);
+    REQUIRE(mappedCount.render() == count.render());
+
+    remove("vartest.qta");
+    remove("counttest.qta");
+}
+
+TEST_CASE("metrics::counters", "[weight=1][part=metrics]") {
+    PNG img = makeTestImage(64, 64);
+    metrics().reset();
+    {
+        qtcount count(img);
+        count.prune(count.idealPrune(100));
+        count.render();
+    }
+    Metrics m = metrics();
+    if (!metricsEnabled()) {
+        REQUIRE(m.nodesAllocated == 0);
+        REQUIRE(m.toJson().find("\"prunableCalls\": 0") != string::npos);
+        return;
+    }
+    // a full tree of a 64x64 image above its pixel leaves, all freed with it
+    REQUIRE(m.nodesAllocated == (64 * 64 - 1) / 3);
+    REQUIRE(m.nodesFreed == m.nodesAllocated);
+    REQUIRE(m.prunableCalls > 0);
+    REQUIRE(m.checkLeafVisits > m.prunableCalls);
+    REQUIRE(m.idealPruneIterations > 0);
+    REQUIRE(m.bytes[PHASE_STATS] > 0);
+    REQUIRE(m.bytes[PHASE_BUILD] >= m.nodesAllocated * sizeof(int));
+    REQUIRE(m.bytes[PHASE_RENDER] >= 64 * 64 * sizeof(RGBAPixel));
+    REQUIRE(m.seconds[PHASE_BUILD] > 0);
+}
+
+TEST_CASE("trace::batch spans", "[weight=1][part=trace]") {
+    PNG img = makeTestImage(128, 64);
+    REQUIRE(img.writeToFile("tracetest.png"));
+    vector<BatchJob> jobs(2);
+    jobs[0].input = jobs[1].input = "tracetest.png";
+    jobs[0].output = "tracetest.qtc";
+    jobs[1].output = "tracetest-out.png";
+
+    REQUIRE(startTrace("tracetest.json"));
+    REQUIRE_FALSE(startTrace("other.json"));
+    REQUIRE(tracing());
+    REQUIRE(runBatch(jobs, 2).images == 2);
+    REQUIRE(stopTrace());
+    REQUIRE_FALSE(tracing());
+
+    vector<unsigned char> data;
+    REQUIRE(lodepng::load_file(data, "tracetest.json") == 0);
+    string json(data.begin(), data.end());
+    const char* spans[] = {"decode", "stats", "build", "prune", "render",
+                           "encode", "save"};
+    for (const char* span : spans)
+        REQUIRE(json.find(string("\"name\": \"") + span + "\"") != string::npos);
+    REQUIRE(json.find("\"image\": \"tracetest.png\", \"width\": 128, "
+                      "\"height\": 64") != string::npos);
+    REQUIRE(json.find("\"ph\": \"X\"") != string::npos);
+
+    remove("tracetest.png");
+    remove("tracetest.qtc");
+    remove("tracetest-out.png");
+    remove("tracetest.json");
+}
+
+TEST_CASE("memory::footprint", "[weight=1][part=memory]") {
+#ifdef __GLIBC__
+    size_t sizes[] = {1, 24, 72, 1000, 4096};
+    for (size_t size : sizes) {
+        char* block = new char[size];
+        // malloc may hand out a larger free block than it would carve
+        REQUIRE(heapBlockBytes(size) >= size + sizeof(size_t));
+        REQUIRE(heapBlockBytes(size) % 16 == 0);
+        REQUIRE(heapBlockBytes(size) <= malloc_usable_size(block) + sizeof(size_t));
+        delete[] block;
+    }
+#endif
+    PNG img = makeTestImage(80, 64);
+    REQUIRE(img.footprint() == PNG::footprint(80, 64));
+    REQUIRE(PNG().footprint() == 0);
+    stats s(img);
+    REQUIRE(s.footprint() == stats::footprint(80, 64));
+
+    qtvar tree(img);
+    TreeFootprint full = tree.footprint();
+    REQUIRE(full.nodes == (64 * 64 - 1) / 3);
+    REQUIRE(full.pixelLeaves == 64 * 64);
+    REQUIRE(full.nodesByLevel.size() == 6);
+    for (size_t level = 0; level < full.nodesByLevel.size(); level++)
+        REQUIRE(full.nodesByLevel[level] == (size_t)1 << (2 * level));
+    REQUIRE(full.pixelBytes == heapBlockBytes(3 * 64 * 64));
+    REQUIRE(full.bytes == full.nodes * full.nodeBytes + full.pixelBytes);
+    REQUIRE(quadtree::buildFootprint(80, 64) ==
+            img.footprint() + s.footprint() + full.bytes);
+
+    tree.prune(tree.idealPrune(100));
+    REQUIRE(tree.footprint().nodes < full.nodes);
+    REQUIRE(tree.footprint().nodesByLevel[0] == 1);
+    REQUIRE(residentBytes() > 0);
+    REQUIRE(peakResidentBytes() >= residentBytes());
+
+    // the peak keeps a block that was touched and given back
+    size_t before = residentBytes();
+    vector<char> *block = new vector<char>(64 << 20, 1);
+    size_t touched = residentBytes();
+    delete block;
+    REQUIRE(touched > before);
+    REQUIRE(peakResidentBytes() >= touched);
+}
+
+TEST_CASE("quadtree::prune to leaves", "[weight=1][part=leaves]") {
+    PNG img = makeTestImage(128, 128);
+    qtcount count(img);
+    qtvar var(img);
+    // a qtcount leaf is always prunable, so pruneSize(INT_MIN) counts leaves
+    REQUIRE(count.pruneToLeaves(1000) == 1000);
+    REQUIRE(count.pruneSize(INT_MIN) == 1000);
+    REQUIRE(count.pruneToLeaves(500) == 499);
+    REQUIRE(count.pruneSize(INT_MIN) == 499);
+    REQUIRE(count.pruneToLeaves(1000) == 499);
+    REQUIRE(count.pruneToLeaves(0) == 1);
+
+    // whatever the policy
+    REQUIRE(var.pruneToLeaves(1000) == 1000);
+    TreeFootprint pruned = var.footprint();
+    REQUIRE(pruned.nodes + pruned.pixelLeaves == 1 + 1000 / 3 * 4);
+
+    // a tree shared by dedupe is left alone
+    PNG blank(64, 64);
+    qtcount shared(blank);
+    REQUIRE(shared.dedupe() > 0);
+    REQUIRE(shared.pruneToLeaves(10) == -1);
+    REQUIRE(shared.render() == blank);
+}
+
+TEST_CASE("quadtree::optimal prune", "[weight=1][part=optimal]") {
+    PNG img = makeTestImage(128, 128);
+    qtvar full(img);
+    REQUIRE(full.distortion() == Approx(0).margin(1e-6));
+
+    qtvar optimal(img);
+    double lambda = optimal.idealLambda(1000);
+    int leaves = optimal.optimalPruneSize(lambda);
+    REQUIRE(leaves <= 1000);
+    REQUIRE(leaves > 900);
+    REQUIRE(optimal.optimalPruneSize(lambda * 0.99) > 1000);
+    optimal.optimalPrune(lambda);
+    TreeFootprint pruned = optimal.footprint();
+    REQUIRE(pruned.nodes + pruned.pixelLeaves == 1 + (size_t)(leaves - 1) / 3 * 4);
+
+    // the distortion is the squared error of the render, but for the
+    // rounding of the avg to a pixel
+    PNG rendered = optimal.render();
+    double error = 0;
+    for (unsigned int x = 0; x < 128; x++) {
+        for (unsigned int y = 0; y < 128; y++) {
+            RGBAPixel* a = img.getPixel(x, y);
+            RGBAPixel* b = rendered.getPixel(x, y);
+            error += (a->r - b->r) * (a->r - b->r) + (a->g - b->g) * (a->g - b->g) +
+                     (a->b - b->b) * (a->b - b->b);
+        }
+    }
+    REQUIRE(optimal.distortion() <= error + 1e-6);
+    REQUIRE(error <= optimal.distortion() + 128 * 128 * 3 * 0.25 + 1e-6);
+
+    // no cut with as few leaves has less distortion
+    qtvar greedy(img);
+    REQUIRE(greedy.pruneToLeaves(leaves) <= leaves);
+    REQUIRE(optimal.distortion() <= greedy.distortion() + 1e-6);
+    qtvar byTolerance(img);
+    byTolerance.prune(byTolerance.idealPrune(leaves));
+    REQUIRE(optimal.distortion() <= byTolerance.distortion() + 1e-6);
+}
+
+TEST_CASE("quadtree::prune to quality", "[weight=1][part=quality]") {
+    PNG img = makeTestImage(128, 128);
+    qtvar tree(img);
+    REQUIRE(std::isinf(tree.qualityOf(0)));
+    double quality = tree.qualityOf(5000);
+    REQUIRE(quality < tree.qualityOf(500));
+
+    // the PSNR of the render, less the rounding of the avg to a pixel
+    qtvar pruned(tree);
+    pruned.prune(5000);
+    REQUIRE(pruned.qualityOf(INT_MIN) == Approx(quality));
+    PNG rendered = pruned.render();
+    double error = 0;
+    for (unsigned int x = 0; x < 128; x++) {
+        for (unsigned int y = 0; y < 128; y++) {
+            RGBAPixel* a = img.getPixel(x, y);
+            RGBAPixel* b = rendered.getPixel(x, y);
+            error += (a->r - b->r) * (a->r - b->r) + (a->g - b->g) * (a->g - b->g) +
+                     (a->b - b->b) * (a->b - b->b);
+        }
+    }
+    double renderedQuality = 10 * log10(255.0 * 255.0 * 3 * 128 * 128 / error);
+    REQUIRE(renderedQuality <= quality + 1e-9);
+    REQUIRE(renderedQuality > quality - 0.5);
+
+    qtvar high(tree);
+    qtvar low(tree);
+    int highLeaves = high.pruneToQuality(35);
+    int lowLeaves = low.pruneToQuality(25);
+    REQUIRE(high.qualityOf(INT_MIN) >= 35);
+    REQUIRE(low.qualityOf(INT_MIN) >= 25);
+    REQUIRE(lowLeaves < highLeaves);
+    REQUIRE(highLeaves < 128 * 128);
+    // fewer leaves than the tolerance prune of the same quality
+    int tol = 0;
+    while (tree.qualityOf(tol + 100) >= 35)
+        tol += 100;
+    REQUIRE(highLeaves <= tree.pruneSize(tol));
+}
+
+TEST_CASE("quadtree::prune to bytes", "[weight=1][part=budget]") {
+    PNG img = makeTestImage(128, 128);
+    qtvar tree(img);
+    int tols[] = {0, 1000, 10000, 100000};
+    for (int tol : tols) {
+        qtvar pruned(tree);
+        pruned.prune(tol);
+        vector<unsigned char> raw, coded;
+        pruned.encodeQtc(raw, false);
+        pruned.encodeQtc(coded);
+        REQUIRE(tree.estimateQtcBytes(tol, false) == raw.size());
+        REQUIRE(tree.estimateQtcBytes(tol) < 2 * coded.size());
+        REQUIRE(coded.size() < 2 * tree.estimateQtcBytes(tol));
+    }
+
+    // the raw estimate is exact, so the search finds the tolerance
+    qtvar sized(tree);
+    sized.prune(2000);
+    vector<unsigned char> out;
+    sized.encodeQtc(out, false);
+    qtvar raw(tree);
+    int tol = raw.pruneToBytes(out.size(), false);
+    REQUIRE(tol >= 0);
+    REQUIRE(tol <= 2000);
+    raw.encodeQtc(out, false);
+    REQUIRE(out.size() <= sized.estimateQtcBytes(INT_MIN, false));
+
+    size_t budgets[] = {200, 2000, 20000};
+    for (size_t budget : budgets) {
+        qtvar coded(tree);
+        REQUIRE(coded.pruneToBytes(budget) >= 0);
+        coded.encodeQtc(out);
+        REQUIRE(out.size() <= budget);
+        REQUIRE(out.size() > budget / 2);
+        qtvar rendered(tree);
+        REQUIRE(rendered.pruneToPngBytes(10 * budget) >= 0);
+        REQUIRE(rendered.render().writeToMemory(out));
+        REQUIRE(out.size() <= 10 * budget);
+    }
+
+    // no prune fits: the tree is unchanged
+    qtvar tooSmall(tree);
+    REQUIRE(tooSmall.pruneToBytes(10) == -1);
+    REQUIRE(tooSmall.pruneSize(0) == tree.pruneSize(0));
+
+    // a mapped artifact is searched without building the tree
+    REQUIRE(tree.writeArtifact("budgettest.qta"));
+    qtvar mapped(img);
+    REQUIRE(mapped.openArtifact("budgettest.qta"));
+    REQUIRE(mapped.estimateQtcBytes(3000) == tree.estimateQtcBytes(3000));
+    REQUIRE(mapped.estimatePngBytes(3000) == tree.estimatePngBytes(3000));
+    qtvar inMemory(tree);
+    REQUIRE(mapped.pruneToBytes(2000) == inMemory.pruneToBytes(2000));
+    remove("budgettest.qta");
+}
+
+TEST_CASE("quadtree::build with a floor", "[weight=1][part=floor]") {
+    PNG img = makeTestImage(128, 128);
+    REQUIRE(img.writeToFile("floortest.png"));
+    size_t fullNodes = qtvar(img).footprint().nodes;
+    int tols[] = {100, 1000, 10000};
+    for (int tol : tols) {
+        qtvar full(img);
+        full.prune(tol);
+        qtvar floor(img, tol);
+        REQUIRE(floor.footprint().nodes < fullNodes);
+        qtvar streamed("floortest.png", tol);
+        REQUIRE(streamed.footprint().nodes == floor.footprint().nodes);
+
+        // the same tree once pruned at the floor or above
+        floor.prune(tol);
+        vector<unsigned char> expected, actual;
+        full.encodeQtc(expected);
+        floor.encodeQtc(actual);
+        REQUIRE(actual == expected);
+        qtvar coarser(img);
+        coarser.prune(2 * tol);
+        floor.prune(2 * tol);
+        coarser.encodeQtc(expected);
+        floor.encodeQtc(actual);
+        REQUIRE(actual == expected);
+    }
+    remove("floortest.png");
+}
+
+TEST_CASE("quadtree::implicit pixel leaves", "[weight=1][part=pixels]") {
+    PNG img = makeTestImage(128, 128);
+    qtcount packed(img);
+    TreeFootprint footprint = packed.footprint();
+    REQUIRE(footprint.nodes == (128 * 128 - 1) / 3);
+    REQUIRE(footprint.pixelLeaves == 128 * 128);
+
+    // a decoded tree allocates its pixel leaves; qtcount only reads the
+    // avg, so both prune the same
+    vector<unsigned char> data;
+    packed.encodeQtc(data);
+    qtcount decoded;
+    REQUIRE(decoded.decodeQtc(data.data(), data.size()));
+    REQUIRE(decoded.footprint().nodes == footprint.nodes + footprint.pixelLeaves);
+    REQUIRE(decoded.render() == packed.render());
+    vector<unsigned char> expected, actual;
+    decoded.encodeQtc(expected, false);
+    packed.encodeQtc(actual, false);
+    REQUIRE(actual == expected);
+    decoded.encodeQtcProgressive(expected);
+    packed.encodeQtcProgressive(actual);
+    REQUIRE(actual == expected);
+
+    int tols[] = {0, 100, 1000};
+    for (int tol : tols)
+        REQUIRE(packed.pruneSize(tol) == decoded.pruneSize(tol));
+    qtcount copy(packed);
+    copy.prune(100);
+    decoded.prune(100);
+    REQUIRE(copy.render() == decoded.render());
+    copy.encodeQtc(actual);
+    decoded.encodeQtc(expected);
+    REQUIRE(actual == expected);
+
+    // the pixel block goes with the last packed node
+    copy.prune(100000);
+    REQUIRE(copy.footprint().pixelBytes == 0);
+    REQUIRE(packed.footprint().pixelBytes > 0);
+}
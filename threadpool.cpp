@@ -0,0 +1,62 @@
+/**
+ *
+ * threadpool.cpp
+ *
+ */
+#include "threadpool.h"
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+    : submitted(0), running(0), stopping(false) {
+  if (numThreads == 0)
+    numThreads = max(1u, thread::hardware_concurrency());
+  for (unsigned int i = 0; i < numThreads; i++)
+    workers.push_back(thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  available.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+void ThreadPool::submit(const function<void()> &task, int priority) {
+  {
+    lock_guard<mutex> guard(lock);
+    Task t = {priority, submitted++, task};
+    tasks.push(t);
+  }
+  available.notify_one();
+}
+
+void ThreadPool::wait() {
+  unique_lock<mutex> guard(lock);
+  while (!tasks.empty() || running > 0)
+    idle.wait(guard);
+}
+
+unsigned int ThreadPool::size() const { return workers.size(); }
+
+void ThreadPool::work() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    while (tasks.empty() && !stopping)
+      available.wait(guard);
+    if (tasks.empty())
+      return;
+    function<void()> task = tasks.top().run;
+    tasks.pop();
+    running++;
+    guard.unlock();
+    task();
+    guard.lock();
+    running--;
+    if (tasks.empty() && running == 0)
+      idle.notify_all();
+  }
+}
@@ -0,0 +1,84 @@
+/**
+ *
+ * threadpool.h
+ * Fixed set of worker threads running prioritized tasks.
+ *
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * ThreadPool: runs the submitted tasks on a fixed number of worker
+ * threads. Tasks may submit further tasks. Among the waiting tasks, those
+ * of higher priority run first, and tasks of equal priority run in the
+ * order they were submitted.
+ */
+class ThreadPool {
+public:
+    /**
+     * Starts the worker threads.
+     * @param numThreads Number of threads; 0 for one per hardware thread.
+     */
+    ThreadPool(unsigned int numThreads = 0);
+
+    /**
+     * Runs the tasks still waiting, then stops the threads.
+     */
+    ~ThreadPool();
+
+    /**
+     * Queues a task.
+     * @param task The task; it must not throw.
+     * @param priority Tasks of higher priority run first.
+     */
+    void submit(const function<void()> &task, int priority = 0);
+
+    /**
+     * Blocks until no task is waiting or running, including the tasks
+     * submitted by tasks.
+     */
+    void wait();
+
+    /**
+     * @return the number of worker threads.
+     */
+    unsigned int size() const;
+
+private:
+    ThreadPool(const ThreadPool &other);
+    ThreadPool &operator=(const ThreadPool &other);
+
+    struct Task {
+        int priority;
+        unsigned long order; // submission number, to keep FIFO order
+        function<void()> run;
+        bool operator<(const Task &other) const {
+            if (priority != other.priority)
+                return priority < other.priority;
+            return order > other.order;
+        }
+    };
+
+    void work();
+
+    vector<thread> workers;
+    priority_queue<Task> tasks;
+    mutex lock;
+    condition_variable available; // a task was queued, or the pool stops
+    condition_variable idle;      // no task is waiting or running
+    unsigned long submitted;
+    unsigned int running;
+    bool stopping;
+};
+
+#endif
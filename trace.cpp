@@ -0,0 +1,179 @@
+/**
+ *
+ * trace.cpp
+ *
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+using namespace std;
+
+namespace {
+struct TraceEvent {
+  const char *name;
+  int64_t start; // nanoseconds since the trace started
+  int64_t duration;
+  int image;     // index in the images of the thread, or -1
+  unsigned int width, height;
+};
+
+// The spans of one thread. Only its thread appends to it; buffers are
+// never freed, so a trace outlives the threads of the pools that made it.
+struct ThreadTrace {
+  int id;
+  vector<TraceEvent> events;
+  vector<string> images;
+  ThreadTrace *next;
+};
+
+atomic<bool> enabled(false);
+// the buffers of every thread that recorded a span, newest first
+atomic<ThreadTrace *> buffers(NULL);
+atomic<int> nextThreadId(1);
+chrono::steady_clock::time_point origin;
+string traceFile;
+mutex fileLock; // guards traceFile against concurrent start and stop
+
+thread_local ThreadTrace *local = NULL;
+// the image tagging the spans of the thread
+thread_local int currentImage = -1;
+thread_local unsigned int currentWidth = 0;
+thread_local unsigned int currentHeight = 0;
+
+int64_t now() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now() - origin).count();
+}
+
+ThreadTrace *threadTrace() {
+  if (local == NULL) {
+    local = new ThreadTrace();
+    local->id = nextThreadId++;
+    local->next = buffers.load();
+    while (!buffers.compare_exchange_weak(local->next, local))
+      ;
+  }
+  return local;
+}
+
+void writeString(ostream &out, const string &s) {
+  out << '"';
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      out << '\\' << s[i];
+    else if ((unsigned char)s[i] < 0x20)
+      out << ' ';
+    else
+      out << s[i];
+  }
+  out << '"';
+}
+
+void stopAtExit() { stopTrace(); }
+}
+
+bool startTrace(const string &fileName) {
+  static bool registered = false;
+  lock_guard<mutex> guard(fileLock);
+  if (enabled)
+    return false;
+  for (ThreadTrace *t = buffers; t != NULL; t = t->next) {
+    t->events.clear();
+    t->images.clear();
+  }
+  currentImage = -1;
+  traceFile = fileName;
+  origin = chrono::steady_clock::now();
+  if (!registered) {
+    atexit(stopAtExit);
+    registered = true;
+  }
+  enabled = true;
+  return true;
+}
+
+bool stopTrace() {
+  lock_guard<mutex> guard(fileLock);
+  if (!enabled)
+    return true;
+  enabled = false;
+  ofstream out(traceFile.c_str());
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  for (ThreadTrace *t = buffers; t != NULL; t = t->next) {
+    out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+        << "\"pid\": 1, \"tid\": " << t->id
+        << ", \"args\": {\"name\": \"thread " << t->id << "\"}}";
+    first = false;
+    for (size_t i = 0; i < t->events.size(); i++) {
+      const TraceEvent &e = t->events[i];
+      // timestamps are in microseconds
+      out << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"qtc\", "
+          << "\"ph\": \"X\", \"pid\": 1, \"tid\": " << t->id
+          << ", \"ts\": " << e.start / 1000 << "." << e.start % 1000 / 100
+          << ", \"dur\": " << e.duration / 1000 << "."
+          << e.duration % 1000 / 100;
+      // images recorded before a restart of the trace are gone
+      if (e.image >= 0 && e.image < (int)t->images.size()) {
+        out << ", \"args\": {\"image\": ";
+        writeString(out, t->images[e.image]);
+        out << ", \"width\": " << e.width << ", \"height\": " << e.height
+            << "}";
+      }
+      out << "}";
+    }
+  }
+  out << "\n]}" << endl;
+  if (!out) {
+    cerr << "trace: can not write " << traceFile << endl;
+    return false;
+  }
+  return true;
+}
+
+bool tracing() { return enabled.load(memory_order_relaxed); }
+
+TraceSpan::TraceSpan(const char *name)
+    : name(name), start(tracing() ? now() : -1) {}
+
+TraceSpan::~TraceSpan() {
+  if (start < 0 || !tracing())
+    return;
+  TraceEvent event;
+  event.name = name;
+  event.start = start;
+  event.duration = now() - start;
+  event.image = currentImage;
+  event.width = currentWidth;
+  event.height = currentHeight;
+  threadTrace()->events.push_back(event);
+}
+
+TraceImage::TraceImage(const string &name, unsigned int width,
+                       unsigned int height)
+    : outerImage(currentImage), outerWidth(currentWidth),
+      outerHeight(currentHeight) {
+  if (!tracing())
+    return;
+  ThreadTrace *t = threadTrace();
+  currentImage = t->images.size();
+  t->images.push_back(name);
+  currentWidth = width;
+  currentHeight = height;
+}
+
+TraceImage::~TraceImage() {
+  currentImage = outerImage;
+  currentWidth = outerWidth;
+  currentHeight = outerHeight;
+}
+
+void TraceImage::setSize(unsigned int width, unsigned int height) {
+  currentWidth = width;
+  currentHeight = height;
+}
@@ -0,0 +1,83 @@
+/**
+ *
+ * trace.h
+ * Timeline of the compression stages, exported as Chrome trace events.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/**
+ * Starts recording spans, for every thread, until stopTrace or the exit of
+ * the process. The result is a JSON file in the Chrome trace-event format,
+ * which chrome://tracing and ui.perfetto.dev open: one row per thread, one
+ * bar per span, tagged with the image it worked on.
+ * @param fileName The JSON file to write.
+ * @return false, if a trace is already being recorded.
+ */
+bool startTrace(const string &fileName);
+
+/**
+ * Stops recording and writes the trace file. It must not run while other
+ * threads record spans; call it once the pool that ran them is idle.
+ * @return false, if the file can not be written.
+ */
+bool stopTrace();
+
+/**
+ * @return true, while a trace is being recorded.
+ */
+bool tracing();
+
+/**
+ * TraceSpan: records its scope as a span of the calling thread, if a trace
+ * is being recorded; otherwise it costs a load of a flag. Spans are kept
+ * in a buffer of their thread, so recording takes no lock.
+ */
+class TraceSpan {
+public:
+    /**
+     * @param name Name of the span; a string literal, as it is not copied.
+     */
+    TraceSpan(const char *name);
+    ~TraceSpan();
+
+private:
+    TraceSpan(const TraceSpan &other);
+    TraceSpan &operator=(const TraceSpan &other);
+
+    const char *name;
+    int64_t start; // nanoseconds since the trace started; -1 when not tracing
+};
+
+/**
+ * TraceImage: tags the spans that the calling thread ends in its scope with
+ * the name and size of an image, so the spans of the library (decode,
+ * stats, build, ...) tell which image of a batch they worked on.
+ */
+class TraceImage {
+public:
+    TraceImage(const string &name, unsigned int width = 0,
+               unsigned int height = 0);
+    ~TraceImage();
+
+    /**
+     * Sets the size of the current image of the calling thread, once known.
+     */
+    static void setSize(unsigned int width, unsigned int height);
+
+private:
+    TraceImage(const TraceImage &other);
+    TraceImage &operator=(const TraceImage &other);
+
+    int outerImage; // the tag of the enclosing TraceImage, restored after
+    unsigned int outerWidth, outerHeight;
+};
+
+#endif